@@ -0,0 +1,180 @@
+/**
+ * Count the heap allocations of the request path.
+ *
+ * Sets up the private and backup modules the way mammutfs does, without
+ * mounting anything, and calls getattr, read and write on an open file in a
+ * loop - exactly what the fuse engines do for every request. After a warmup
+ * (the scratch arenas grow to their working size) no request may allocate
+ * anymore.
+ *
+ *     ./alloc_bench [memory|posix] [iterations]
+ *
+ * The memory storage measures mammutfs alone, posix includes the syscalls on
+ * a temporary raid. The exit status is 1 if any request allocated.
+ */
+#include "mammut_config.h"
+#include "communicator.h"
+#include "resolver.h"
+
+#include "module/backup.h"
+#include "module/default.h"
+#include "module/private.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <new>
+#include <vector>
+
+#include <fcntl.h>
+#include <pwd.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static std::atomic<size_t> allocations { 0 };
+
+void *operator new(size_t size) {
+	allocations++;
+	void *p = malloc(size == 0 ? 1 : size);
+	if (p == nullptr) {
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+void *operator new[](size_t size) {
+	return operator new(size);
+}
+
+void operator delete(void *p) noexcept {
+	free(p);
+}
+
+void operator delete[](void *p) noexcept {
+	free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+	free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept {
+	free(p);
+}
+
+using namespace mammutfs;
+
+static void measure(const char *name, size_t iterations, const std::function<void()> &op) {
+	// Warm up the arenas of this thread
+	for (int i = 0; i < 100; ++i) {
+		op();
+	}
+
+	size_t before = allocations;
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < iterations; ++i) {
+		op();
+	}
+	auto end = std::chrono::steady_clock::now();
+	size_t count = allocations - before;
+
+	double ns = std::chrono::duration<double, std::nano>(end - start).count() / iterations;
+	std::cout << name << ": " << ns << " ns/op, "
+	          << static_cast<double>(count) / iterations << " allocations/op" << std::endl;
+	if (count != 0) {
+		std::exit(1);
+	}
+}
+
+int main(int argc, char **argv) {
+	std::string storage = argc > 1 ? argv[1] : "memory";
+	size_t iterations = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 100000;
+
+	char tmpl[] = "/tmp/mammutfs-alloc-bench-XXXXXX";
+	if (mkdtemp(tmpl) == nullptr) {
+		perror("mkdtemp");
+		return 2;
+	}
+	std::string dir = tmpl;
+	std::string user = getpwuid(getuid())->pw_name;
+
+	std::string raid = dir + "/raid";
+	if (storage == "posix") {
+		for (const char *sub : { "/raid", "/raid/private", "/raid/backup" }) {
+			::mkdir((dir + sub).c_str(), 0755);
+		}
+		::mkdir((raid + "/private/" + user).c_str(), 0755);
+		::mkdir((raid + "/backup/" + user).c_str(), 0755);
+	}
+
+	std::string cfgfile = dir + "/bench.cfg";
+	{
+		std::ofstream cfg(cfgfile);
+		cfg << "raids = [ \"" << raid << "\" ];\n"
+		    << "mountpoint = \"" << dir << "/mnt\";\n"
+		    << "username = \"" << user << "\";\n"
+		    << "anon_user_name = \"" << user << "\";\n"
+		    << "loglevel = \"ERROR\";\n"
+		    << "deamonize = \"false\";\n"
+		    << "truncate_maxsize = \"1073741824\";\n"
+		    << "max_native_fds = \"64\";\n"
+		    << "anon_mapping_file = \"" << dir << "/anon.map\";\n"
+		    << "daemon_socket = \"" << dir << "/mammutfsd.sock\";\n"
+		    << "storage = \"" << storage << "\";\n";
+	}
+
+	auto resolver = std::make_shared<ModuleResolver>();
+	char *args[] = { argv[0], nullptr };
+	auto config = std::make_shared<MammutConfig>(cfgfile.c_str(), 1, args, resolver);
+	auto comm = std::make_shared<Communicator>(config);
+
+	resolver->registerModule("default", std::make_shared<Default>(config, comm));
+	resolver->registerModule("private", std::make_shared<Private>(config, comm));
+	resolver->registerModule("backup", std::make_shared<Backup>(config, comm));
+	for (const char *m : { "default", "private", "backup" }) {
+		resolver->activateModule(m);
+	}
+
+	const char *file = "/private/a-file-with-a-name-longer-than-short-strings";
+	const char *subdir;
+	Module *module = resolver->getModuleFromPath(file, subdir);
+
+	struct fuse_file_info fi;
+	memset(&fi, 0, sizeof(fi));
+	if (module->create(subdir, 0644, &fi) != 0) {
+		std::cerr << "Could not create the file" << std::endl;
+		return 2;
+	}
+	module->release(subdir, &fi);
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = O_RDWR;
+	if (module->open(subdir, &fi) != 0) {
+		std::cerr << "Could not open the file" << std::endl;
+		return 2;
+	}
+
+	std::vector<char> buf(4096, 'x');
+	module->write(subdir, buf.data(), buf.size(), 0, &fi);
+
+	measure("getattr", iterations, [&]() {
+			const char *sub;
+			struct stat st;
+			resolver->getModuleFromPath(file, sub)->getattr(sub, &st);
+		});
+	measure("read", iterations, [&]() {
+			const char *sub;
+			resolver->getModuleFromPath(file, sub)->read(sub, buf.data(), buf.size(), 0, &fi);
+		});
+	measure("write", iterations, [&]() {
+			const char *sub;
+			resolver->getModuleFromPath(file, sub)->write(sub, buf.data(), buf.size(), 0, &fi);
+		});
+
+	module->release(subdir, &fi);
+	module->unlink(subdir);
+	return 0;
+}
@@ -0,0 +1,90 @@
+/**
+ * Compare the ways getattr can ask the raid for attributes.
+ *
+ * Creates files in a directory (ideally on the cephfs the raids live on)
+ * and stats them in a loop through the posix storage: with lstat as before,
+ * with statx for all basic fields, for the size only and without syncing.
+ * On cephfs the difference shows once other clients hold capabilities on
+ * the files.
+ *
+ *     ./stat_bench [directory] [files] [rounds]
+ */
+#include "storage.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace mammutfs;
+
+static void measure(const char *name, size_t files, size_t rounds,
+                    const std::function<int(size_t)> &op) {
+	auto start = std::chrono::steady_clock::now();
+	for (size_t r = 0; r < rounds; ++r) {
+		for (size_t i = 0; i < files; ++i) {
+			if (op(i) != 0) {
+				std::cerr << name << " failed" << std::endl;
+				std::exit(1);
+			}
+		}
+	}
+	auto end = std::chrono::steady_clock::now();
+	double ns = std::chrono::duration<double, std::nano>(end - start).count() / (files * rounds);
+	std::cout << name << ": " << ns << " ns/op" << std::endl;
+}
+
+int main(int argc, char **argv) {
+	std::string base = argc > 1 ? argv[1] : "/tmp";
+	size_t files = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 1000;
+	size_t rounds = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 100;
+
+	std::string dir = base + "/mammutfs-stat-bench-XXXXXX";
+	if (mkdtemp(&dir[0]) == nullptr) {
+		perror("mkdtemp");
+		return 2;
+	}
+
+	PosixStorage storage;
+	storage.add_root(dir);
+
+	std::vector<std::string> paths;
+	for (size_t i = 0; i < files; ++i) {
+		paths.push_back(dir + "/file-" + std::to_string(i));
+		int fd = storage.open(paths.back(), O_CREAT | O_WRONLY, 0644);
+		if (fd < 0) {
+			std::cerr << "Could not create " << paths.back() << std::endl;
+			return 2;
+		}
+		storage.pwrite(fd, "mammut", 6, 0);
+		storage.close(fd);
+	}
+
+	struct stat st;
+	measure("lstat", files, rounds, [&](size_t i) {
+			return storage.lstat(paths[i], &st);
+		});
+	measure("statx basic", files, rounds, [&](size_t i) {
+			return storage.statx(paths[i], AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS, &st);
+		});
+	measure("statx type+size", files, rounds, [&](size_t i) {
+			return storage.statx(paths[i], AT_SYMLINK_NOFOLLOW, STATX_TYPE | STATX_SIZE, &st);
+		});
+	measure("statx basic, dont sync", files, rounds, [&](size_t i) {
+			return storage.statx(paths[i], AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+			                     STATX_BASIC_STATS, &st);
+		});
+
+	for (const auto &path : paths) {
+		storage.unlink(path);
+	}
+	::rmdir(dir.c_str());
+	return 0;
+}
@@ -0,0 +1,37 @@
+# This module finds liburing, the userspace side of io_uring
+#
+# The following variables will be defined for your use:
+# - LIBURING_FOUND : was liburing found?
+# - LIBURING_INCLUDE_DIRS : liburing include directory
+# - LIBURING_LIBRARIES : liburing library
+
+find_package(PkgConfig)
+
+set(PC_LIBURING_INCLUDE_DIRS )
+set(PC_LIBURING_LIBRARY_DIRS )
+if(PKG_CONFIG_FOUND)
+    pkg_check_modules(PC_LIBURING "liburing" QUIET)
+endif(PKG_CONFIG_FOUND)
+
+find_path(
+    LIBURING_INCLUDE_DIRS
+    NAMES liburing.h
+    PATHS "${PC_LIBURING_INCLUDE_DIRS}"
+    DOC "Include directories for liburing"
+)
+
+find_library(
+    LIBURING_LIBRARIES
+    NAMES "uring"
+    PATHS "${PC_LIBURING_LIBRARY_DIRS}"
+    DOC "Libraries for liburing"
+)
+
+include(FindPackageHandleStandardArgs)
+find_package_handle_standard_args(Liburing
+    REQUIRED_VARS LIBURING_LIBRARIES LIBURING_INCLUDE_DIRS)
+
+mark_as_advanced(
+    LIBURING_INCLUDE_DIRS
+    LIBURING_LIBRARIES
+)
@@ -1,4 +1,4 @@
-# This module can find FUSE Library
+# This module can find FUSE Library (libfuse3)
 #
 # Requirements:
 # - CMake >= 2.8.3
@@ -58,7 +58,7 @@ find_package(PkgConfig)
 set(PC_FUSE_INCLUDE_DIRS )
 set(PC_FUSE_LIBRARY_DIRS )
 if(PKG_CONFIG_FOUND)
-    pkg_check_modules(PC_FUSE "fuse" QUIET)
+    pkg_check_modules(PC_FUSE "fuse3" QUIET)
     if(PC_FUSE_FOUND)
 # fusedebug(PC_FUSE_LIBRARIES)
 # fusedebug(PC_FUSE_LIBRARY_DIRS)
@@ -75,6 +75,7 @@ find_path(
     FUSE_INCLUDE_DIRS
     NAMES fuse.h
     PATHS "${PC_FUSE_INCLUDE_DIRS}"
+    PATH_SUFFIXES fuse3
     DOC "Include directories for FUSE"
 )
 
@@ -84,7 +85,7 @@ endif(NOT FUSE_INCLUDE_DIRS)
 
 find_library(
     FUSE_LIBRARIES
-    NAMES "fuse"
+    NAMES "fuse3"
     PATHS "${PC_FUSE_LIBRARY_DIRS}"
     DOC "Libraries for FUSE"
 )
@@ -94,8 +95,8 @@ if(NOT FUSE_LIBRARIES)
 endif(NOT FUSE_LIBRARIES)
 
 if(FUSE_FOUND)
-    if(EXISTS "${FUSE_INCLUDE_DIRS}/fuse/fuse_common.h")
-        file(READ "${FUSE_INCLUDE_DIRS}/fuse/fuse_common.h" _contents)
+    if(EXISTS "${FUSE_INCLUDE_DIRS}/fuse_common.h")
+        file(READ "${FUSE_INCLUDE_DIRS}/fuse_common.h" _contents)
         string(REGEX REPLACE ".*# *define *FUSE_MAJOR_VERSION *([0-9]+).*" "\\1" FUSE_MAJOR_VERSION "${_contents}")
         string(REGEX REPLACE ".*# *define *FUSE_MINOR_VERSION *([0-9]+).*" "\\1" FUSE_MINOR_VERSION "${_contents}")
         set(FUSE_VERSION "${FUSE_MAJOR_VERSION}.${FUSE_MINOR_VERSION}")
@@ -110,7 +111,8 @@ if(FUSE_FOUND)
     set(CMAKE_REQUIRED_INCLUDES "${CMAKE_REQUIRED_INCLUDES}" "${FUSE_INCLUDE_DIRS}")
     set(CMAKE_REQUIRED_LIBRARIES "${CMAKE_REQUIRED_LIBRARIES}" "${FUSE_LIBRARIES}")
     set(CMAKE_REQUIRED_DEFINITIONS "${CMAKE_REQUIRED_DEFINITIONS}" "${FUSE_DEFINITIONS}")
-    check_c_source_compiles("#include <stdlib.h>
+    check_c_source_compiles("#define FUSE_USE_VERSION 312
+#include <stdlib.h>
 #include <fuse.h>
 #include <stdio.h>
 #include <string.h>
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace mammutfs {
+
+/**
+ * Scratch memory for the temporaries of a request.
+ *
+ * Every thread owns an arena of strings that keep their capacity. A request
+ * takes the strings it needs one after another (a bump of an index) and its
+ * scope hands all of them back when it ends. Once the strings have grown to
+ * the longest path the thread has seen, building translated paths and names
+ * does not allocate anymore.
+ *
+ *     Arena::scope scope;
+ *     std::string &translated = scope.string();
+ *
+ * Scopes nest, a string must not outlive the scope it was taken from.
+ */
+class Arena {
+public:
+	class scope {
+	public:
+		scope() :
+			arena(Arena::local()),
+			mark(arena.used) {}
+
+		~scope() {
+			arena.used = mark;
+		}
+
+		scope(const scope &) = delete;
+		scope &operator=(const scope &) = delete;
+
+		/** An empty string that stays valid until the end of the scope */
+		std::string &string() {
+			return arena.take();
+		}
+
+	private:
+		Arena &arena;
+		const size_t mark;
+	};
+
+private:
+	static Arena &local() {
+		static thread_local Arena arena;
+		return arena;
+	}
+
+	std::string &take() {
+		if (this->used == this->strings.size()) {
+			// The strings must not move, they are referenced by the requests
+			this->strings.emplace_back(new std::string());
+		}
+		std::string &s = *this->strings[this->used++];
+		s.clear();
+		return s;
+	}
+
+	std::vector<std::unique_ptr<std::string>> strings;
+	size_t used = 0;
+};
+
+}
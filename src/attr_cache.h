@@ -0,0 +1,420 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <shared_mutex>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+
+namespace mammutfs {
+
+/**
+ * The attributes mammutfs fetched from the raids, by translated path.
+ *
+ * Samba and ftp stat the same paths over and over, every getattr would be a
+ * round trip to the raid. An entry is used for ttl seconds, changes made
+ * through mammutfs drop it right away - changes made directly on the raids
+ * show up after the ttl.
+ *
+ * Names that do not exist are kept apart, with a ttl and size of their own:
+ * windows clients probe for desktop.ini, Thumbs.db and friends in every
+ * directory they touch. With check_parent a negative entry also remembers
+ * the mtime of its directory, the caller compares it before trusting the
+ * entry - so names created directly on the raids show up, too.
+ *
+ * The extended attributes of a path are kept as a whole, with a ttl of their
+ * own: samba asks for user.DOSATTRIB of every file it lists, and most files
+ * have none - a complete list answers that without asking the raid.
+ *
+ * A getattr that misses takes a ticket() before the lstat and hands it to
+ * put(): if anything was invalidated in between, the result may already be
+ * stale and is not stored.
+ */
+class AttrCache {
+public:
+	/** The extended attributes of a path, names and values */
+	using xattr_list = std::vector<std::pair<std::string, std::string>>;
+
+	/** ttl <= 0 disables the cache */
+	AttrCache(double ttl = 0, size_t max_entries = 65536) {
+		this->configure(ttl, max_entries);
+		this->configure_negative(0, 0, false);
+		this->configure_xattr(0, 0);
+	}
+
+	void configure(double ttl, size_t max_entries) {
+		std::unique_lock<std::shared_mutex> lock(this->mux);
+		this->ttl = std::chrono::duration_cast<clock::duration>(
+			std::chrono::duration<double>(ttl));
+		this->max_entries = max_entries;
+		this->enabled = ttl > 0 && max_entries > 0;
+		this->entries.clear();
+	}
+
+	/** negative_ttl <= 0 disables the negative entries */
+	void configure_negative(double ttl, size_t max_entries, bool check_parent) {
+		std::unique_lock<std::shared_mutex> lock(this->mux);
+		this->negative_ttl = std::chrono::duration_cast<clock::duration>(
+			std::chrono::duration<double>(ttl));
+		this->max_negatives = max_entries;
+		this->negative_enabled = ttl > 0 && max_entries > 0;
+		this->parent_check = check_parent && this->negative_enabled;
+		this->negatives.clear();
+	}
+
+	/** ttl <= 0 disables caching the extended attributes */
+	void configure_xattr(double ttl, size_t max_entries) {
+		std::unique_lock<std::shared_mutex> lock(this->mux);
+		this->xattr_ttl = std::chrono::duration_cast<clock::duration>(
+			std::chrono::duration<double>(ttl));
+		this->max_xattrs = max_entries;
+		this->xattr_enabled = ttl > 0 && max_entries > 0;
+		this->xattrs.clear();
+	}
+
+	/** If fetching all xattrs of a path for put_xattrs is worth it */
+	bool caches_xattrs() const {
+		return this->xattr_enabled;
+	}
+
+	/** If negative entries carry the mtime of their directory */
+	bool check_parent() const {
+		return this->parent_check;
+	}
+
+	/** Fill st from the cache, false if it has to be fetched */
+	bool get(const std::string &path, struct stat *st) {
+		if (!this->enabled) {
+			return false;
+		}
+		{
+			std::shared_lock<std::shared_mutex> lock(this->mux);
+			auto it = this->entries.find(path);
+			if (it != this->entries.end() && clock::now() < it->second.expires) {
+				*st = it->second.st;
+				this->hits++;
+				return true;
+			}
+		}
+		this->misses++;
+		return false;
+	}
+
+	/**
+	 * If path is known not to exist. parent_mtime is what was given to
+	 * put_negative.
+	 */
+	bool get_negative(const std::string &path, struct timespec &parent_mtime) {
+		if (!this->negative_enabled) {
+			return false;
+		}
+		std::shared_lock<std::shared_mutex> lock(this->mux);
+		auto it = this->negatives.find(path);
+		if (it == this->negatives.end() || clock::now() >= it->second.expires) {
+			return false;
+		}
+		parent_mtime = it->second.parent_mtime;
+		this->negative_hits++;
+		return true;
+	}
+
+	/** The directory of a negative entry changed behind our back */
+	void drop_negative(const std::string &path) {
+		std::unique_lock<std::shared_mutex> lock(this->mux);
+		if (this->negatives.erase(path) > 0) {
+			// get_negative counted it as a hit
+			this->negative_hits--;
+			this->negative_stale++;
+		}
+	}
+
+	/**
+	 * getxattr(2) from the cache: retstat is the size of the value (copied
+	 * to value if size is not 0), -ERANGE or -ENODATA. false if the xattrs
+	 * of path have to be fetched.
+	 */
+	bool get_xattr(const std::string &path, const char *name,
+	               char *value, size_t size, int &retstat) {
+		if (!this->xattr_enabled) {
+			return false;
+		}
+		std::shared_lock<std::shared_mutex> lock(this->mux);
+		auto it = this->xattrs.find(path);
+		if (it == this->xattrs.end() || clock::now() >= it->second.expires) {
+			return false;
+		}
+		this->xattr_hits++;
+		retstat = -ENODATA;
+		for (const auto &attr : it->second.values) {
+			if (attr.first == name) {
+				retstat = copy_out(attr.second.data(), attr.second.size(), value, size);
+				break;
+			}
+		}
+		return true;
+	}
+
+	/** listxattr(2) from the cache, see get_xattr */
+	bool list_xattr(const std::string &path, char *list, size_t size, int &retstat) {
+		if (!this->xattr_enabled) {
+			return false;
+		}
+		std::shared_lock<std::shared_mutex> lock(this->mux);
+		auto it = this->xattrs.find(path);
+		if (it == this->xattrs.end() || clock::now() >= it->second.expires) {
+			return false;
+		}
+		this->xattr_hits++;
+		size_t length = 0;
+		for (const auto &attr : it->second.values) {
+			length += attr.first.size() + 1;
+		}
+		if (size == 0) {
+			retstat = length;
+		} else if (size < length) {
+			retstat = -ERANGE;
+		} else {
+			for (const auto &attr : it->second.values) {
+				memcpy(list, attr.first.c_str(), attr.first.size() + 1);
+				list += attr.first.size() + 1;
+			}
+			retstat = length;
+		}
+		return true;
+	}
+
+	/** Take before fetching the attributes that are put() afterwards */
+	uint64_t ticket() const {
+		return this->generation.load();
+	}
+
+	void put(const std::string &path, const struct stat &st, uint64_t ticket) {
+		if (!this->enabled) {
+			return;
+		}
+		std::unique_lock<std::shared_mutex> lock(this->mux);
+		if (ticket != this->generation.load()) {
+			return;
+		}
+		auto now = clock::now();
+		if (this->entries.size() >= this->max_entries) {
+			expire(this->entries, this->max_entries, now);
+		}
+		entry_t &e = this->entries[path];
+		e.st = st;
+		e.expires = now + this->ttl;
+		this->negatives.erase(path);
+	}
+
+	/** path does not exist, see get_negative */
+	void put_negative(const std::string &path, const struct timespec &parent_mtime,
+	                  uint64_t ticket) {
+		if (!this->negative_enabled) {
+			return;
+		}
+		std::unique_lock<std::shared_mutex> lock(this->mux);
+		if (ticket != this->generation.load()) {
+			return;
+		}
+		auto now = clock::now();
+		if (this->negatives.size() >= this->max_negatives) {
+			expire(this->negatives, this->max_negatives, now);
+		}
+		negative_t &n = this->negatives[path];
+		n.parent_mtime = parent_mtime;
+		n.expires = now + this->negative_ttl;
+	}
+
+	/** All extended attributes of path, see get_xattr */
+	void put_xattrs(const std::string &path, xattr_list &&values, uint64_t ticket) {
+		if (!this->xattr_enabled) {
+			return;
+		}
+		std::unique_lock<std::shared_mutex> lock(this->mux);
+		if (ticket != this->generation.load()) {
+			return;
+		}
+		auto now = clock::now();
+		if (this->xattrs.size() >= this->max_xattrs) {
+			expire(this->xattrs, this->max_xattrs, now);
+		}
+		xattrs_t &x = this->xattrs[path];
+		x.values = std::move(values);
+		x.expires = now + this->xattr_ttl;
+	}
+
+	/** The attributes of path changed */
+	void invalidate(const std::string &path) {
+		if (!this->enabled && !this->negative_enabled && !this->xattr_enabled) {
+			return;
+		}
+		std::unique_lock<std::shared_mutex> lock(this->mux);
+		this->generation++;
+		this->entries.erase(path);
+		this->negatives.erase(path);
+		this->xattrs.erase(path);
+	}
+
+	/**
+	 * The entry in the directory that contains path was added or removed:
+	 * path and the parent (its mtime and link count) changed.
+	 */
+	void invalidate_entry(const std::string &path) {
+		if (!this->enabled && !this->negative_enabled && !this->xattr_enabled) {
+			return;
+		}
+		std::unique_lock<std::shared_mutex> lock(this->mux);
+		this->generation++;
+		this->entries.erase(path);
+		this->negatives.erase(path);
+		this->xattrs.erase(path);
+		size_t pos = path.find_last_of('/');
+		if (pos != std::string::npos) {
+			this->entries.erase(path.substr(0, pos));
+		}
+	}
+
+	/** path and everything below it was moved or removed */
+	void invalidate_tree(const std::string &path) {
+		if (!this->enabled && !this->negative_enabled && !this->xattr_enabled) {
+			return;
+		}
+		std::unique_lock<std::shared_mutex> lock(this->mux);
+		this->generation++;
+		erase_below(this->entries, path);
+		erase_below(this->negatives, path);
+		erase_below(this->xattrs, path);
+	}
+
+	void clear() {
+		std::unique_lock<std::shared_mutex> lock(this->mux);
+		this->generation++;
+		this->entries.clear();
+		this->negatives.clear();
+		this->xattrs.clear();
+	}
+
+	/** The counters as json, for the communicator */
+	std::string stats() {
+		size_t size, negative_size, xattr_size;
+		double ttl, negative_ttl;
+		{
+			std::shared_lock<std::shared_mutex> lock(this->mux);
+			size = this->entries.size();
+			ttl = this->enabled ? std::chrono::duration<double>(this->ttl).count() : 0;
+			negative_size = this->negatives.size();
+			negative_ttl = this->negative_enabled
+				? std::chrono::duration<double>(this->negative_ttl).count() : 0;
+			xattr_size = this->xattrs.size();
+		}
+		std::stringstream ss;
+		ss << "{\"entries\":" << size
+		   << ",\"ttl\":" << ttl
+		   << ",\"hits\":" << this->hits.load()
+		   << ",\"misses\":" << this->misses.load()
+		   << ",\"negative_entries\":" << negative_size
+		   << ",\"negative_ttl\":" << negative_ttl
+		   << ",\"negative_hits\":" << this->negative_hits.load()
+		   << ",\"negative_stale\":" << this->negative_stale.load()
+		   << ",\"xattr_entries\":" << xattr_size
+		   << ",\"xattr_hits\":" << this->xattr_hits.load() << "}";
+		return ss.str();
+	}
+
+private:
+	using clock = std::chrono::steady_clock;
+
+	struct entry_t {
+		struct stat st;
+		clock::time_point expires;
+	};
+
+	struct negative_t {
+		struct timespec parent_mtime;
+		clock::time_point expires;
+	};
+
+	struct xattrs_t {
+		xattr_list values;
+		clock::time_point expires;
+	};
+
+	/** Copy a value out the way getxattr(2) does */
+	static int copy_out(const char *data, size_t length, char *value, size_t size) {
+		if (size == 0) {
+			return length;
+		}
+		if (size < length) {
+			return -ERANGE;
+		}
+		memcpy(value, data, length);
+		return length;
+	}
+
+	/** Make room for a new entry, has to be called locked */
+	template<typename map_t>
+	static void expire(map_t &map, size_t max, clock::time_point now) {
+		for (auto it = map.begin(); it != map.end();) {
+			if (it->second.expires <= now) {
+				it = map.erase(it);
+			} else {
+				++it;
+			}
+		}
+		if (map.size() >= max) {
+			map.clear();
+		}
+	}
+
+	/** Erase path and everything below it, has to be called locked */
+	template<typename map_t>
+	static void erase_below(map_t &map, const std::string &path) {
+		for (auto it = map.begin(); it != map.end();) {
+			const std::string &key = it->first;
+			if (key.compare(0, path.size(), path) == 0
+			    && (key.size() == path.size() || key[path.size()] == '/')) {
+				it = map.erase(it);
+			} else {
+				++it;
+			}
+		}
+	}
+
+	std::shared_mutex mux;
+	std::unordered_map<std::string, entry_t> entries;
+	std::unordered_map<std::string, negative_t> negatives;
+	std::unordered_map<std::string, xattrs_t> xattrs;
+
+	clock::duration ttl;
+	size_t max_entries;
+	std::atomic<bool> enabled { false };
+
+	clock::duration negative_ttl;
+	size_t max_negatives;
+	std::atomic<bool> negative_enabled { false };
+	std::atomic<bool> parent_check { false };
+
+	clock::duration xattr_ttl;
+	size_t max_xattrs;
+	std::atomic<bool> xattr_enabled { false };
+
+	/** Counts the invalidations, see ticket() */
+	std::atomic<uint64_t> generation { 0 };
+
+	std::atomic<uint64_t> hits { 0 };
+	std::atomic<uint64_t> misses { 0 };
+	std::atomic<uint64_t> negative_hits { 0 };
+	std::atomic<uint64_t> negative_stale { 0 };
+	std::atomic<uint64_t> xattr_hits { 0 };
+};
+
+}
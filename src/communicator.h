@@ -2,6 +2,7 @@
 
 #include "thread_queue.h"
 
+#include <atomic>
 #include <unordered_map>
 #include <functional>
 #include <thread>
@@ -91,7 +92,7 @@ private:
 	std::unordered_map<std::string, command> commands;
 
 	/** if the queue is too full, emergency action must be taken */
-	bool performed_queue_full_op = false;
+	std::atomic<bool> performed_queue_full_op { false };
 
 	SafeQueue<std::string> queue;
 };
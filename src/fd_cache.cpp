@@ -0,0 +1,245 @@
+#include "fd_cache.h"
+
+#include "config.h"
+#include "mammut_config.h"
+#include "storage.h"
+
+#include <algorithm>
+#include <limits>
+#include <sstream>
+#include <vector>
+
+#include <sys/resource.h>
+
+namespace mammutfs {
+
+/** How long the fd of an evicted file stays open */
+static const std::chrono::seconds retire_grace(1);
+
+/** The budget for max_native_fds, see FdCache::shared */
+static size_t fd_budget(size_t max_native_fds) {
+#ifndef SAVE_FILE_HANDLES
+	(void)max_native_fds;
+	return std::numeric_limits<size_t>::max();
+#else
+	if (max_native_fds > 0) {
+		return max_native_fds;
+	}
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) != 0) {
+		return 768;
+	}
+	if (limit.rlim_cur < limit.rlim_max) {
+		struct rlimit raised = limit;
+		raised.rlim_cur = limit.rlim_max;
+		if (setrlimit(RLIMIT_NOFILE, &raised) == 0) {
+			limit = raised;
+		}
+	}
+	if (limit.rlim_cur == RLIM_INFINITY) {
+		return 1 << 20;
+	}
+	return std::max<size_t>(limit.rlim_cur / 4 * 3, 16);
+#endif
+}
+
+
+std::shared_ptr<FdCache> FdCache::shared(const std::shared_ptr<MammutConfig> &config,
+                                         const std::shared_ptr<Storage> &storage) {
+	static std::mutex mux;
+	static std::shared_ptr<FdCache> cache;
+
+	std::lock_guard<std::mutex> lock(mux);
+	if (!cache) {
+		size_t max_native_fds = 0;
+		config->lookupValue("max_native_fds", max_native_fds);
+		cache = std::make_shared<FdCache>(fd_budget(max_native_fds), storage);
+
+		std::weak_ptr<FdCache> weak = cache;
+		config->register_changeable("max_native_fds", [config, weak]() {
+				size_t max_native_fds = 0;
+				config->lookupValue("max_native_fds", max_native_fds);
+				if (auto cache = weak.lock()) {
+					cache->set_budget(fd_budget(max_native_fds));
+				}
+			});
+	}
+	return cache;
+}
+
+
+FdCache::FdCache(size_t budget, const std::shared_ptr<Storage> &storage) :
+	storage(storage),
+	budget(budget) {
+}
+
+
+FdCache::~FdCache() {
+	// The files themselves are closed by their modules
+	for (const auto &r : this->retired) {
+		this->storage->close(r.second);
+	}
+}
+
+
+void FdCache::set_budget(size_t budget) {
+	std::unique_lock<std::mutex> lock(this->mux);
+	this->budget = budget;
+	this->enforce(lock);
+}
+
+
+void FdCache::link(entry_t *entry) {
+	if (this->hand == nullptr) {
+		entry->prev = entry;
+		entry->next = entry;
+		this->hand = entry;
+	} else {
+		// Just behind the hand - the last one it gets to
+		entry->next = this->hand;
+		entry->prev = this->hand->prev;
+		entry->prev->next = entry;
+		this->hand->prev = entry;
+	}
+	this->count++;
+}
+
+
+void FdCache::unlink(entry_t *entry) {
+	if (entry->prev == nullptr) {
+		return;
+	}
+	if (entry->next == entry) {
+		this->hand = nullptr;
+	} else {
+		entry->prev->next = entry->next;
+		entry->next->prev = entry->prev;
+		if (this->hand == entry) {
+			this->hand = entry->next;
+		}
+	}
+	entry->prev = nullptr;
+	entry->next = nullptr;
+	this->count--;
+}
+
+
+void FdCache::add(entry_t *entry, int fd) {
+	std::unique_lock<std::mutex> lock(this->mux);
+	if (entry->is_open) {
+		lock.unlock();
+		this->storage->close(fd);
+		return;
+	}
+	entry->fh.fd = fd;
+	entry->is_open.store(true, std::memory_order_release);
+	this->link(entry);
+	this->enforce(lock);
+}
+
+
+void FdCache::add(entry_t *entry, void *dir) {
+	std::unique_lock<std::mutex> lock(this->mux);
+	if (entry->is_open) {
+		lock.unlock();
+		this->storage->closedir(dir);
+		return;
+	}
+	entry->fh.dir = dir;
+	entry->is_open.store(true, std::memory_order_release);
+	this->link(entry);
+	this->enforce(lock);
+}
+
+
+int FdCache::close(entry_t *entry) {
+	std::unique_lock<std::mutex> lock(this->mux);
+	this->unlink(entry);
+	if (!entry->is_open) {
+		return 0;
+	}
+	entry->is_open = false;
+	lock.unlock();
+
+	if (entry->type == entry_t::DIRECTORY) {
+		return this->storage->closedir(entry->fh.dir);
+	}
+	return this->storage->close(entry->fh.fd);
+}
+
+
+int FdCache::take(entry_t *entry) {
+	std::lock_guard<std::mutex> lock(this->mux);
+	this->unlink(entry);
+	if (!entry->is_open || entry->type != entry_t::FILE) {
+		return -1;
+	}
+	entry->is_open = false;
+	return entry->fh.fd;
+}
+
+
+void FdCache::enforce(std::unique_lock<std::mutex> &lock) {
+	std::vector<void *> dirs;
+	std::vector<int> due;
+
+	// Every entry is passed at most twice: once to clear its mark, once to
+	// evict it. What is still in use after that stays over the budget.
+	size_t steps = 2 * this->count;
+	while (this->count > this->budget && steps-- > 0) {
+		entry_t *entry = this->hand;
+		this->hand = entry->next;
+
+		int32_t unused = 0;
+		if (entry->referenced.exchange(false, std::memory_order_relaxed)
+		    || !entry->users.compare_exchange_strong(unused, -1)) {
+			continue;
+		}
+		this->unlink(entry);
+		if (entry->type == entry_t::DIRECTORY) {
+			dirs.push_back(entry->fh.dir);
+		} else {
+			this->retired.emplace_back(clock::now(), entry->fh.fd);
+		}
+		entry->is_open = false;
+		entry->users.store(0);
+		this->evictions++;
+	}
+
+	auto now = clock::now();
+	while (!this->retired.empty()
+	       && now - this->retired.front().first > retire_grace) {
+		due.push_back(this->retired.front().second);
+		this->retired.pop_front();
+	}
+	this->retiring.store(this->retired.size(), std::memory_order_relaxed);
+	lock.unlock();
+
+	for (void *dir : dirs) {
+		this->storage->closedir(dir);
+	}
+	for (int fd : due) {
+		this->storage->close(fd);
+	}
+}
+
+
+std::string FdCache::stats() {
+	uint64_t hits = this->hits.load();
+	uint64_t reopens = this->reopens.load();
+
+	std::lock_guard<std::mutex> lock(this->mux);
+	std::stringstream ss;
+	ss << "{\"budget\":" << this->budget.load()
+	   << ",\"open\":" << this->count.load()
+	   << ",\"retired\":" << this->retired.size()
+	   << ",\"hits\":" << hits
+	   << ",\"reopens\":" << reopens
+	   << ",\"evictions\":" << this->evictions
+	   << ",\"hit_rate\":" << (hits + reopens > 0
+	                             ? static_cast<double>(hits) / (hits + reopens) : 1.0)
+	   << "}";
+	return ss.str();
+}
+
+}
@@ -0,0 +1,172 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+
+namespace mammutfs {
+
+class MammutConfig;
+class Storage;
+
+/**
+ * The native fds of the open files of all modules, kept within a budget.
+ *
+ * A file keeps its fd as long as there is room for it. Once the budget is
+ * used up, the files that were not used for the longest time are closed,
+ * and reopened when they are used again - hot files are never reopened.
+ *
+ * The order is a clock (second chance): a use only marks the file, so
+ * using a file takes no lock. The hand that looks for files to close skips
+ * files that are in use, and clears the mark of marked ones, so they are
+ * closed on its next round only if they were not used since.
+ */
+class FdCache {
+public:
+	/** What an open file needs to be kept here, the open files extend it */
+	struct entry_t {
+		enum { FILE, DIRECTORY, UNSPEC } type = UNSPEC;
+		/** fh is valid */
+		std::atomic<bool> is_open { false };
+		union {
+			int32_t fd;
+			void *dir;
+		} fh;
+		/** Handles using fh right now, -1 while it is being closed */
+		std::atomic<int32_t> users { 0 };
+		/** Used since the hand passed by */
+		std::atomic<bool> referenced { false };
+		/** The place in the clock, guarded by the cache */
+		entry_t *prev = nullptr;
+		entry_t *next = nullptr;
+	};
+
+	/**
+	 * The cache of this process, created on the first call. Its budget is
+	 * "max_native_fds", 0 raises RLIMIT_NOFILE to its hard limit and takes
+	 * three quarters of that - the rest is left to the raids, the sockets
+	 * and the files being reopened.
+	 * Without SAVE_FILE_HANDLES no fd is closed before its file is.
+	 */
+	static std::shared_ptr<FdCache> shared(const std::shared_ptr<MammutConfig> &config,
+	                                       const std::shared_ptr<Storage> &storage);
+
+	FdCache(size_t budget, const std::shared_ptr<Storage> &storage);
+	~FdCache();
+
+	/** Change the budget, files are closed until it is kept */
+	void set_budget(size_t budget);
+
+	/**
+	 * If the fd of a file in use may be evicted soon: the budget is nearly
+	 * used up, or fds were evicted within the grace period. An fd that is
+	 * handed on without a pin (a splice after the handle is gone) is safe
+	 * otherwise - an fd evicted anyway stays open for the grace period,
+	 * longer than the splice that was already under way takes to start.
+	 * Takes no lock.
+	 */
+	bool under_pressure() const {
+		size_t budget = this->budget.load(std::memory_order_relaxed);
+		return this->count.load(std::memory_order_relaxed) + budget / 8 >= budget
+			|| this->retiring.load(std::memory_order_relaxed) > 0;
+	}
+
+	/**
+	 * entry has to keep its fd from now on. If it got one meanwhile - a
+	 * concurrent reopen - fd is closed instead. Closes the coldest files if
+	 * the budget is exceeded.
+	 */
+	void add(entry_t *entry, int fd);
+	void add(entry_t *entry, void *dir);
+
+	/**
+	 * Close the fd of entry for good, its file is closed. The result of the
+	 * close, 0 if it had no fd. entry has to be pinned.
+	 */
+	int close(entry_t *entry);
+
+	/**
+	 * Forget entry without closing its fd, that is returned - or -1 if
+	 * it had none. entry has to be pinned.
+	 */
+	int take(entry_t *entry);
+
+	/**
+	 * Wait until the fd of entry is not being closed and keep it from
+	 * being closed until unpin.
+	 */
+	static void pin(entry_t *entry) {
+		int32_t users = entry->users.load();
+		for (;;) {
+			if (users < 0) {
+				// Evicting takes a few instructions under the lock
+				std::this_thread::yield();
+				users = entry->users.load();
+			} else if (entry->users.compare_exchange_weak(users, users + 1)) {
+				break;
+			}
+		}
+		entry->referenced.store(true, std::memory_order_relaxed);
+	}
+
+	static void unpin(entry_t *entry) {
+		entry->users--;
+	}
+
+	/** Count a use that found the fd open */
+	void hit() {
+		this->hits.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	/** Count a use that had to reopen the file */
+	void miss() {
+		this->reopens.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	/** The budget, the fds and the hit rate, as json */
+	std::string stats();
+
+private:
+	/** Link entry before the hand, has to be called locked */
+	void link(entry_t *entry);
+	/** Has to be called locked */
+	void unlink(entry_t *entry);
+
+	/**
+	 * Evict files until the budget is kept and close what is due.
+	 * Has to be called locked, the lock is released.
+	 */
+	void enforce(std::unique_lock<std::mutex> &lock);
+
+	using clock = std::chrono::steady_clock;
+
+	std::shared_ptr<Storage> storage;
+
+	std::mutex mux;
+	/** budget and count are changed locked, read by under_pressure without */
+	std::atomic<size_t> budget;
+	/** The entries in the clock */
+	std::atomic<size_t> count { 0 };
+	entry_t *hand = nullptr;
+
+	/**
+	 * The fds of evicted files stay open a little longer, no matter how many
+	 * pile up: a syscall that was issued on an fd just before it was evicted
+	 * must not hit another file that reuses the number.
+	 */
+	std::deque<std::pair<clock::time_point, int>> retired;
+	/** The size of retired, for under_pressure */
+	std::atomic<size_t> retiring { 0 };
+
+	std::atomic<uint64_t> hits { 0 };
+	std::atomic<uint64_t> reopens { 0 };
+	uint64_t evictions = 0;
+};
+
+}
@@ -15,7 +15,7 @@ public:
 		Module(name, config, comm) {
 	}
 
-	int translatepath(const std::string &path, std::string &out) override {
+	int translatepath(std::string_view path, std::string &out) override {
 		if (path == "/") {
 			int rc = Module::translatepath(path, out);
 			if (rc == 0) {
@@ -50,10 +50,7 @@ public:
 			int retstat = this->translatepath(path, out);
 			if (retstat != 0) return retstat;
 
-			retstat = ::lstat(out.c_str(), statbuf);
-			if (retstat != 0) return -errno;
-
-			return 0;
+			return this->statx(out, AT_SYMLINK_NOFOLLOW, this->attr_mask, statbuf);
 		} else {
 			this->trace("filemodule::getattr: FAILED access to non-root path!", path);
 			return -ENOENT;
@@ -123,6 +120,14 @@ public:
 		return Module::write(path, buf, size, offset, fi);
 	}
 
+	int write_buf(const char *path,
+	              struct fuse_bufvec *buf,
+	              off_t offset,
+	              struct fuse_file_info *fi) override {
+		this->has_changed = true;
+		return Module::write_buf(path, buf, offset, fi);
+	}
+
 	int release(const char *path, struct fuse_file_info *fi) {
 		this->trace("filemod::release", path);
 		int rc = Module::release(path, fi);
@@ -131,7 +136,8 @@ public:
 		this->translatepath(path, out);
 
 		struct stat statbuf;
-		::stat(out.c_str(), &statbuf);
+		memset(&statbuf, 0, sizeof(statbuf));
+		this->statx(out, 0, STATX_SIZE, &statbuf);
 
 		if (statbuf.st_size == 0) {
 			this->info("file was empty, will create new one", out, "");
@@ -146,6 +152,7 @@ public:
 	}
 
 protected:
-	bool has_changed;
+	// set from concurrent writers, consumed on release
+	std::atomic<bool> has_changed { false };
 };
 }
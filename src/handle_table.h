@@ -0,0 +1,211 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace mammutfs {
+
+/**
+ * Strings that are stored once, however often they are used.
+ *
+ * The lister serves the same few public files to many clients at once:
+ * every open handle points to the one copy of its path.
+ */
+class PathPool {
+public:
+	/** The pooled copy of path, valid until it is released as often */
+	const std::string *intern(const std::string &path) {
+		std::lock_guard<std::mutex> lock(this->mux);
+		auto it = this->paths.emplace(path, 0).first;
+		if (it->second++ == 0) {
+			this->bytes += path.capacity() + sizeof(*it);
+		}
+		return &it->first;
+	}
+
+	void release(const std::string *path) {
+		if (path == nullptr) {
+			return;
+		}
+		std::lock_guard<std::mutex> lock(this->mux);
+		auto it = this->paths.find(*path);
+		if (it != this->paths.end() && --it->second == 0) {
+			this->bytes -= it->first.capacity() + sizeof(*it);
+			this->paths.erase(it);
+		}
+	}
+
+	/** The number of different paths */
+	size_t size() {
+		std::lock_guard<std::mutex> lock(this->mux);
+		return this->paths.size();
+	}
+
+	/** About what the paths take in memory */
+	size_t memory() {
+		std::lock_guard<std::mutex> lock(this->mux);
+		return this->bytes + this->paths.bucket_count() * sizeof(void *);
+	}
+
+private:
+	std::mutex mux;
+	std::unordered_map<std::string, size_t> paths;
+	size_t bytes = 0;
+};
+
+
+/**
+ * A fixed maximum of slots, handed out as handles for fi->fh.
+ *
+ * The slots live in chunks that are allocated when they are first needed
+ * and never move, so get() needs no lock: a handle is the slot number and
+ * the generation of the slot, which counts up whenever the slot is taken or
+ * given back - a handle that was freed does not find its slot anymore.
+ * Taking and giving back slots is locked.
+ */
+template<typename T, size_t CHUNK = 1024>
+class HandleTable {
+public:
+	explicit HandleTable(size_t max_handles) :
+		max_handles(max_handles),
+		chunks(new std::atomic<slot_t *>[(max_handles + CHUNK - 1) / CHUNK]) {
+		for (size_t i = 0; i < this->chunk_count(); ++i) {
+			this->chunks[i] = nullptr;
+		}
+	}
+
+	~HandleTable() {
+		for (size_t i = 0; i < this->chunk_count(); ++i) {
+			delete[] this->chunks[i].load();
+		}
+	}
+
+	HandleTable(const HandleTable &) = delete;
+	HandleTable &operator=(const HandleTable &) = delete;
+
+	/** A reset slot and its handle, 0 if all slots are in use */
+	uint64_t allocate(T *&value) {
+		std::lock_guard<std::mutex> lock(this->mux);
+		uint32_t index;
+		if (!this->free_slots.empty()) {
+			index = this->free_slots.back();
+			this->free_slots.pop_back();
+		} else if (this->next_slot < this->max_handles) {
+			index = this->next_slot++;
+			std::atomic<slot_t *> &chunk = this->chunks[index / CHUNK];
+			if (chunk.load() == nullptr) {
+				chunk.store(new slot_t[CHUNK]);
+			}
+		} else {
+			return 0;
+		}
+
+		slot_t &slot = this->chunks[index / CHUNK].load()[index % CHUNK];
+		// T may hold atomics, which cannot be assigned
+		slot.value.~T();
+		new (&slot.value) T();
+		// Odd while in use
+		uint32_t generation = slot.generation.load() + 1;
+		slot.generation.store(generation, std::memory_order_release);
+		this->used++;
+		value = &slot.value;
+		return (static_cast<uint64_t>(generation) << 32) | (index + 1);
+	}
+
+	/** The slot of handle, nullptr if it is not in use */
+	T *get(uint64_t handle) const {
+		uint64_t index = (handle & 0xffffffff) - 1;
+		if (index >= this->max_handles || (handle >> 32 & 1) == 0) {
+			return nullptr;
+		}
+		slot_t *chunk = this->chunks[index / CHUNK].load(std::memory_order_acquire);
+		if (chunk == nullptr) {
+			return nullptr;
+		}
+		slot_t &slot = chunk[index % CHUNK];
+		if (slot.generation.load(std::memory_order_acquire) != (handle >> 32)) {
+			return nullptr;
+		}
+		return &slot.value;
+	}
+
+	/** Give the slot of handle back */
+	void free(uint64_t handle) {
+		std::lock_guard<std::mutex> lock(this->mux);
+		uint64_t index = (handle & 0xffffffff) - 1;
+		if (index >= this->next_slot) {
+			return;
+		}
+		slot_t &slot = this->chunks[index / CHUNK].load()[index % CHUNK];
+		uint32_t generation = handle >> 32;
+		if (slot.generation.load() != generation) {
+			return;
+		}
+		slot.generation.store(generation + 1, std::memory_order_release);
+		this->free_slots.push_back(index);
+		this->used--;
+	}
+
+	/** The handles in use */
+	size_t size() const {
+		return this->used.load();
+	}
+
+	/** The most handles that can be in use at once */
+	size_t limit() const {
+		return this->max_handles;
+	}
+
+	/** The slots allocated so far */
+	size_t capacity() {
+		std::lock_guard<std::mutex> lock(this->mux);
+		return ((this->next_slot + CHUNK - 1) / CHUNK) * CHUNK;
+	}
+
+	/** What the table takes in memory */
+	size_t memory() {
+		std::lock_guard<std::mutex> lock(this->mux);
+		return ((this->next_slot + CHUNK - 1) / CHUNK) * CHUNK * sizeof(slot_t)
+			+ this->chunk_count() * sizeof(std::atomic<slot_t *>)
+			+ this->free_slots.capacity() * sizeof(uint32_t);
+	}
+
+	/** Call f(handle, value) for all handles in use, locked */
+	template<typename F>
+	void for_each(F f) {
+		std::lock_guard<std::mutex> lock(this->mux);
+		for (uint32_t index = 0; index < this->next_slot; ++index) {
+			slot_t &slot = this->chunks[index / CHUNK].load()[index % CHUNK];
+			uint32_t generation = slot.generation.load();
+			if (generation & 1) {
+				f((static_cast<uint64_t>(generation) << 32) | (index + 1), slot.value);
+			}
+		}
+	}
+
+private:
+	struct slot_t {
+		T value;
+		std::atomic<uint32_t> generation { 0 };
+	};
+
+	size_t chunk_count() const {
+		return (this->max_handles + CHUNK - 1) / CHUNK;
+	}
+
+	const size_t max_handles;
+	std::unique_ptr<std::atomic<slot_t *>[]> chunks;
+
+	std::mutex mux;
+	uint32_t next_slot = 0;
+	std::vector<uint32_t> free_slots;
+	std::atomic<size_t> used { 0 };
+};
+
+}
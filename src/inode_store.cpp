@@ -0,0 +1,195 @@
+#include "inode_store.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace mammutfs {
+
+/** Slots looked at for a file before giving up */
+static const size_t PROBES = 8;
+
+static const uint64_t MAGIC = 0x6d616d6d75746e64; // "mammutnd"
+static const uint32_t VERSION = 1;
+
+struct InodeStore::header_t {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t slot_size;
+	uint64_t slots;
+	uint64_t boot;
+	char padding[96];
+};
+
+struct InodeStore::slot_t {
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t parent;
+	uint32_t generation;
+	uint8_t used;
+	/** 0 if the name did not fit */
+	uint8_t namelen;
+	char name[NAME_LEN + 1];
+};
+
+std::unique_ptr<InodeStore> InodeStore::open(const std::string &path, size_t slots) {
+	static_assert(sizeof(header_t) == 128, "the file layout changed");
+	static_assert(sizeof(slot_t) == 128, "the file layout changed");
+	if (slots == 0) {
+		return nullptr;
+	}
+	int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		return nullptr;
+	}
+
+	size_t length = sizeof(header_t) + slots * sizeof(slot_t);
+	header_t old;
+	memset(&old, 0, sizeof(old));
+	bool valid = ::pread(fd, &old, sizeof(old), 0) == sizeof(old)
+		&& old.magic == MAGIC
+		&& old.version == VERSION
+		&& old.slot_size == sizeof(slot_t)
+		&& old.slots == slots;
+	if (!valid) {
+		// The nodeids of another layout mean nothing here: start over.
+		// The file stays sparse, slots are written when they are used.
+		if (::ftruncate(fd, 0) != 0 || ::ftruncate(fd, length) != 0) {
+			::close(fd);
+			return nullptr;
+		}
+	}
+
+	void *map = ::mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		::close(fd);
+		return nullptr;
+	}
+	// Lookups jump around the whole table
+	::madvise(map, length, MADV_RANDOM);
+
+	std::unique_ptr<InodeStore> store(new InodeStore(fd, map, length, slots));
+	header_t *header = store->header;
+	if (!valid) {
+		header->magic = MAGIC;
+		header->version = VERSION;
+		header->slot_size = sizeof(slot_t);
+		header->slots = slots;
+		header->boot = 0;
+	}
+	header->boot++;
+	return store;
+}
+
+
+InodeStore::InodeStore(int fd, void *map, size_t length, size_t slots) :
+	fd(fd),
+	map(map),
+	length(length),
+	slots(slots),
+	header(static_cast<header_t *>(map)),
+	table(reinterpret_cast<slot_t *>(static_cast<char *>(map) + sizeof(header_t))) {
+}
+
+
+InodeStore::~InodeStore() {
+	::msync(this->map, this->length, MS_ASYNC);
+	::munmap(this->map, this->length);
+	::close(this->fd);
+}
+
+
+uint64_t InodeStore::boot() const {
+	return this->header->boot;
+}
+
+
+InodeStore::slot_t &InodeStore::slot(fuse_ino_t nodeid) const {
+	return this->table[nodeid - FIRST_INO];
+}
+
+
+void InodeStore::set_name(slot_t &slot, const std::string &name) {
+	if (name.size() > NAME_LEN) {
+		slot.namelen = 0;
+		return;
+	}
+	memcpy(slot.name, name.data(), name.size());
+	slot.name[name.size()] = '\0';
+	slot.namelen = name.size();
+}
+
+
+fuse_ino_t InodeStore::assign(dev_t dev, ino_t ino, fuse_ino_t parent, const std::string &name,
+                              const std::function<bool(fuse_ino_t)> &live,
+                              uint64_t &generation) {
+	// splitmix64, dev and ino alone are far from uniform
+	uint64_t h = static_cast<uint64_t>(ino) ^ (static_cast<uint64_t>(dev) << 32);
+	h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9;
+	h = (h ^ (h >> 27)) * 0x94d049bb133111eb;
+	h ^= h >> 31;
+
+	size_t free = this->slots;
+	for (size_t i = 0; i < PROBES && i < this->slots; ++i) {
+		size_t index = (h + i) % this->slots;
+		slot_t &s = this->table[index];
+		if (s.used && s.dev == dev && s.ino == ino) {
+			if (s.parent != parent || s.namelen != name.size()
+			    || name.compare(0, name.size(), s.name, s.namelen) != 0) {
+				s.parent = parent;
+				set_name(s, name);
+			}
+			generation = s.generation;
+			return FIRST_INO + index;
+		}
+		if (free == this->slots && (!s.used || !live(FIRST_INO + index))) {
+			free = index;
+		}
+	}
+	if (free == this->slots) {
+		return 0;
+	}
+
+	slot_t &s = this->table[free];
+	s.generation++;
+	s.used = 1;
+	s.dev = dev;
+	s.ino = ino;
+	s.parent = parent;
+	set_name(s, name);
+	generation = s.generation;
+	return FIRST_INO + free;
+}
+
+
+void InodeStore::move(fuse_ino_t nodeid, fuse_ino_t parent, const std::string &name) {
+	if (!this->contains(nodeid)) {
+		return;
+	}
+	slot_t &s = this->slot(nodeid);
+	s.parent = parent;
+	set_name(s, name);
+}
+
+
+bool InodeStore::get(fuse_ino_t nodeid, fuse_ino_t &parent, std::string &name,
+                     dev_t &dev, ino_t &ino, uint64_t &generation) const {
+	if (!this->contains(nodeid)) {
+		return false;
+	}
+	const slot_t &s = this->slot(nodeid);
+	if (!s.used || s.namelen == 0) {
+		return false;
+	}
+	parent = s.parent;
+	name.assign(s.name, s.namelen);
+	dev = s.dev;
+	ino = s.ino;
+	generation = s.generation;
+	return true;
+}
+
+}
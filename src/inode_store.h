@@ -0,0 +1,92 @@
+#pragma once
+
+#include <fuse_lowlevel.h>
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+
+#include <sys/types.h>
+
+namespace mammutfs {
+
+/**
+ * The nodeids of the lowlevel engine, kept in a file across restarts.
+ *
+ * nfs hands out file handles that contain the nodeid and its generation and
+ * expects them to work forever. Without this table every restart of mammutfs
+ * (and every inode the kernel forgot) turns them stale.
+ *
+ * The table is a hash table of fixed size, mapped from the file: the slot of
+ * a backing file is found by its dev and ino, the nodeid is the slot number.
+ * So the same file gets the same nodeid in every run, and only the pages
+ * that are touched stay in memory. Every slot remembers its parent and name,
+ * so an unknown nodeid can be looked up again from the root. A slot that is
+ * taken over by another file counts up its generation - old handles turn
+ * stale instead of reaching the wrong file. Names longer than NAME_LEN are
+ * not stored, their handles do not survive a restart.
+ *
+ * Not thread safe, the InodeTable calls it locked.
+ */
+class InodeStore {
+public:
+	/** The nodeid of slot 0 */
+	static const fuse_ino_t FIRST_INO = FUSE_ROOT_ID + 1;
+	static const size_t NAME_LEN = 95;
+
+	/**
+	 * Open the table at path, it is created (or recreated if it was created
+	 * with another size) with the given number of slots. nullptr on errors.
+	 */
+	static std::unique_ptr<InodeStore> open(const std::string &path, size_t slots);
+
+	~InodeStore();
+
+	/** Counts the runs, the generation of nodeids that are not stored */
+	uint64_t boot() const;
+
+	/** The number of slots, nodeids above belong to nobody */
+	size_t size() const {
+		return this->slots;
+	}
+
+	/** If the nodeid is one of the table */
+	bool contains(fuse_ino_t nodeid) const {
+		return nodeid >= FIRST_INO && nodeid - FIRST_INO < this->slots;
+	}
+
+	/**
+	 * The nodeid of the backing file dev/ino, now at parent/name.
+	 * Slots of nodeids that are live (still known to the kernel) are never
+	 * taken over. Returns 0 if all slots it could get are live.
+	 */
+	fuse_ino_t assign(dev_t dev, ino_t ino, fuse_ino_t parent, const std::string &name,
+	                  const std::function<bool(fuse_ino_t)> &live, uint64_t &generation);
+
+	/** The nodeid was renamed */
+	void move(fuse_ino_t nodeid, fuse_ino_t parent, const std::string &name);
+
+	/** What is stored for nodeid, false if nothing (or no name) is */
+	bool get(fuse_ino_t nodeid, fuse_ino_t &parent, std::string &name,
+	         dev_t &dev, ino_t &ino, uint64_t &generation) const;
+
+private:
+	struct header_t;
+	struct slot_t;
+
+	InodeStore(int fd, void *map, size_t length, size_t slots);
+
+	slot_t &slot(fuse_ino_t nodeid) const;
+
+	static void set_name(slot_t &slot, const std::string &name);
+
+	int fd;
+	void *map;
+	size_t length;
+	size_t slots;
+	header_t *header;
+	slot_t *table;
+};
+
+}
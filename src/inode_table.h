@@ -0,0 +1,353 @@
+#pragma once
+
+#include "arena.h"
+#include "inode_store.h"
+#include "module.h"
+
+#include <fuse_lowlevel.h>
+
+#include <sys/stat.h>
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+namespace mammutfs {
+
+/**
+ * The nodeid bookkeeping of the lowlevel engine.
+ *
+ * Every inode that was handed to the kernel via lookup is stored here until
+ * the kernel forgets about it. An inode knows its parent and its name, so its
+ * path can be rebuilt for the path based module api.
+ * Only the module roots (the mount root and - if there is more than a single
+ * module - the module directories) store the module they belong to, all other
+ * nodes get it from their module root. So a directory that has been moved to
+ * another module does not leave stale module pointers in its children.
+ *
+ * With an InodeStore the nodeids are taken from it, so they stay the same
+ * across restarts and nfs file handles can be looked up again (see
+ * persisted). Without one - or if it is full - nodeids are simply counted
+ * and never reused.
+ */
+class InodeTable {
+public:
+	InodeTable() {
+		inode_t &root = nodes[FUSE_ROOT_ID];
+		root.parent = 0;
+		root.nlookup = 1; // The root is never forgotten
+	}
+
+	/** Take the nodeids from store from now on */
+	void set_store(std::unique_ptr<InodeStore> store) {
+		std::lock_guard<std::mutex> lock(this->mux);
+		this->store = std::move(store);
+		this->boot = this->store ? this->store->boot() : 0;
+		if (this->store) {
+			this->next_ino = InodeStore::FIRST_INO + this->store->size();
+		}
+	}
+
+	/** The root inode is the module root of the given module */
+	void set_root(Module *module) {
+		std::lock_guard<std::mutex> lock(this->mux);
+		inode_t &root = nodes.at(FUSE_ROOT_ID);
+		root.module = module;
+	}
+
+	/**
+	 * Register a kernel lookup of parent/name.
+	 *
+	 * If the name is already known and still refers to the same backing file,
+	 * the existing nodeid is reused, else a new one is allocated.
+	 * module has to be set for module roots only. nlookup is 0 for nodes
+	 * the kernel does not know of, they live as long as their children.
+	 * Returns 0 if parent is not known (anymore) - without a reference of the
+	 * kernel it can be forgotten any time.
+	 */
+	fuse_ino_t lookup(fuse_ino_t parent,
+	                  const std::string &name,
+	                  Module *module,
+	                  const struct stat &st,
+	                  uint64_t *generation = nullptr,
+	                  uint64_t nlookup = 1) {
+		std::lock_guard<std::mutex> lock(this->mux);
+		if (nodes.count(parent) == 0) {
+			return 0;
+		}
+		auto key = std::make_pair(parent, name);
+		auto it = names.find(key);
+		if (it != names.end()) {
+			inode_t &node = nodes.at(it->second);
+			if (node.dev == st.st_dev && node.ino == st.st_ino) {
+				node.nlookup += nlookup;
+				if (generation != nullptr) {
+					*generation = node.generation;
+				}
+				return it->second;
+			}
+			// The entry was replaced behind our back - the old nodeid has
+			// to stay valid until it is forgotten, but it is not reachable by
+			// its name anymore.
+			names.erase(it);
+		}
+
+		uint64_t gen = this->boot;
+		fuse_ino_t ino = 0;
+		if (this->store) {
+			ino = this->store->assign(st.st_dev, st.st_ino, parent, name,
+			                          [this](fuse_ino_t i) { return nodes.count(i) > 0; },
+			                          gen);
+		}
+		if (ino == 0) {
+			ino = next_ino++;
+			gen = this->boot;
+		}
+		if (generation != nullptr) {
+			*generation = gen;
+		}
+
+		auto known = nodes.find(ino);
+		if (known != nodes.end()) {
+			// The backing file is known by another name already - it was
+			// moved behind our back (or is a hard link): it lives here now
+			inode_t &node = known->second;
+			auto old = names.find(std::make_pair(node.parent, node.name));
+			if (old != names.end() && old->second == ino) {
+				names.erase(old);
+			}
+			fuse_ino_t old_parent = node.parent;
+			nodes.at(parent).children++;
+			node.parent = parent;
+			node.name = name;
+			node.nlookup += nlookup;
+			names.emplace(key, ino);
+			nodes.at(old_parent).children--;
+			release(old_parent);
+			return ino;
+		}
+
+		inode_t &node = nodes[ino];
+		node.parent = parent;
+		node.name = name;
+		node.module = module;
+		node.nlookup = nlookup;
+		node.dev = st.st_dev;
+		node.ino = st.st_ino;
+		node.generation = gen;
+		nodes.at(parent).children++;
+		names.emplace(key, ino);
+		return ino;
+	}
+
+	/** If the kernel (or a child) still references the inode */
+	bool known(fuse_ino_t ino) {
+		std::lock_guard<std::mutex> lock(this->mux);
+		return nodes.count(ino) > 0;
+	}
+
+	/** The generation of a known inode, for the replies to the kernel */
+	uint64_t generation(fuse_ino_t ino) {
+		std::lock_guard<std::mutex> lock(this->mux);
+		auto it = nodes.find(ino);
+		return it == nodes.end() ? 0 : it->second.generation;
+	}
+
+	/**
+	 * Where the store saw an inode that is not known anymore - to look it up
+	 * again from its parent when nfs comes back with an old file handle.
+	 */
+	bool persisted(fuse_ino_t ino, fuse_ino_t &parent, std::string &name,
+	               dev_t &dev, ino_t &backing_ino, uint64_t &generation) {
+		std::lock_guard<std::mutex> lock(this->mux);
+		return this->store
+			&& this->store->get(ino, parent, name, dev, backing_ino, generation);
+	}
+
+	/** An additional lookup to an already known inode (for "." and "..") */
+	bool ref(fuse_ino_t ino) {
+		std::lock_guard<std::mutex> lock(this->mux);
+		auto it = nodes.find(ino);
+		if (it == nodes.end()) {
+			return false;
+		}
+		it->second.nlookup++;
+		return true;
+	}
+
+	/** The kernel drops nlookup references to the inode */
+	void forget(fuse_ino_t ino, uint64_t nlookup) {
+		std::lock_guard<std::mutex> lock(this->mux);
+		auto it = nodes.find(ino);
+		if (it == nodes.end()) {
+			return;
+		}
+		if (it->second.nlookup < nlookup) {
+			it->second.nlookup = 0;
+		} else {
+			it->second.nlookup -= nlookup;
+		}
+		release(ino);
+	}
+
+	/** The name was removed from its parent */
+	void unlink(fuse_ino_t parent, const std::string &name) {
+		std::lock_guard<std::mutex> lock(this->mux);
+		names.erase(std::make_pair(parent, name));
+	}
+
+	/** The name was moved to a new location */
+	void rename(fuse_ino_t parent, const std::string &name,
+	            fuse_ino_t newparent, const std::string &newname) {
+		std::lock_guard<std::mutex> lock(this->mux);
+		// Whatever was at the destination is gone now
+		names.erase(std::make_pair(newparent, newname));
+
+		auto it = names.find(std::make_pair(parent, name));
+		if (it == names.end()) {
+			return;
+		}
+		fuse_ino_t ino = it->second;
+		names.erase(it);
+
+		inode_t &node = nodes.at(ino);
+		nodes.at(newparent).children++;
+		node.parent = newparent;
+		node.name = newname;
+		names.emplace(std::make_pair(newparent, newname), ino);
+		if (this->store) {
+			this->store->move(ino, newparent, newname);
+		}
+
+		nodes.at(parent).children--;
+		release(parent);
+	}
+
+	/** Find the inode of a path within the mount, if the kernel knows it */
+	bool find(const std::string &path, fuse_ino_t &ino) {
+		std::lock_guard<std::mutex> lock(this->mux);
+		ino = FUSE_ROOT_ID;
+		size_t start = 1;
+		while (start < path.size()) {
+			size_t end = path.find('/', start);
+			if (end == std::string::npos) {
+				end = path.size();
+			}
+			if (end > start) {
+				auto it = names.find(std::make_pair(ino, path.substr(start, end - start)));
+				if (it == names.end()) {
+					return false;
+				}
+				ino = it->second;
+			}
+			start = end + 1;
+		}
+		return true;
+	}
+
+	/** The parent of an inode - the root is its own parent */
+	bool parent(fuse_ino_t ino, fuse_ino_t &parent) {
+		std::lock_guard<std::mutex> lock(this->mux);
+		auto it = nodes.find(ino);
+		if (it == nodes.end()) {
+			return false;
+		}
+		parent = (ino == FUSE_ROOT_ID) ? FUSE_ROOT_ID : it->second.parent;
+		return true;
+	}
+
+	/**
+	 * Rebuild the path of an inode.
+	 *
+	 * path will be relative to the module (as the modules expect it), raw - if
+	 * requested - will be the path within the mount.
+	 */
+	bool resolve(fuse_ino_t ino, Module *&module,
+	             std::string &path, std::string *raw = nullptr) {
+		std::lock_guard<std::mutex> lock(this->mux);
+		module = nullptr;
+		path.clear();
+
+		Arena::scope scope;
+		std::string &fullpath = scope.string();
+		fuse_ino_t current = ino;
+		while (current != 0) {
+			auto it = nodes.find(current);
+			if (it == nodes.end()) {
+				return false;
+			}
+			const inode_t &node = it->second;
+			if (module == nullptr && node.module != nullptr) {
+				module = node.module;
+				path.assign(fullpath.empty() ? "/" : fullpath);
+				if (raw == nullptr) {
+					return true;
+				}
+			}
+			if (current != FUSE_ROOT_ID) {
+				fullpath.insert(0, node.name);
+				fullpath.insert(0, 1, '/');
+			}
+			current = node.parent;
+		}
+		if (raw != nullptr) {
+			raw->assign(fullpath.empty() ? "/" : fullpath);
+		}
+		return module != nullptr;
+	}
+
+private:
+	struct inode_t {
+		fuse_ino_t parent = 0;
+		std::string name;
+		/** Set only for module roots */
+		Module *module = nullptr;
+		/** references held by the kernel */
+		uint64_t nlookup = 0;
+		/** inodes that have this one as parent */
+		uint64_t children = 0;
+		/** identity of the backing file */
+		dev_t dev = 0;
+		ino_t ino = 0;
+		uint64_t generation = 0;
+	};
+
+	/** Drop the inode if nobody references it any longer, has to be locked */
+	void release(fuse_ino_t ino) {
+		while (ino != FUSE_ROOT_ID) {
+			auto it = nodes.find(ino);
+			if (it == nodes.end()
+			    || it->second.nlookup != 0
+			    || it->second.children != 0) {
+				return;
+			}
+			fuse_ino_t parent = it->second.parent;
+			auto name = names.find(std::make_pair(parent, it->second.name));
+			if (name != names.end() && name->second == ino) {
+				names.erase(name);
+			}
+			nodes.erase(it);
+			nodes.at(parent).children--;
+			ino = parent;
+		}
+	}
+
+	std::mutex mux;
+
+	std::unordered_map<fuse_ino_t, inode_t> nodes;
+	std::map<std::pair<fuse_ino_t, std::string>, fuse_ino_t> names;
+
+	/** Where the nodeids come from, if they are kept across restarts */
+	std::unique_ptr<InodeStore> store;
+
+	/**
+	 * Counted nodeids are never reused within a run, their generation is the
+	 * run of the store. They start above all stored nodeids.
+	 */
+	uint64_t boot = 0;
+	fuse_ino_t next_ino = FUSE_ROOT_ID + 1;
+};
+
+}
@@ -0,0 +1,255 @@
+#include "io_ring.h"
+
+#include "config.h"
+
+#ifdef ENABLE_IO_URING
+#include <liburing.h>
+#include <linux/openat2.h>
+#endif
+
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <syslog.h>
+
+namespace mammutfs {
+
+struct IoRing::request_t {
+	enum { READ, WRITE, STATX, OPENAT2, CLOSE, STOP } op;
+	int fd;
+	void *buf;
+	size_t size;
+	off_t offset;
+	std::string path;
+	int flags;
+	unsigned int mask;
+	struct statx *statxbuf;
+#ifdef ENABLE_IO_URING
+	/** Read by the kernel when the request is submitted */
+	struct open_how how;
+#endif
+	completion done;
+};
+
+
+IoRing::IoRing() :
+	ring(nullptr) {
+}
+
+
+std::unique_ptr<IoRing> IoRing::create(unsigned int entries) {
+#ifdef ENABLE_IO_URING
+	std::unique_ptr<IoRing> r(new IoRing());
+	r->ring = new struct io_uring;
+	int retstat = io_uring_queue_init(entries, r->ring, 0);
+	if (retstat < 0) {
+		delete r->ring;
+		r->ring = nullptr;
+		errno = -retstat;
+		return nullptr;
+	}
+	struct io_uring_probe *probe = io_uring_get_probe_ring(r->ring);
+	if (probe != NULL) {
+		r->resolve_ops = io_uring_opcode_supported(probe, IORING_OP_STATX)
+			&& io_uring_opcode_supported(probe, IORING_OP_OPENAT2);
+		io_uring_free_probe(probe);
+	}
+	r->running = true;
+	IoRing *self = r.get();
+	r->reaper = std::make_unique<std::thread>([self]() {
+			self->reap();
+		});
+	return r;
+#else
+	(void)entries;
+	errno = ENOSYS;
+	return nullptr;
+#endif
+}
+
+
+IoRing::~IoRing() {
+#ifdef ENABLE_IO_URING
+	if (this->ring == nullptr) {
+		return;
+	}
+	// Wake the reaper with a request that tells it to leave
+	this->running = false;
+	request_t *req = new request_t();
+	req->op = request_t::STOP;
+	this->submit(req);
+	this->reaper->join();
+
+	io_uring_queue_exit(this->ring);
+	delete this->ring;
+#endif
+}
+
+
+void IoRing::read(int fd, void *buf, size_t size, off_t offset,
+                  const completion &done) {
+	request_t *req = new request_t();
+	req->op = request_t::READ;
+	req->fd = fd;
+	req->buf = buf;
+	req->size = size;
+	req->offset = offset;
+	req->done = done;
+	this->submit(req);
+}
+
+
+void IoRing::write(int fd, const void *buf, size_t size, off_t offset,
+                   const completion &done) {
+	request_t *req = new request_t();
+	req->op = request_t::WRITE;
+	req->fd = fd;
+	req->buf = const_cast<void *>(buf);
+	req->size = size;
+	req->offset = offset;
+	req->done = done;
+	this->submit(req);
+}
+
+
+void IoRing::statx(int dirfd, const std::string &path, int flags, unsigned int mask,
+                   struct statx *statxbuf, const completion &done) {
+	request_t *req = new request_t();
+	req->op = request_t::STATX;
+	req->fd = dirfd;
+	req->path = path;
+	req->flags = flags;
+	req->mask = mask;
+	req->statxbuf = statxbuf;
+	req->done = done;
+	this->submit(req);
+}
+
+
+void IoRing::open_beneath(int dirfd, const std::string &path, int flags, mode_t mode,
+                          const completion &done) {
+	request_t *req = new request_t();
+	req->op = request_t::OPENAT2;
+	req->fd = dirfd;
+	req->path = path;
+#ifdef ENABLE_IO_URING
+	memset(&req->how, 0, sizeof(req->how));
+	req->how.flags = flags;
+	if ((flags & O_CREAT) || (flags & O_TMPFILE) == O_TMPFILE) {
+		req->how.mode = mode;
+	}
+	req->how.resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS;
+#else
+	(void)flags;
+	(void)mode;
+#endif
+	req->done = done;
+	this->submit(req);
+}
+
+
+void IoRing::close(int fd, const completion &done) {
+	request_t *req = new request_t();
+	req->op = request_t::CLOSE;
+	req->fd = fd;
+	req->done = done;
+	this->submit(req);
+}
+
+
+void IoRing::submit(request_t *req) {
+#ifdef ENABLE_IO_URING
+	int retstat = 0;
+	bool queued = false;
+	{
+		std::lock_guard<std::mutex> lock(this->submit_mux);
+		struct io_uring_sqe *sqe = io_uring_get_sqe(this->ring);
+		if (sqe == NULL) {
+			// The queue is full - hand everything to the kernel, that frees it
+			io_uring_submit(this->ring);
+			sqe = io_uring_get_sqe(this->ring);
+		}
+
+		if (sqe != NULL) {
+			switch (req->op) {
+			case request_t::READ:
+				io_uring_prep_read(sqe, req->fd, req->buf, req->size, req->offset);
+				break;
+			case request_t::WRITE:
+				io_uring_prep_write(sqe, req->fd, req->buf, req->size, req->offset);
+				break;
+			case request_t::STATX:
+				io_uring_prep_statx(sqe, req->fd, req->path.c_str(),
+				                    req->flags, req->mask, req->statxbuf);
+				break;
+			case request_t::OPENAT2:
+				io_uring_prep_openat2(sqe, req->fd, req->path.c_str(), &req->how);
+				break;
+			case request_t::CLOSE:
+				io_uring_prep_close(sqe, req->fd);
+				break;
+			case request_t::STOP:
+				io_uring_prep_nop(sqe);
+				break;
+			}
+			io_uring_sqe_set_data(sqe, req);
+			queued = true;
+			retstat = io_uring_submit(this->ring);
+		}
+	}
+
+	if (!queued) {
+		if (req->done) {
+			req->done(-EBUSY);
+		}
+		delete req;
+	} else if (retstat < 0) {
+		// The sqe stays in the ring and goes out with the next submit (or
+		// the reaper's), only its completion may free req.
+		syslog(LOG_WARNING, "io_uring submit failed: %s", strerror(-retstat));
+	}
+#else
+	// Without io_uring there are no rings to submit to
+	if (req->done) {
+		req->done(-ENOSYS);
+	}
+	delete req;
+#endif
+}
+
+
+void IoRing::reap() {
+#ifdef ENABLE_IO_URING
+	while (true) {
+		struct io_uring_cqe *cqe;
+		int retstat = io_uring_wait_cqe(this->ring, &cqe);
+		if (retstat == -EINTR) {
+			continue;
+		} else if (retstat < 0) {
+			// Giving up would leave every request in flight without a reply
+			syslog(LOG_ERR, "io_uring wait failed: %s", strerror(-retstat));
+			continue;
+		}
+		request_t *req = static_cast<request_t *>(io_uring_cqe_get_data(cqe));
+		int result = cqe->res;
+		io_uring_cqe_seen(this->ring, cqe);
+
+		bool stop = req->op == request_t::STOP && !this->running;
+		if (req->done) {
+			req->done(result);
+		}
+		delete req;
+		if (stop) {
+			break;
+		}
+
+		// Requests left in the ring by a failed submit
+		if (io_uring_sq_ready(this->ring) > 0) {
+			std::lock_guard<std::mutex> lock(this->submit_mux);
+			io_uring_submit(this->ring);
+		}
+	}
+#endif
+}
+
+}
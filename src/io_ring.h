@@ -0,0 +1,91 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+struct io_uring;
+
+namespace mammutfs {
+
+/**
+ * Asynchronous syscalls through io_uring.
+ *
+ * The calls are queued to the kernel and return immediately, the completion
+ * is called with the result of the syscall (>= 0 or -errno) from the reaper
+ * thread once the kernel finished it. So a fuse worker does not block on a
+ * round trip to the raids and many requests can be in flight at once.
+ *
+ * The completions are called one after another from a single thread and
+ * have to be short - they should do nothing but reply to fuse.
+ * All buffers have to stay valid until the completion was called.
+ */
+class IoRing {
+public:
+	using completion = std::function<void(int result)>;
+
+	/**
+	 * Set up a ring with the given number of submission entries.
+	 * Returns nullptr (with errno set) if the kernel or the build has no
+	 * io_uring support.
+	 */
+	static std::unique_ptr<IoRing> create(unsigned int entries);
+
+	~IoRing();
+
+	void read(int fd, void *buf, size_t size, off_t offset,
+	          const completion &done);
+
+	void write(int fd, const void *buf, size_t size, off_t offset,
+	           const completion &done);
+
+	/** statx(2) of path relative to dirfd */
+	void statx(int dirfd, const std::string &path, int flags, unsigned int mask,
+	           struct statx *statxbuf, const completion &done);
+
+	/**
+	 * openat2(2) of path beneath dirfd, without following any symlink
+	 * (RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS). flags may only contain what
+	 * openat2 accepts, see openat2_flags.
+	 */
+	void open_beneath(int dirfd, const std::string &path, int flags, mode_t mode,
+	                  const completion &done);
+
+	/**
+	 * If the kernel queues statx and openat2 - without them the paths have
+	 * to be resolved synchronously.
+	 */
+	bool can_resolve() const {
+		return this->resolve_ops;
+	}
+
+	void close(int fd, const completion &done);
+
+private:
+	IoRing();
+
+	struct request_t;
+
+	/** Hand a request to the kernel, it is deleted after its completion */
+	void submit(request_t *req);
+
+	/** The reaper thread, calls the completions */
+	void reap();
+
+	struct io_uring *ring;
+	bool resolve_ops = false;
+
+	/** The submission queue is not thread safe */
+	std::mutex submit_mux;
+
+	std::unique_ptr<std::thread> reaper;
+	std::atomic<bool> running { false };
+};
+
+}
@@ -0,0 +1,72 @@
+#include "kernel_cache.h"
+
+#include "thread_queue.h"
+
+#include <atomic>
+#include <memory>
+#include <thread>
+
+namespace mammutfs {
+
+namespace {
+
+struct invalidation_t {
+	KernelCache::TYPE type;
+	const Module *module;
+	std::string path;
+	/** Tells the worker to leave */
+	bool stop;
+};
+
+std::atomic<bool> running { false };
+KernelCache::notifier notify;
+SafeQueue<invalidation_t> queue;
+std::unique_ptr<std::thread> worker;
+
+void enqueue(KernelCache::TYPE type, const Module *module, const std::string &path) {
+	if (running) {
+		queue.enqueue(invalidation_t { type, module, path, false });
+	}
+}
+
+}
+
+
+void KernelCache::start(const notifier &n) {
+	if (running.exchange(true)) {
+		return;
+	}
+	notify = n;
+	worker = std::make_unique<std::thread>([]() {
+			invalidation_t inval;
+			while (queue.dequeue(inval) && !inval.stop) {
+				notify(inval.type, inval.module, inval.path);
+			}
+		});
+}
+
+
+void KernelCache::stop() {
+	if (!running.exchange(false)) {
+		return;
+	}
+	queue.enqueue(invalidation_t { TYPE::INODE, nullptr, "", true });
+	worker->join();
+	worker.reset();
+
+	// Whatever was enqueued after the stop marker cannot be delivered anymore
+	invalidation_t inval;
+	while (queue.dequeue(inval, false));
+}
+
+
+void KernelCache::invalidate_entry(const Module *module, const std::string &path) {
+	enqueue(TYPE::ENTRY, module, path);
+}
+
+
+void KernelCache::invalidate_inode(const Module *module, const std::string &path) {
+	enqueue(TYPE::INODE, module, path);
+}
+
+}
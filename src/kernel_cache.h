@@ -0,0 +1,50 @@
+#pragma once
+
+#include <functional>
+#include <string>
+
+namespace mammutfs {
+
+class Module;
+
+/**
+ * Pushes changes mammutfs made on its own into the kernel cache.
+ *
+ * The kernel caches entries, attributes and directory listings according to
+ * the cache policy of the module. Whenever mammutfs changes something behind
+ * the back of the kernel (for example the lister's anon mapping), it has to
+ * tell the kernel to forget the old state.
+ *
+ * The engine registers how to reach the kernel. The invalidations are sent
+ * from a thread of their own: the request that caused them may still hold
+ * the locks of the kernel, notifying from within it would deadlock.
+ */
+class KernelCache {
+public:
+	enum class TYPE {
+		ENTRY, //< the name was added, removed or renamed
+		INODE, //< attributes or contents changed
+	};
+
+	/**
+	 * Delivers a single invalidation to the kernel.
+	 * module is nullptr if path is relative to the mount instead of the module.
+	 */
+	using notifier = std::function<void(TYPE type,
+	                                    const Module *module,
+	                                    const std::string &path)>;
+
+	/** Start delivering invalidations, before that they are dropped */
+	static void start(const notifier &notify);
+
+	/** Stop delivering invalidations, pending ones are dropped */
+	static void stop();
+
+	/** The name at path was added, removed or renamed */
+	static void invalidate_entry(const Module *module, const std::string &path);
+
+	/** The attributes or the contents at path changed */
+	static void invalidate_inode(const Module *module, const std::string &path);
+};
+
+}
@@ -1,7 +1,11 @@
 #include "resolver.h"
 
 #include "mammut_fuse.h"
+#include "mammut_lowlevel.h"
 #include "mammut_config.h"
+#include "fd_cache.h"
+#include "raid_locator.h"
+#include "storage.h"
 
 #include "module/default.h"
 #include "module/anonymous.h"
@@ -49,7 +53,11 @@ int main(int argc, char **argv) {
 
 	// Hit the road
 	// This will fork, and afterwards call setup_main
-	return mammutfs::mammut_main(resolver, config);
+	if (config->engine() == "lowlevel") {
+		return mammutfs::mammut_lowlevel_main(resolver, config);
+	} else {
+		return mammutfs::mammut_main(resolver, config);
+	}
 }
 
 void setup_main() {
@@ -70,7 +78,7 @@ void setup_main() {
 	                         std::make_shared<mammutfs::Anonymous>(
 		                         config,
 		                         communicator,
-		                         anon_lister->get_mapping()));
+		                         anon_lister.get()));
 	resolver->registerModule("private",
 	                         std::make_shared<mammutfs::Private>(config, communicator));
 	resolver->registerModule("public",
@@ -83,6 +91,30 @@ void setup_main() {
 	// Filter the modules to the active ones
 	config->filterModules(resolver);
 
+	// Look for the homes of all modules at once, not one by one on first access
+	for (const auto &module : resolver->activatedModules()) {
+		module.second->prefetch_raid();
+	}
+
+	auto locator = mammutfs::RaidLocator::shared(config, mammutfs::Storage::shared(config));
+	communicator->register_void_command(
+		"RAIDRESCAN",
+		[locator](const std::string &/*data*/, std::string &/*resp*/) {
+			locator->refresh();
+		}, "Reread the raid index and look for the homes on the raids again");
+	communicator->register_void_command(
+		"RAIDS",
+		[locator](const std::string &/*data*/, std::string &resp) {
+			resp = locator->stats();
+		}, "Get the raids the homes of the modules were found on");
+
+	auto fd_cache = mammutfs::FdCache::shared(config, mammutfs::Storage::shared(config));
+	communicator->register_void_command(
+		"FDCACHE",
+		[fd_cache](const std::string &/*data*/, std::string &resp) {
+			resp = fd_cache->stats();
+		}, "Get the native fds of the open files and how often they were reopened");
+
 	std::stringstream ss;
 	ss << "New Mammutfs for user " << config->username()
 	   << " at " << config->mountpoint();
@@ -38,7 +38,10 @@ public:
 		auto it = changeables.find(key);
 		if (it != changeables.end()) {
 			// Change and notify
-			manvalues[it->first] = value;
+			{
+				std::lock_guard<std::mutex> lock(manvaluesaccess);
+				manvalues[it->first] = value;
+			}
 			for(const auto &f : it->second) {
 				f();
 			}
@@ -51,6 +54,7 @@ public:
 	// Drop the value that was manually overwritten either via command or commandline
 	// and read from configfile
 	void unset_value(const std::string &key) {
+		std::lock_guard<std::mutex> lock(manvaluesaccess);
 		manvalues.erase(key);
 	}
 
@@ -74,6 +78,86 @@ public:
 	std::string username() { return this->lookupValue<std::string>("username"); }
 	std::string mountpoint() { return this->lookupValue<std::string>("mountpoint"); }
 	std::string anon_mapping_file() { return this->lookupValue<std::string>("anon_mapping_file"); }
+	/** "highlevel" (path based) or "lowlevel" (inode based) fuse engine */
+	std::string engine() {
+		std::string engine;
+		if (this->lookupValue<std::string>("engine", engine, true)) {
+			return engine;
+		} else {
+			return "highlevel";
+		}
+	}
+	/** The largest write request the kernel may send, in bytes */
+	unsigned int fuse_max_write() {
+		unsigned int max_write;
+		if (this->lookupValue<unsigned int>("fuse_max_write", max_write, true)) {
+			return max_write;
+		} else {
+			return 1024 * 1024;
+		}
+	}
+	/** "sync" or "uring" - how the lowlevel engine performs the syscalls */
+	std::string io_backend() {
+		std::string backend;
+		if (this->lookupValue<std::string>("io_backend", backend, true)) {
+			return backend;
+		} else {
+			return "sync";
+		}
+	}
+	/** "posix" or "memory" - where the modules keep the files */
+	std::string storage() {
+		std::string storage;
+		if (this->lookupValue<std::string>("storage", storage, true)) {
+			return storage;
+		} else {
+			return "posix";
+		}
+	}
+	/** Splice file data between /dev/fuse and the raids instead of copying */
+	bool fuse_splice() {
+		std::string splice;
+		if (this->lookupValue<std::string>("fuse_splice", splice, true)) {
+			return splice != "false";
+		} else {
+			return true;
+		}
+	}
+	/** If reads and writes of a module may bypass mammutfs in the kernel */
+	bool passthrough(const std::string &module) {
+		return this->module_flag(module, "passthrough");
+	}
+
+	/**
+	 * A per module option: "<module>_<key>", falling back to the
+	 * module independent "<key>" and finally to the given default.
+	 */
+	template<typename _T>
+	_T module_value(const std::string &module,
+	                const std::string &key,
+	                const _T &default_value) const {
+		_T value;
+		if (this->lookupValue<_T>((module + "_" + key).c_str(), value, true)
+		    || this->lookupValue<_T>(key.c_str(), value, true)) {
+			return value;
+		} else {
+			return default_value;
+		}
+	}
+
+	/** A per module option that is "true" or "false" */
+	bool module_flag(const std::string &module, const std::string &key) const {
+		return this->module_value<std::string>(module, key, "false") == "true";
+	}
+	int fuse_threads() {
+		int threads;
+		if (this->lookupValue<int>("fuse_threads", threads, true)) {
+			return threads;
+		} else {
+			// backward compability: the old default was singlethreaded
+			return 1;
+		}
+	}
 
 	uid_t anon_uid;
 	uid_t anon_gid;
@@ -89,26 +173,27 @@ public:
 		return t;
 	}
 
-	#ifndef ENABLE_CONFIG_DEBUG
-	mutable std::stringstream voidstream;
-	#endif
 	std::ostream &log() const {
 		#ifdef ENABLE_CONFIG_DEBUG
 		return std::cout;
 		#else
+		// Every fuse worker gets its own sink, so lookups can run concurrently
+		static thread_local std::stringstream voidstream;
 		// Clean it - so it wont overflow
-		this->voidstream.str(std::string());
-		return this->voidstream;
+		voidstream.str(std::string());
+		return voidstream;
 		#endif
 	}
 
 	template <typename _T>
 	bool lookupValue(const char *key, _T &value, bool ignore_error = false) const {
 		this->log() << "Looking for \"" << key << "\"";
+		// The buffer is local, since lookups happen from all fuse workers
+		std::istringstream buf;
 		{
+			std::lock_guard<std::mutex> lock(manvaluesaccess);
 			auto it = manvalues.find(key);
 			if (it != manvalues.end()) {
-				buf.clear();
 				buf.str(it->second);
 				buf >> value;
 				this->log() << " [man] " << value << std::endl;
@@ -118,7 +203,6 @@ public:
 		{
 			auto it = cmdline.find(key);
 			if (it != cmdline.end()) {
-				buf.clear();
 				buf.str(it->second);
 				buf >> value;
 				this->log() << " [cmd] " << value << std::endl;
@@ -130,7 +214,6 @@ public:
 			const char *tmp;
 			bool state = config->lookupValue(key, tmp);
 			if (state) {
-				buf.clear();
 				buf.str(tmp);
 				buf >> value;
 				this->log() << " [file] " << value << std::endl;
@@ -154,7 +237,8 @@ public:
 
 private:
 	mutable std::mutex libconfigaccess;
-	mutable std::istringstream buf;
+	// manvalues can be changed at runtime through the communicator
+	mutable std::mutex manvaluesaccess;
 
 	std::unordered_map<std::string, std::string> manvalues;
 	std::unordered_map<std::string, std::string> cmdline;
@@ -1,7 +1,6 @@
-#define FUSE_USE_VERSION 26
-
 #include "mammut_fuse.h"
 
+#include "kernel_cache.h"
 #include "mammut_config.h"
 
 #include <vector>
@@ -19,6 +18,7 @@ namespace mammutfs {
 static struct userdata_t {
 	std::shared_ptr<ModuleResolver> resolver;
 	std::shared_ptr<MammutConfig> config;
+	struct fuse *fuse;
 } userdata;
 
 #define GETMODULE(path) \
@@ -27,7 +27,8 @@ static struct userdata_t {
 	if (module == NULL) { return -ENOENT; }
 
 
-static int mammut_getattr(const char *path, struct stat *statbuf) {
+static int mammut_getattr(const char *path, struct stat *statbuf,
+                          struct fuse_file_info *) {
 	GETMODULE(path);
 	return module->getattr(subdir, statbuf);
 }
@@ -67,8 +68,15 @@ static int mammut_symlink(const char *path, const char *link) {
 	return -ENOTSUP;
 }
 
-static int mammut_rename(const char *path, const char *newpath) {
+static int mammut_rename(const char *path, const char *newpath,
+                         unsigned int flags) {
+	// RENAME_EXCHANGE and RENAME_NOREPLACE are not supported by the modules
+	if (flags != 0) {
+		return -EINVAL;
+	}
+
 	std::string from_translated;
+	Module *from_module;
 	{
 		GETMODULE(path);
 		int retval = module->translatepath(subdir, from_translated);
@@ -76,10 +84,16 @@ static int mammut_rename(const char *path, const char *newpath) {
 			std::cout << "Could not translate from path (" << path << "), " << subdir << std::endl;
 			return retval;
 		}
+		from_module = module;
 	}
 
 	GETMODULE(newpath);
-	return module->rename(from_translated.c_str(), subdir, path, newpath);
+	int retval = module->rename(from_translated.c_str(), subdir, path, newpath);
+	if (retval == 0 && from_module != module) {
+		from_module->attr_cache().invalidate_tree(from_translated);
+		from_module->attr_cache().invalidate_entry(from_translated);
+	}
+	return retval;
 }
 
 static int mammut_link(const char *path, const char *newpath) {
@@ -89,17 +103,20 @@ static int mammut_link(const char *path, const char *newpath) {
 	return -ENOTSUP;
 }
 
-static int mammut_chmod(const char *path, mode_t mode) {
+static int mammut_chmod(const char *path, mode_t mode,
+                        struct fuse_file_info *) {
 	GETMODULE(path);
 	return module->chmod(subdir, mode);
 }
 
-static int mammut_chown(const char *path, uid_t uid, gid_t gid) {
+static int mammut_chown(const char *path, uid_t uid, gid_t gid,
+                        struct fuse_file_info *) {
 	GETMODULE(path);
 	return module->chown(subdir, uid, gid);
 }
 
-static int mammut_truncate(const char *path, off_t newsize) {
+static int mammut_truncate(const char *path, off_t newsize,
+                           struct fuse_file_info *) {
 	GETMODULE(path);
 	return module->truncate(subdir, newsize);
 }
@@ -127,6 +144,23 @@ static int mammut_write(const char *path,
 	return module->write(subdir, buf, size, offset, fi);
 }
 
+static int mammut_read_buf(const char *path,
+                           struct fuse_bufvec **bufp,
+                           size_t size,
+                           off_t offset,
+                           struct fuse_file_info *fi) {
+	GETMODULE(path);
+	return module->read_buf(subdir, bufp, size, offset, fi);
+}
+
+static int mammut_write_buf(const char *path,
+                            struct fuse_bufvec *buf,
+                            off_t offset,
+                            struct fuse_file_info *fi) {
+	GETMODULE(path);
+	return module->write_buf(subdir, buf, offset, fi);
+}
+
 static int mammut_statfs(const char *path, struct statvfs *statv) {
 	GETMODULE(path);
 	return module->statfs(subdir, statv);
@@ -149,6 +183,31 @@ static int mammut_fsync(const char *path,
 	return module->fsync(subdir, datasync, fi);
 }
 
+static off_t mammut_lseek(const char *path,
+                          off_t off,
+                          int whence,
+                          struct fuse_file_info *fi) {
+	GETMODULE(path);
+	return module->lseek(subdir, off, whence, fi);
+}
+
+static ssize_t mammut_copy_file_range(const char *path_in,
+                                      struct fuse_file_info *fi_in,
+                                      off_t off_in,
+                                      const char *path_out,
+                                      struct fuse_file_info *fi_out,
+                                      off_t off_out,
+                                      size_t size,
+                                      int flags) {
+	const char *subdir_in;
+	Module *from_module = userdata.resolver->getModuleFromPath(path_in, subdir_in);
+	if (from_module == NULL) { return -ENOENT; }
+
+	GETMODULE(path_out);
+	return module->copy_file_range(from_module, subdir_in, fi_in, off_in,
+	                               subdir, fi_out, off_out, size, flags);
+}
+
 static int mammut_setxattr(const char *path,
                            const char *name,
                            const char *value,
@@ -185,9 +244,10 @@ static int mammut_readdir(const char *path,
                           void *buf,
                           fuse_fill_dir_t filler,
                           off_t offset,
-                          struct fuse_file_info *fi) {
+                          struct fuse_file_info *fi,
+                          enum fuse_readdir_flags flags) {
 	GETMODULE(path)
-	return module->readdir(subdir, buf, filler, offset, fi);
+	return module->readdir(subdir, buf, filler, offset, fi, flags);
 }
 
 static int mammut_releasedir(const char *path, struct fuse_file_info *fi) {
@@ -215,12 +275,34 @@ static int mammut_create(const char *path,
 	return module->create(subdir, mode, fi);
 }
 
-static int mammut_utimens(const char *path, const struct timespec tv[2]) {
+static int mammut_utimens(const char *path, const struct timespec tv[2],
+                          struct fuse_file_info *) {
 	GETMODULE(path);
 	return module->utimens(subdir, tv);
 }
 
-void *mammut_init(struct fuse_conn_info *conn) {
+/**
+ * Deliver an invalidation of the KernelCache to the kernel.
+ *
+ * The highlevel api can only invalidate inodes - a changed name invalidates
+ * its directory, the name itself stays until its entry_timeout.
+ */
+static void notify_kernel(KernelCache::TYPE type,
+                          const Module *module,
+                          const std::string &modpath) {
+	std::string path = modpath;
+	if (module != nullptr
+	    && !userdata.resolver->mount_path(module, modpath, path)) {
+		return;
+	}
+	if (type == KernelCache::TYPE::ENTRY) {
+		size_t split = path.find_last_of('/');
+		path = (split == 0 || split == std::string::npos) ? "/" : path.substr(0, split);
+	}
+	fuse_invalidate_path(userdata.fuse, path.c_str());
+}
+
+void *mammut_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
 	prctl(PR_SET_NAME, "mammutfs_fuse", 0, 0, 0);
 	if (conn->capable & FUSE_CAP_EXPORT_SUPPORT) {
 		conn->want |= FUSE_CAP_EXPORT_SUPPORT;
@@ -228,13 +310,34 @@ void *mammut_init(struct fuse_conn_info *conn) {
 		syslog(LOG_ERR, "ERROR NOT SETTING FUSE_CAP_EXPORT_SUPPORT");
 	}
 
+	// Move file data between /dev/fuse and the raids with splice(2).
+	// Without kernel support libfuse silently copies instead.
+	if (userdata.config->fuse_splice()) {
+		conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ
+		                               | FUSE_CAP_SPLICE_WRITE
+		                               | FUSE_CAP_SPLICE_MOVE);
+	}
+
+	// Copy the underlying inodes instead of giving us new ones.
+	cfg->use_ino = 1;
+
+	// The highlevel api knows a single cache policy for all modules, only
+	// kernel_cache and cache_readdir are set per module on open.
+	userdata.config->lookupValue("attr_timeout", cfg->attr_timeout, true);
+	userdata.config->lookupValue("entry_timeout", cfg->entry_timeout, true);
+	userdata.config->lookupValue("negative_timeout", cfg->negative_timeout, true);
+
 	setup_main();
 
+	userdata.fuse = fuse_get_context()->fuse;
+	KernelCache::start(notify_kernel);
+
 	return &userdata;
 }
 
 void mammut_destroy(void *userdata) {
 	(void)userdata;
+	KernelCache::stop();
 }
 
 #undef GETMODULE
@@ -247,22 +350,35 @@ int mammut_main (std::shared_ptr<ModuleResolver> resolver,
 	userdata.resolver = resolver;
 	userdata.config = config;
 
+	if (config->io_backend() != "sync") {
+		std::cerr << "io_backend " << config->io_backend()
+		          << " needs the lowlevel engine, using sync" << std::endl;
+	}
+
 	std::vector<const char *> fuseargs;
 	//fuseargs.push_back(config->self);
 	//fuseargs.push_back("mammutfs");
 
 	fuseargs.push_back("-ofsname=mammutfs");     // We want to have the name mammutfs
 	fuseargs.push_back("-osubtype=fuse.mammutfs");  // We want to have the name mammutfs
-	fuseargs.push_back("-ononempty");            // We need to mount over the original mount-fuckups
+	// fuse3 does always mount over the original mount-fuckups, -ononempty is gone
 	fuseargs.push_back("-odefault_permissions"); // To allow us to set permissions
 	fuseargs.push_back("-oallow_other");         // To enable smb
-	fuseargs.push_back("-ouse_ino");             // Copy the underlying inodes instead of giving us new ones. Might give us more inodes!
 	// fuseargs.push_back("-onoforget");            // Do not forget inodes. keep them forever
 	                                               //- this might be enabled, if nfs is making troubles!
 	//fuseargs.push_back("-d");                    // Enable FUSE-DEBUG!
-	fuseargs.push_back("-obig_writes");            // HUGHE PERFORMANCE IMPACT! now at ceph level
-
-	fuseargs.push_back("-s");                      // Run singlethreaded to get rid of these nasty threads
+	// -obig_writes is always on with fuse3 - HUGHE PERFORMANCE IMPACT! now at ceph level
+	// -ouse_ino is set in mammut_init
+
+	// Every worker serves one request at a time - a slow backend syscall
+	// will only block its own worker if there is more than one.
+	int threads = config->fuse_threads();
+	std::string max_threads = "-omax_threads=" + std::to_string(threads);
+	if (threads <= 1) {
+		fuseargs.push_back("-s");                  // Run singlethreaded to get rid of these nasty threads
+	} else {
+		fuseargs.push_back(max_threads.c_str());
+	}
 
 	if (!config->deamonize()) {
 		fuseargs.push_back("-f");
@@ -282,7 +398,6 @@ int mammut_main (std::shared_ptr<ModuleResolver> resolver,
 	memset(&mammut_ops, 0, sizeof(mammut_ops));
 	mammut_ops.getattr  = mammut_getattr;
 	mammut_ops.readlink = mammut_readlink;
-	mammut_ops.getdir   = NULL;
 	mammut_ops.mknod    = NULL;
 	mammut_ops.mkdir    = mammut_mkdir;
 	mammut_ops.unlink   = mammut_unlink;
@@ -296,11 +411,17 @@ int mammut_main (std::shared_ptr<ModuleResolver> resolver,
 	mammut_ops.open     = mammut_open;
 	mammut_ops.read     = mammut_read;
 	mammut_ops.write    = mammut_write;
+	if (config->fuse_splice()) {
+		mammut_ops.read_buf  = mammut_read_buf;
+		mammut_ops.write_buf = mammut_write_buf;
+	}
 
 	mammut_ops.statfs  = mammut_statfs;
 	mammut_ops.flush   = mammut_flush;
 	mammut_ops.release = mammut_release;
 	mammut_ops.fsync   = mammut_fsync;
+	mammut_ops.lseek   = mammut_lseek;
+	mammut_ops.copy_file_range = mammut_copy_file_range;
 
 	mammut_ops.setxattr    = mammut_setxattr;
 	mammut_ops.getxattr    = mammut_getxattr;
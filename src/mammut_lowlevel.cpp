@@ -0,0 +1,1312 @@
+#include "mammut_lowlevel.h"
+
+#include "arena.h"
+#include "inode_table.h"
+#include "io_ring.h"
+#include "kernel_cache.h"
+#include "mammut_config.h"
+
+#include <fuse_lowlevel.h>
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <vector>
+
+#include <sys/prctl.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+// Forward declare to create the main mount point
+extern void setup_main();
+
+namespace mammutfs {
+
+/** Number of requests that can be queued to the io_uring at once */
+static const unsigned int IO_RING_ENTRIES = 256;
+
+/** Inode number for directory entries that were listed without attributes */
+static const ino_t UNKNOWN_INO = 0xffffffff;
+
+static struct lowlevel_userdata_t {
+	std::shared_ptr<ModuleResolver> resolver;
+	std::shared_ptr<MammutConfig> config;
+	InodeTable inodes;
+	struct fuse_session *se = nullptr;
+	/** Set with io_backend = "uring" */
+	std::unique_ptr<IoRing> ring;
+	/** If the kernel accepted passthrough and we may register backing files */
+	std::atomic<bool> passthrough { false };
+} userdata;
+
+/** An open directory */
+struct dir_handle_t {
+	/** The directory handle as seen by the module */
+	struct fuse_file_info fi;
+};
+
+#define GETNODE(ino) \
+	Module *module; \
+	Arena::scope scope; \
+	std::string &path = scope.string(); \
+	if (!userdata.inodes.resolve(ino, module, path)) { \
+		fuse_reply_err(req, ENOENT); \
+		return; \
+	}
+
+#define GETCHILD(parent, name) \
+	Module *module; \
+	Arena::scope scope; \
+	std::string &path = scope.string(); \
+	bool module_root; \
+	if (!resolve_child(parent, name, module, path, module_root)) { \
+		fuse_reply_err(req, ENOENT); \
+		return; \
+	}
+
+/**
+ * Find the module and the module relative path of parent/name.
+ *
+ * In the root every entry is a module of its own - unless there is only a
+ * single module, then the mount root is the module root.
+ */
+static bool resolve_child(fuse_ino_t parent, const char *name,
+                          Module *&module, std::string &path,
+                          bool &module_root, std::string *raw = nullptr) {
+	Arena::scope scope;
+	std::string &parent_raw = scope.string();
+	if (!userdata.inodes.resolve(parent, module, path,
+	                             raw ? &parent_raw : nullptr)) {
+		return false;
+	}
+	if (raw != nullptr) {
+		*raw = (parent_raw == "/" ? "" : parent_raw) + "/" + name;
+	}
+
+	if (parent == FUSE_ROOT_ID && !userdata.resolver->is_single_module()) {
+		module = userdata.resolver->getModule(name);
+		path = "/";
+		module_root = true;
+		return module != nullptr;
+	}
+
+	module_root = false;
+	if (path != "/") {
+		path += "/";
+	}
+	path += name;
+	return true;
+}
+
+/** The modules return -errno, fuse wants to have it positive */
+static void reply_status(fuse_req_t req, int retstat) {
+	fuse_reply_err(req, (retstat < 0) ? -retstat : 0);
+}
+
+/**
+ * Register the lookup of parent/name, whose attributes are in e.attr, in the
+ * inode table. If the entry could not be replied, the lookup has to be
+ * forgotten again.
+ */
+static void register_entry(fuse_ino_t parent, const char *name,
+                           Module *module, bool module_root,
+                           struct fuse_entry_param &e) {
+	e.ino = userdata.inodes.lookup(parent, name,
+	                               module_root ? module : nullptr,
+	                               e.attr, &e.generation);
+	e.attr_timeout = module->cache_policy().attr_timeout;
+	e.entry_timeout = module->cache_policy().entry_timeout;
+}
+
+/** Fill the entry for parent/name, see register_entry */
+static int fill_entry(fuse_ino_t parent, const char *name,
+                      Module *module, const std::string &path,
+                      bool module_root, struct fuse_entry_param &e) {
+	memset(&e, 0, sizeof(e));
+	int retstat = module->getattr(path.c_str(), &e.attr);
+	if (retstat != 0) {
+		return retstat;
+	}
+	register_entry(parent, name, module, module_root, e);
+	return 0;
+}
+
+/** If the engine may do the syscalls of the module on the io_uring */
+static bool use_ring(Module *module) {
+	return userdata.ring && module->plain_io();
+}
+
+using getattr_completion = std::function<void(int retstat, const struct stat &)>;
+
+/**
+ * Module::getattr on the io_uring.
+ *
+ * Returns false if the module has to be asked synchronously, else done is
+ * called once the attributes are there.
+ */
+static bool ring_getattr(Module *module, const std::string &path,
+                         const getattr_completion &done) {
+	std::string translated;
+	if (!use_ring(module)
+	    || path == "/"
+	    || module->translatepath(path, translated) != 0) {
+		return false;
+	}
+
+	module->flush_writes(translated);
+	struct stat cached;
+	int retstat;
+	if (module->cached_attr(translated, &cached, retstat)) {
+		done(retstat, cached);
+		return true;
+	}
+
+	// Only paths that resolve beneath the home are queued - a symlinked
+	// directory must not lead out of it
+	std::string rel;
+	int root = module->get_storage()->root_fd(translated, rel);
+	if (root < 0 || !userdata.ring->can_resolve()) {
+		return false;
+	}
+
+	uint64_t ticket = module->attr_cache().ticket();
+	auto stx = std::make_shared<struct statx>();
+	IoRing::completion finish = [stx, done, module, translated, ticket](int result) {
+		struct stat statbuf;
+		statx_to_stat(*stx, statbuf);
+		AttrCache &cache = module->attr_cache();
+		if (result == 0) {
+			cache.put(translated, statbuf, ticket);
+		} else if (result == -ENOENT && !cache.check_parent()) {
+			// The mtime of the parent would need a stat of its own
+			cache.put_negative(translated, { 0, 0 }, ticket);
+		}
+		done(result, statbuf);
+	};
+	int flags = AT_SYMLINK_NOFOLLOW | module->statx_sync();
+	unsigned int mask = module->statx_mask();
+
+	rel.erase(rel.find_last_not_of('/') + 1);
+	size_t slash = rel.rfind('/');
+	if (slash == std::string::npos) {
+		userdata.ring->statx(root, rel, flags, mask, stx.get(), finish);
+		return true;
+	}
+
+	// statx cannot resolve beneath a dirfd: the directory is opened beneath
+	// the home first - as PosixStorage does - and the name stat-ed within it
+	std::string name = rel.substr(slash + 1);
+	rel.resize(slash);
+	userdata.ring->open_beneath(root, rel, O_PATH | O_DIRECTORY | O_CLOEXEC, 0,
+		[stx, name, flags, mask, finish](int dirfd) {
+			if (dirfd < 0) {
+				finish(dirfd);
+				return;
+			}
+			userdata.ring->statx(dirfd, name, flags, mask, stx.get(),
+				[dirfd, finish](int result) {
+					userdata.ring->close(dirfd, IoRing::completion());
+					finish(result);
+				});
+		});
+	return true;
+}
+
+/** Reply a failed lookup - the kernel may cache that the name does not exist */
+static void reply_negative(fuse_req_t req, Module *module, int retstat) {
+	double timeout = module->cache_policy().negative_timeout;
+	if (retstat != -ENOENT || timeout <= 0) {
+		reply_status(req, retstat);
+		return;
+	}
+	struct fuse_entry_param e;
+	memset(&e, 0, sizeof(e));
+	e.ino = 0;
+	e.entry_timeout = timeout;
+	fuse_reply_entry(req, &e);
+}
+
+/**
+ * Look up an inode the kernel forgot - or that is from an earlier run - from
+ * what the inode store remembers of it and its parents. Fails if the backing
+ * file is not there anymore, the handle is stale then.
+ */
+static bool restore_inode(fuse_ino_t ino) {
+	struct stored_t {
+		fuse_ino_t ino;
+		fuse_ino_t parent;
+		std::string name;
+		dev_t dev;
+		ino_t backing_ino;
+		uint64_t generation;
+	};
+	std::vector<stored_t> chain;
+	fuse_ino_t current = ino;
+	while (!userdata.inodes.known(current)) {
+		stored_t s;
+		s.ino = current;
+		if (chain.size() > 4096
+		    || !userdata.inodes.persisted(current, s.parent, s.name,
+		                                  s.dev, s.backing_ino, s.generation)) {
+			return false;
+		}
+		current = s.parent;
+		chain.push_back(std::move(s));
+	}
+
+	// From the topmost known parent down, the nodes live as long as ino
+	fuse_ino_t registered = 0;
+	for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+		Module *module;
+		Arena::scope scope;
+		std::string &path = scope.string();
+		bool module_root;
+		struct stat st;
+		uint64_t generation;
+		if (!resolve_child(it->parent, it->name.c_str(), module, path, module_root)
+		    || module->getattr(path.c_str(), &st) != 0
+		    || st.st_dev != it->dev || st.st_ino != it->backing_ino) {
+			break;
+		}
+		fuse_ino_t found = userdata.inodes.lookup(it->parent, it->name,
+		                                          module_root ? module : nullptr,
+		                                          st, &generation, 0);
+		if (found == 0) {
+			// The topmost parent was forgotten meanwhile
+			break;
+		}
+		registered = found;
+		if (found != it->ino || generation != it->generation) {
+			break;
+		}
+		if (found == ino) {
+			return true;
+		}
+	}
+	if (registered != 0) {
+		// Drops the nodes that were registered for nothing
+		userdata.inodes.forget(registered, 0);
+	}
+	return false;
+}
+
+/** "." and ".." are looked up by nfs to reconnect its file handles */
+static void lookup_self(fuse_req_t req, fuse_ino_t ino) {
+	if (!userdata.inodes.known(ino) && !restore_inode(ino)) {
+		fuse_reply_err(req, ESTALE);
+		return;
+	}
+	GETNODE(ino);
+	struct fuse_entry_param e;
+	memset(&e, 0, sizeof(e));
+	int retstat = module->getattr(path.c_str(), &e.attr);
+	if (retstat != 0) {
+		reply_status(req, retstat);
+		return;
+	}
+	if (!userdata.inodes.ref(ino)) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	e.ino = ino;
+	e.generation = userdata.inodes.generation(ino);
+	e.attr_timeout = module->cache_policy().attr_timeout;
+	e.entry_timeout = module->cache_policy().entry_timeout;
+	if (fuse_reply_entry(req, &e) == -ENOENT) {
+		userdata.inodes.forget(ino, 1);
+	}
+}
+
+static void mammut_ll_lookup(fuse_req_t req, fuse_ino_t parent,
+                             const char *name) {
+	if (strcmp(name, ".") == 0) {
+		lookup_self(req, parent);
+		return;
+	} else if (strcmp(name, "..") == 0) {
+		fuse_ino_t grandparent;
+		if (!userdata.inodes.parent(parent, grandparent)) {
+			fuse_reply_err(req, ENOENT);
+			return;
+		}
+		lookup_self(req, grandparent);
+		return;
+	}
+
+	GETCHILD(parent, name);
+	std::string child = name;
+	bool queued = ring_getattr(module, path,
+		[req, parent, child, module, module_root](int retstat, const struct stat &statbuf) {
+			if (retstat != 0) {
+				reply_negative(req, module, retstat);
+				return;
+			}
+			struct fuse_entry_param e;
+			memset(&e, 0, sizeof(e));
+			e.attr = statbuf;
+			register_entry(parent, child.c_str(), module, module_root, e);
+			if (fuse_reply_entry(req, &e) == -ENOENT) {
+				userdata.inodes.forget(e.ino, 1);
+			}
+		});
+	if (queued) {
+		return;
+	}
+
+	struct fuse_entry_param e;
+	int retstat = fill_entry(parent, name, module, path, module_root, e);
+	if (retstat != 0) {
+		reply_negative(req, module, retstat);
+	} else if (fuse_reply_entry(req, &e) == -ENOENT) {
+		userdata.inodes.forget(e.ino, 1);
+	}
+}
+
+static void mammut_ll_forget(fuse_req_t req, fuse_ino_t ino,
+                             uint64_t nlookup) {
+	userdata.inodes.forget(ino, nlookup);
+	fuse_reply_none(req);
+}
+
+static void mammut_ll_forget_multi(fuse_req_t req, size_t count,
+                                   struct fuse_forget_data *forgets) {
+	for (size_t i = 0; i < count; ++i) {
+		userdata.inodes.forget(forgets[i].ino, forgets[i].nlookup);
+	}
+	fuse_reply_none(req);
+}
+
+static void mammut_ll_getattr(fuse_req_t req, fuse_ino_t ino,
+                              struct fuse_file_info *) {
+	GETNODE(ino);
+	bool queued = ring_getattr(module, path,
+		[req, module](int retstat, const struct stat &statbuf) {
+			if (retstat != 0) {
+				reply_status(req, retstat);
+			} else {
+				fuse_reply_attr(req, &statbuf, module->cache_policy().attr_timeout);
+			}
+		});
+	if (queued) {
+		return;
+	}
+
+	struct stat statbuf;
+	int retstat = module->getattr(path.c_str(), &statbuf);
+	if (retstat != 0) {
+		reply_status(req, retstat);
+		return;
+	}
+	fuse_reply_attr(req, &statbuf, module->cache_policy().attr_timeout);
+}
+
+static struct timespec setattr_time(int to_set, int set, int set_now,
+                                    const struct timespec &value) {
+	struct timespec tv;
+	tv.tv_sec = 0;
+	if (to_set & set_now) {
+		tv.tv_nsec = UTIME_NOW;
+	} else if (to_set & set) {
+		tv = value;
+	} else {
+		tv.tv_nsec = UTIME_OMIT;
+	}
+	return tv;
+}
+
+static void mammut_ll_setattr(fuse_req_t req, fuse_ino_t ino,
+                              struct stat *attr, int to_set,
+                              struct fuse_file_info *) {
+	GETNODE(ino);
+	int retstat = 0;
+	if (to_set & FUSE_SET_ATTR_MODE) {
+		retstat = module->chmod(path.c_str(), attr->st_mode);
+	}
+	if (retstat == 0 && (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))) {
+		uid_t uid = (to_set & FUSE_SET_ATTR_UID) ? attr->st_uid : -1;
+		gid_t gid = (to_set & FUSE_SET_ATTR_GID) ? attr->st_gid : -1;
+		retstat = module->chown(path.c_str(), uid, gid);
+	}
+	if (retstat == 0 && (to_set & FUSE_SET_ATTR_SIZE)) {
+		retstat = module->truncate(path.c_str(), attr->st_size);
+	}
+	if (retstat == 0 && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))) {
+		struct timespec tv[2];
+		tv[0] = setattr_time(to_set, FUSE_SET_ATTR_ATIME,
+		                     FUSE_SET_ATTR_ATIME_NOW, attr->st_atim);
+		tv[1] = setattr_time(to_set, FUSE_SET_ATTR_MTIME,
+		                     FUSE_SET_ATTR_MTIME_NOW, attr->st_mtim);
+		retstat = module->utimens(path.c_str(), tv);
+	}
+	if (retstat != 0) {
+		reply_status(req, retstat);
+		return;
+	}
+
+	struct stat statbuf;
+	retstat = module->getattr(path.c_str(), &statbuf);
+	if (retstat != 0) {
+		reply_status(req, retstat);
+		return;
+	}
+	fuse_reply_attr(req, &statbuf, module->cache_policy().attr_timeout);
+}
+
+static void mammut_ll_readlink(fuse_req_t req, fuse_ino_t) {
+	// Same as the highlevel api - symlinks are not supported at all
+	fuse_reply_err(req, ENOTSUP);
+}
+
+static void mammut_ll_mkdir(fuse_req_t req, fuse_ino_t parent,
+                            const char *name, mode_t mode) {
+	GETCHILD(parent, name);
+	int retstat = module->mkdir(path.c_str(), mode);
+	if (retstat != 0) {
+		reply_status(req, retstat);
+		return;
+	}
+
+	struct fuse_entry_param e;
+	retstat = fill_entry(parent, name, module, path, module_root, e);
+	if (retstat != 0) {
+		reply_status(req, retstat);
+	} else if (fuse_reply_entry(req, &e) == -ENOENT) {
+		userdata.inodes.forget(e.ino, 1);
+	}
+}
+
+static void mammut_ll_unlink(fuse_req_t req, fuse_ino_t parent,
+                             const char *name) {
+	GETCHILD(parent, name);
+	int retstat = module->unlink(path.c_str());
+	if (retstat == 0) {
+		userdata.inodes.unlink(parent, name);
+	}
+	reply_status(req, retstat);
+}
+
+static void mammut_ll_rmdir(fuse_req_t req, fuse_ino_t parent,
+                            const char *name) {
+	GETCHILD(parent, name);
+	int retstat = module->rmdir(path.c_str());
+	if (retstat == 0) {
+		userdata.inodes.unlink(parent, name);
+	}
+	reply_status(req, retstat);
+}
+
+static void mammut_ll_symlink(fuse_req_t req, const char *,
+                              fuse_ino_t, const char *) {
+	fuse_reply_err(req, ENOTSUP);
+}
+
+static void mammut_ll_link(fuse_req_t req, fuse_ino_t,
+                           fuse_ino_t, const char *) {
+	fuse_reply_err(req, ENOTSUP);
+}
+
+static void mammut_ll_rename(fuse_req_t req,
+                             fuse_ino_t parent, const char *name,
+                             fuse_ino_t newparent, const char *newname,
+                             unsigned int flags) {
+	// RENAME_EXCHANGE and RENAME_NOREPLACE are not supported by the modules
+	if (flags != 0) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+
+	Module *from_module, *to_module;
+	std::string from_path, to_path, from_raw, to_raw;
+	bool module_root;
+	if (!resolve_child(parent, name, from_module, from_path, module_root, &from_raw)
+	    || !resolve_child(newparent, newname, to_module, to_path, module_root, &to_raw)) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+
+	std::string from_translated;
+	int retstat = from_module->translatepath(from_path, from_translated);
+	if (retstat) {
+		std::cout << "Could not translate from path (" << from_raw << "), "
+		          << from_path << std::endl;
+		reply_status(req, retstat);
+		return;
+	}
+
+	retstat = to_module->rename(from_translated.c_str(), to_path.c_str(),
+	                            from_raw.c_str(), to_raw.c_str());
+	if (retstat == 0) {
+		userdata.inodes.rename(parent, name, newparent, newname);
+		if (from_module != to_module) {
+			from_module->attr_cache().invalidate_tree(from_translated);
+			from_module->attr_cache().invalidate_entry(from_translated);
+		}
+	}
+	reply_status(req, retstat);
+}
+
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 16)
+/**
+ * Let the kernel read and write the backing file of an open file directly.
+ *
+ * Returns the backing id, that has to be closed once the open is replied -
+ * the kernel keeps its own reference to the file.
+ * Any failure leaves the file on the normal path through the module.
+ */
+static int open_passthrough(fuse_req_t req, Module *module,
+                            struct fuse_file_info *fi) {
+	if (!userdata.passthrough || !module->passthrough()) {
+		return 0;
+	}
+	int fd = module->backing_fd(fi);
+	if (fd < 0) {
+		return 0;
+	}
+	// The kernel holds its own reference to the file from now on
+	int backing_id = fuse_passthrough_open(req, fd);
+	module->put_backing_fd(fi);
+	if (backing_id <= 0) {
+		if (errno == EPERM) {
+			// Registering backing files needs CAP_SYS_ADMIN, don't try again
+			syslog(LOG_WARNING, "fuse passthrough not permitted, disabling it");
+			userdata.passthrough = false;
+		}
+		return 0;
+	}
+	fi->backing_id = backing_id;
+	return backing_id;
+}
+
+static void close_passthrough(fuse_req_t req, int backing_id) {
+	if (backing_id > 0) {
+		fuse_passthrough_close(req, backing_id);
+	}
+}
+#else
+static int open_passthrough(fuse_req_t, Module *, struct fuse_file_info *) {
+	return 0;
+}
+
+static void close_passthrough(fuse_req_t, int) {
+}
+#endif
+
+/** Module::open on the io_uring, false if it has to be done synchronously */
+static bool ring_open(fuse_req_t req, Module *module, const std::string &path,
+                      struct fuse_file_info *fi) {
+	std::string translated;
+	if (!use_ring(module) || module->translatepath(path, translated) != 0) {
+		return false;
+	}
+	// Resolved like PosixStorage::open: beneath the home, no symlinks
+	std::string rel;
+	int root = module->get_storage()->root_fd(translated, rel);
+	if (root < 0 || !userdata.ring->can_resolve()) {
+		return false;
+	}
+
+	module->flush_writes(translated);
+	// fi belongs to the request handler, the completion needs its own
+	struct fuse_file_info info = *fi;
+	userdata.ring->open_beneath(root, rel, openat2_flags(info.flags), 0,
+		[req, module, path, translated, info](int result) mutable {
+			if (result < 0) {
+				reply_status(req, result);
+				return;
+			}
+			int retstat = module->register_file(translated, result, &info);
+			if (retstat != 0) {
+				reply_status(req, retstat);
+				return;
+			}
+			int backing_id = open_passthrough(req, module, &info);
+			if (fuse_reply_open(req, &info) == -ENOENT) {
+				module->release(path.c_str(), &info);
+			}
+			close_passthrough(req, backing_id);
+		});
+	return true;
+}
+
+/**
+ * Write the contents of buf to the open file on the io_uring.
+ * False if it has to be written by the module.
+ */
+static bool ring_write(fuse_req_t req, Module *module,
+                       struct fuse_bufvec *buf, off_t offset,
+                       struct fuse_file_info *fi) {
+	int fd = -1;
+	if (!use_ring(module) || (fd = module->backing_fd(fi)) < 0) {
+		return false;
+	}
+
+	// The request buffer is gone once the handler returns
+	size_t size = fuse_buf_size(buf);
+	auto data = std::make_shared<std::vector<char>>(size);
+	struct fuse_bufvec dst;
+	memset(&dst, 0, sizeof(dst));
+	dst.count = 1;
+	dst.buf[0].mem = data->data();
+	dst.buf[0].size = size;
+	ssize_t copied = fuse_buf_copy(&dst, buf, static_cast<fuse_buf_copy_flags>(0));
+	if (copied < 0) {
+		module->put_backing_fd(fi);
+		reply_status(req, copied);
+		return true;
+	}
+
+	// fi belongs to the request handler, the completion needs its own
+	struct fuse_file_info info = *fi;
+	userdata.ring->write(fd, data->data(), copied, offset,
+		[req, data, module, info](int result) mutable {
+			module->put_backing_fd(&info);
+			if (result < 0) {
+				reply_status(req, result);
+			} else {
+				module->file_written(&info);
+				fuse_reply_write(req, result);
+			}
+		});
+	return true;
+}
+
+static void mammut_ll_open(fuse_req_t req, fuse_ino_t ino,
+                           struct fuse_file_info *fi) {
+	GETNODE(ino);
+	if (ring_open(req, module, path, fi)) {
+		return;
+	}
+
+	int retstat = module->open(path.c_str(), fi);
+	if (retstat != 0) {
+		reply_status(req, retstat);
+		return;
+	}
+
+	int backing_id = open_passthrough(req, module, fi);
+	if (fuse_reply_open(req, fi) == -ENOENT) {
+		// The open was interrupted, nobody will ever release it
+		module->release(path.c_str(), fi);
+	}
+	close_passthrough(req, backing_id);
+}
+
+static void mammut_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+                           off_t offset, struct fuse_file_info *fi) {
+	GETNODE(ino);
+	int fd = -1;
+	if (use_ring(module) && (fd = module->backing_fd(fi)) >= 0) {
+		module->read_ahead(fi, fd, offset, size);
+		char *buf = static_cast<char *>(malloc(size));
+		if (buf == NULL) {
+			module->put_backing_fd(fi);
+			fuse_reply_err(req, ENOMEM);
+			return;
+		}
+		// fi belongs to the request handler, the completion needs its own
+		struct fuse_file_info info = *fi;
+		userdata.ring->read(fd, buf, size, offset,
+			[req, buf, module, info](int result) mutable {
+				module->put_backing_fd(&info);
+				if (result < 0) {
+					reply_status(req, result);
+				} else {
+					fuse_reply_buf(req, buf, result);
+				}
+				free(buf);
+			});
+		return;
+	}
+
+	// The fd stays pinned until the data is spliced to the kernel, so it
+	// cannot be evicted and reused by another file meanwhile
+	if (userdata.config->fuse_splice() && (fd = module->backing_fd(fi)) >= 0) {
+		module->read_ahead(fi, fd, offset, size);
+		struct fuse_bufvec buf;
+		memset(&buf, 0, sizeof(buf));
+		buf.count = 1;
+		buf.buf[0].size = size;
+		buf.buf[0].flags = static_cast<fuse_buf_flags>(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+		buf.buf[0].fd = fd;
+		buf.buf[0].pos = offset;
+		fuse_reply_data(req, &buf, FUSE_BUF_SPLICE_MOVE);
+		module->put_backing_fd(fi);
+		return;
+	}
+
+	std::vector<char> buf(size);
+	int retstat = module->read(path.c_str(), buf.data(), size, offset, fi);
+	if (retstat < 0) {
+		reply_status(req, retstat);
+		return;
+	}
+	fuse_reply_buf(req, buf.data(), retstat);
+}
+
+static void mammut_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+                            size_t size, off_t offset,
+                            struct fuse_file_info *fi) {
+	GETNODE(ino);
+	struct fuse_bufvec bufv;
+	memset(&bufv, 0, sizeof(bufv));
+	bufv.count = 1;
+	bufv.buf[0].mem = const_cast<char *>(buf);
+	bufv.buf[0].size = size;
+	if (ring_write(req, module, &bufv, offset, fi)) {
+		return;
+	}
+
+	int retstat = module->write(path.c_str(), buf, size, offset, fi);
+	if (retstat < 0) {
+		reply_status(req, retstat);
+		return;
+	}
+	fuse_reply_write(req, retstat);
+}
+
+static void mammut_ll_write_buf(fuse_req_t req, fuse_ino_t ino,
+                                struct fuse_bufvec *buf, off_t offset,
+                                struct fuse_file_info *fi) {
+	GETNODE(ino);
+	if (ring_write(req, module, buf, offset, fi)) {
+		return;
+	}
+
+	int retstat = module->write_buf(path.c_str(), buf, offset, fi);
+	if (retstat < 0) {
+		reply_status(req, retstat);
+		return;
+	}
+	fuse_reply_write(req, retstat);
+}
+
+static void mammut_ll_flush(fuse_req_t req, fuse_ino_t ino,
+                            struct fuse_file_info *fi) {
+	GETNODE(ino);
+	reply_status(req, module->flush(path.c_str(), fi));
+}
+
+static void mammut_ll_release(fuse_req_t req, fuse_ino_t ino,
+                              struct fuse_file_info *fi) {
+	GETNODE(ino);
+	if (use_ring(module)) {
+		int error;
+		int fd = module->detach_file(fi, error);
+		if (fd >= 0) {
+			userdata.ring->close(fd, [req, error](int result) {
+					// A buffered write that failed is worse than the close
+					reply_status(req, error != 0 ? error : result);
+				});
+		} else {
+			reply_status(req, error);
+		}
+		return;
+	}
+	reply_status(req, module->release(path.c_str(), fi));
+}
+
+static void mammut_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                            struct fuse_file_info *fi) {
+	GETNODE(ino);
+	reply_status(req, module->fsync(path.c_str(), datasync, fi));
+}
+
+static void mammut_ll_lseek(fuse_req_t req, fuse_ino_t ino, off_t off,
+                            int whence, struct fuse_file_info *fi) {
+	GETNODE(ino);
+	off_t retstat = module->lseek(path.c_str(), off, whence, fi);
+	if (retstat < 0) {
+		fuse_reply_err(req, -retstat);
+	} else {
+		fuse_reply_lseek(req, retstat);
+	}
+}
+
+static void mammut_ll_copy_file_range(fuse_req_t req, fuse_ino_t ino_in,
+                                      off_t off_in, struct fuse_file_info *fi_in,
+                                      fuse_ino_t ino_out, off_t off_out,
+                                      struct fuse_file_info *fi_out,
+                                      size_t len, int flags) {
+	Module *from_module;
+	Arena::scope scope_in;
+	std::string &path_in = scope_in.string();
+	if (!userdata.inodes.resolve(ino_in, from_module, path_in)) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	GETNODE(ino_out);
+	ssize_t retstat = module->copy_file_range(from_module, path_in.c_str(), fi_in, off_in,
+	                                          path.c_str(), fi_out, off_out, len, flags);
+	if (retstat < 0) {
+		reply_status(req, retstat);
+		return;
+	}
+	fuse_reply_write(req, retstat);
+}
+
+static void mammut_ll_opendir(fuse_req_t req, fuse_ino_t ino,
+                              struct fuse_file_info *fi) {
+	GETNODE(ino);
+	std::unique_ptr<dir_handle_t> dh(new dir_handle_t());
+	dh->fi = *fi;
+	int retstat = module->opendir(path.c_str(), &dh->fi);
+	if (retstat != 0) {
+		reply_status(req, retstat);
+		return;
+	}
+
+	fi->fh = reinterpret_cast<uint64_t>(dh.get());
+	if (fuse_reply_open(req, fi) == -ENOENT) {
+		module->releasedir(path.c_str(), &dh->fi);
+	} else {
+		dh.release();
+	}
+}
+
+/**
+ * A readdir(plus) request in progress.
+ *
+ * The module lists straight into the reply buffer, starting at the offset
+ * of the request: the storage offsets are stable, so a huge directory is
+ * listed in chunks of the kernel's buffer size without being held in
+ * memory. Listings that do not know offsets (the module roots) pass 0, those
+ * are listed in full every time and numbered here instead.
+ */
+struct dir_fill_t {
+	fuse_req_t req;
+	fuse_ino_t ino;
+	Module *module;
+	off_t offset;
+	bool plus;
+	/** If the entries may be looked up, see mammut_ll_readdirplus */
+	bool lookups;
+
+	std::vector<char> buf;
+	size_t pos = 0;
+	/** The number of entries listed without an offset */
+	off_t index = 0;
+	/** The lookups of the reply */
+	std::vector<fuse_ino_t> registered;
+};
+
+/** fuse_fill_dir_t that serializes the entries into the reply */
+static int dir_filler(void *buf, const char *name,
+                      const struct stat *stbuf, off_t off,
+                      enum fuse_fill_dir_flags) {
+	dir_fill_t *ctx = static_cast<dir_fill_t *>(buf);
+	if (off == 0) {
+		off = ++ctx->index;
+		if (off <= ctx->offset) {
+			return 0;
+		}
+	}
+
+	struct fuse_entry_param e;
+	memset(&e, 0, sizeof(e));
+	if (stbuf != NULL) {
+		e.attr = *stbuf;
+	} else {
+		e.attr.st_ino = UNKNOWN_INO;
+	}
+
+	size_t remaining = ctx->buf.size() - ctx->pos;
+	char *dst = ctx->buf.data() + ctx->pos;
+	if (!ctx->plus) {
+		size_t entsize = fuse_add_direntry(ctx->req, dst, remaining, name, &e.attr, off);
+		if (entsize > remaining) {
+			return 1;
+		}
+		ctx->pos += entsize;
+		return 0;
+	}
+
+	size_t entsize = fuse_add_direntry_plus(ctx->req, NULL, 0, name, NULL, 0);
+	if (entsize > remaining) {
+		return 1;
+	}
+	// Without a nodeid the kernel takes it as a plain entry
+	bool dots = strcmp(name, ".") == 0 || strcmp(name, "..") == 0;
+	if (stbuf != NULL && ctx->lookups && !dots) {
+		register_entry(ctx->ino, name, ctx->module, false, e);
+		ctx->registered.push_back(e.ino);
+	}
+	fuse_add_direntry_plus(ctx->req, dst, remaining, name, &e, off);
+	ctx->pos += entsize;
+	return 0;
+}
+
+static void list_dir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                     struct fuse_file_info *fi, bool plus) {
+	GETNODE(ino);
+	dir_handle_t *dh = reinterpret_cast<dir_handle_t *>(fi->fh);
+
+	dir_fill_t ctx;
+	ctx.req = req;
+	ctx.ino = ino;
+	ctx.module = module;
+	ctx.offset = offset;
+	ctx.plus = plus;
+	// The entries of the mount root are modules, they are looked up as such
+	ctx.lookups = ino != FUSE_ROOT_ID || userdata.resolver->is_single_module();
+	ctx.buf.resize(size);
+
+	int retstat = module->readdir(path.c_str(), &ctx, dir_filler, offset, &dh->fi,
+	                              plus ? FUSE_READDIR_PLUS : fuse_readdir_flags(0));
+	// An error after some entries is reported by the next call
+	if (retstat != 0 && ctx.pos == 0) {
+		reply_status(req, retstat);
+	} else if (fuse_reply_buf(req, ctx.buf.data(), ctx.pos) != 0) {
+		// The kernel did not get the entries, so it will not forget them
+		for (fuse_ino_t child : ctx.registered) {
+			userdata.inodes.forget(child, 1);
+		}
+	}
+}
+
+static void mammut_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                              off_t offset, struct fuse_file_info *fi) {
+	list_dir(req, ino, size, offset, fi, false);
+}
+
+/**
+ * readdir that hands out the attributes the module listed, each entry is a
+ * lookup of its own. So "ls -l" or a smb listing is a single round trip
+ * instead of one per entry.
+ */
+static void mammut_ll_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size,
+                                  off_t offset, struct fuse_file_info *fi) {
+	list_dir(req, ino, size, offset, fi, true);
+}
+
+static void mammut_ll_releasedir(fuse_req_t req, fuse_ino_t ino,
+                                 struct fuse_file_info *fi) {
+	std::unique_ptr<dir_handle_t> dh(reinterpret_cast<dir_handle_t *>(fi->fh));
+	GETNODE(ino);
+	reply_status(req, module->releasedir(path.c_str(), &dh->fi));
+}
+
+static void mammut_ll_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync,
+                               struct fuse_file_info *fi) {
+	GETNODE(ino);
+	dir_handle_t *dh = reinterpret_cast<dir_handle_t *>(fi->fh);
+	reply_status(req, module->fsyncdir(path.c_str(), datasync, &dh->fi));
+}
+
+static void mammut_ll_statfs(fuse_req_t req, fuse_ino_t ino) {
+	GETNODE(ino);
+	struct statvfs statv;
+	memset(&statv, 0, sizeof(statv));
+	int retstat = module->statfs(path.c_str(), &statv);
+	if (retstat < 0) {
+		reply_status(req, retstat);
+		return;
+	}
+	fuse_reply_statfs(req, &statv);
+}
+
+static void mammut_ll_setxattr(fuse_req_t req, fuse_ino_t ino,
+                               const char *name, const char *value,
+                               size_t size, int flags) {
+	GETNODE(ino);
+	reply_status(req, module->setxattr(path.c_str(), name, value, size, flags));
+}
+
+static void mammut_ll_getxattr(fuse_req_t req, fuse_ino_t ino,
+                               const char *name, size_t size) {
+	GETNODE(ino);
+	std::vector<char> buf(size);
+	int retstat = module->getxattr(path.c_str(), name,
+	                               size ? buf.data() : NULL, size);
+	if (retstat < 0) {
+		reply_status(req, retstat);
+	} else if (size == 0) {
+		fuse_reply_xattr(req, retstat);
+	} else {
+		fuse_reply_buf(req, buf.data(), retstat);
+	}
+}
+
+static void mammut_ll_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size) {
+	GETNODE(ino);
+	std::vector<char> buf(size);
+	int retstat = module->listxattr(path.c_str(), size ? buf.data() : NULL, size);
+	if (retstat < 0) {
+		reply_status(req, retstat);
+	} else if (size == 0) {
+		fuse_reply_xattr(req, retstat);
+	} else {
+		fuse_reply_buf(req, buf.data(), retstat);
+	}
+}
+
+static void mammut_ll_removexattr(fuse_req_t req, fuse_ino_t ino,
+                                  const char *name) {
+	GETNODE(ino);
+	reply_status(req, module->removexattr(path.c_str(), name));
+}
+
+static void mammut_ll_access(fuse_req_t req, fuse_ino_t ino, int mask) {
+	GETNODE(ino);
+	reply_status(req, module->access(path.c_str(), mask));
+}
+
+static void mammut_ll_create(fuse_req_t req, fuse_ino_t parent,
+                             const char *name, mode_t mode,
+                             struct fuse_file_info *fi) {
+	GETCHILD(parent, name);
+	int retstat = module->create(path.c_str(), mode, fi);
+	if (retstat != 0) {
+		reply_status(req, retstat);
+		return;
+	}
+
+	struct fuse_entry_param e;
+	retstat = fill_entry(parent, name, module, path, module_root, e);
+	if (retstat != 0) {
+		module->release(path.c_str(), fi);
+		reply_status(req, retstat);
+	} else {
+		int backing_id = open_passthrough(req, module, fi);
+		if (fuse_reply_create(req, &e, fi) == -ENOENT) {
+			module->release(path.c_str(), fi);
+			userdata.inodes.forget(e.ino, 1);
+		}
+		close_passthrough(req, backing_id);
+	}
+}
+
+/** Deliver an invalidation of the KernelCache to the kernel */
+static void notify_kernel(KernelCache::TYPE type,
+                          const Module *module,
+                          const std::string &modpath) {
+	std::string path = modpath;
+	if (module != nullptr
+	    && !userdata.resolver->mount_path(module, modpath, path)) {
+		return;
+	}
+
+	// Whatever the kernel has not looked up, it cannot have cached
+	if (type == KernelCache::TYPE::INODE) {
+		fuse_ino_t ino;
+		if (userdata.inodes.find(path, ino)) {
+			fuse_lowlevel_notify_inval_inode(userdata.se, ino, 0, 0);
+		}
+	} else {
+		size_t split = path.find_last_of('/');
+		if (split == std::string::npos || split + 1 == path.size()) {
+			return;
+		}
+		std::string name = path.substr(split + 1);
+		fuse_ino_t parent;
+		if (userdata.inodes.find(path.substr(0, split), parent)) {
+			fuse_lowlevel_notify_inval_entry(userdata.se, parent,
+			                                 name.c_str(), name.size());
+		}
+	}
+}
+
+static void mammut_ll_init(void *, struct fuse_conn_info *conn) {
+	prctl(PR_SET_NAME, "mammutfs_fuse", 0, 0, 0);
+	if (conn->capable & FUSE_CAP_EXPORT_SUPPORT) {
+		conn->want |= FUSE_CAP_EXPORT_SUPPORT;
+	} else {
+		syslog(LOG_ERR, "ERROR NOT SETTING FUSE_CAP_EXPORT_SUPPORT");
+	}
+	// Reads of the same file may be in flight at the same time
+	if (conn->capable & FUSE_CAP_ASYNC_READ) {
+		conn->want |= FUSE_CAP_ASYNC_READ;
+	}
+	// lookups and readdirs of the same directory may run in parallel,
+	// the inode table has its own locking
+	if (conn->capable & FUSE_CAP_PARALLEL_DIROPS) {
+		conn->want |= FUSE_CAP_PARALLEL_DIROPS;
+	}
+	// Move file data between /dev/fuse and the raids with splice(2).
+	// Without kernel support libfuse silently copies instead.
+	if (userdata.config->fuse_splice()) {
+		conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ
+		                               | FUSE_CAP_SPLICE_WRITE
+		                               | FUSE_CAP_SPLICE_MOVE);
+	}
+	// libfuse negotiates max_pages from max_write, so a single request can
+	// carry more than the historic 128k
+	conn->max_write = userdata.config->fuse_max_write();
+
+	setup_main();
+
+	std::string inode_file;
+	if (userdata.config->lookupValue("inode_table_file", inode_file, true)) {
+		size_t slots = 1 << 20;
+		userdata.config->lookupValue("inode_table_size", slots, true);
+		auto store = InodeStore::open(inode_file, slots);
+		if (store) {
+			userdata.inodes.set_store(std::move(store));
+		} else {
+			syslog(LOG_WARNING, "Could not open the inode table %s (%s), nfs handles will not survive a restart",
+			       inode_file.c_str(), strerror(errno));
+		}
+	}
+
+	const char *remaining_path;
+	userdata.inodes.set_root(
+		userdata.resolver->getModuleFromPath("/", remaining_path));
+
+	KernelCache::start(notify_kernel);
+
+	// The ring and its reaper thread have to be created after daemonizing
+	if (userdata.config->io_backend() == "uring") {
+		userdata.ring = IoRing::create(IO_RING_ENTRIES);
+		if (!userdata.ring) {
+			syslog(LOG_WARNING, "io_uring unavailable (%s), using synchronous io",
+			       strerror(errno));
+		}
+	}
+
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 16)
+	// Passthrough is only negotiated if a module asked for it, since the
+	// kernel then refuses writeback caching for the whole mount.
+	bool wants_passthrough = false;
+	for (const auto &m : userdata.resolver->activatedModules()) {
+		wants_passthrough |= m.second->passthrough();
+	}
+	if (wants_passthrough) {
+		if (conn->capable & FUSE_CAP_PASSTHROUGH) {
+			conn->want |= FUSE_CAP_PASSTHROUGH;
+			userdata.passthrough = true;
+		} else {
+			syslog(LOG_WARNING, "fuse passthrough not supported by the kernel");
+		}
+	}
+#endif
+}
+
+static void mammut_ll_destroy(void *) {
+	KernelCache::stop();
+	userdata.ring.reset();
+}
+
+#undef GETNODE
+#undef GETCHILD
+
+int mammut_lowlevel_main (std::shared_ptr<ModuleResolver> resolver,
+                          std::shared_ptr<MammutConfig> config) {
+	prctl(PR_SET_NAME, "mammutfs_main", 0, 0, 0);
+	openlog("mammutfs", LOG_PID, 0);
+
+	userdata.resolver = resolver;
+	userdata.config = config;
+
+	std::vector<const char *> fuseargs;
+	fuseargs.push_back(config->self);
+	fuseargs.push_back("-ofsname=mammutfs");     // We want to have the name mammutfs
+	fuseargs.push_back("-osubtype=fuse.mammutfs");  // We want to have the name mammutfs
+	fuseargs.push_back("-odefault_permissions"); // To allow us to set permissions
+	fuseargs.push_back("-oallow_other");         // To enable smb
+	//fuseargs.push_back("-d");                    // Enable FUSE-DEBUG!
+
+	std::cout << "fuse args (lowlevel): ";
+	for (auto arg : fuseargs) {
+		std::cout << " " << arg;
+	}
+	std::cout << std::endl;
+
+	struct fuse_lowlevel_ops mammut_ops;
+	memset(&mammut_ops, 0, sizeof(mammut_ops));
+	mammut_ops.init         = mammut_ll_init;
+	mammut_ops.destroy      = mammut_ll_destroy;
+	mammut_ops.lookup       = mammut_ll_lookup;
+	mammut_ops.forget       = mammut_ll_forget;
+	mammut_ops.forget_multi = mammut_ll_forget_multi;
+	mammut_ops.getattr      = mammut_ll_getattr;
+	mammut_ops.setattr      = mammut_ll_setattr;
+	mammut_ops.readlink     = mammut_ll_readlink;
+	mammut_ops.mknod        = NULL;
+	mammut_ops.mkdir        = mammut_ll_mkdir;
+	mammut_ops.unlink       = mammut_ll_unlink;
+	mammut_ops.rmdir        = mammut_ll_rmdir;
+	mammut_ops.symlink      = mammut_ll_symlink;
+	mammut_ops.rename       = mammut_ll_rename;
+	mammut_ops.link         = mammut_ll_link;
+	mammut_ops.open         = mammut_ll_open;
+	mammut_ops.read         = mammut_ll_read;
+	mammut_ops.write        = mammut_ll_write;
+	if (config->fuse_splice()) {
+		mammut_ops.write_buf = mammut_ll_write_buf;
+	}
+	mammut_ops.flush        = mammut_ll_flush;
+	mammut_ops.release      = mammut_ll_release;
+	mammut_ops.fsync        = mammut_ll_fsync;
+	mammut_ops.lseek        = mammut_ll_lseek;
+	mammut_ops.copy_file_range = mammut_ll_copy_file_range;
+
+	mammut_ops.opendir    = mammut_ll_opendir;
+	mammut_ops.readdir    = mammut_ll_readdir;
+	mammut_ops.readdirplus = mammut_ll_readdirplus;
+	mammut_ops.releasedir = mammut_ll_releasedir;
+	mammut_ops.fsyncdir   = mammut_ll_fsyncdir;
+	mammut_ops.statfs     = mammut_ll_statfs;
+
+	mammut_ops.setxattr    = mammut_ll_setxattr;
+	mammut_ops.getxattr    = mammut_ll_getxattr;
+	mammut_ops.listxattr   = mammut_ll_listxattr;
+	mammut_ops.removexattr = mammut_ll_removexattr;
+
+	mammut_ops.access = mammut_ll_access;
+	mammut_ops.create = mammut_ll_create;
+
+	struct fuse_args args = FUSE_ARGS_INIT(
+		static_cast<int>(fuseargs.size()),
+		const_cast<char**>(fuseargs.data()));
+
+	struct fuse_session *se = fuse_session_new(&args,
+	                                           &mammut_ops,
+	                                           sizeof(mammut_ops),
+	                                           &userdata);
+	if (se == NULL) {
+		syslog(LOG_ERR, "fuse failed: could not create session");
+		std::cerr << "fuse failed: could not create session" << std::endl;
+		fuse_opt_free_args(&args);
+		return 1;
+	}
+	userdata.se = se;
+
+	int fuse_stat = 1;
+	if (fuse_set_signal_handlers(se) == 0) {
+		std::string mountpoint = config->mountpoint();
+		if (fuse_session_mount(se, mountpoint.c_str()) == 0) {
+			fuse_daemonize(!config->deamonize());
+
+			int threads = config->fuse_threads();
+			if (threads <= 1) {
+				fuse_stat = fuse_session_loop(se);
+			} else {
+				struct fuse_loop_config *loop_config = fuse_loop_cfg_create();
+				fuse_loop_cfg_set_max_threads(loop_config, threads);
+				fuse_stat = fuse_session_loop_mt(se, loop_config);
+				fuse_loop_cfg_destroy(loop_config);
+			}
+			fuse_session_unmount(se);
+		} else {
+			std::stringstream ss;
+			ss << "fuse failed: " << strerror(errno);
+			if (errno == EPERM) {
+				ss << " user " << config->username() << " needs write access to " << config->mountpoint();
+			}
+			syslog(LOG_ERR, ss.str().c_str());
+			std::cerr << ss.str();
+		}
+		fuse_remove_signal_handlers(se);
+	}
+
+	fuse_session_destroy(se);
+	fuse_opt_free_args(&args);
+	return fuse_stat;
+}
+
+}
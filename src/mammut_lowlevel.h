@@ -0,0 +1,19 @@
+#pragma once
+
+#include "resolver.h"
+
+#include "mammut_config.h"
+
+namespace mammutfs {
+
+/**
+ * Run mammutfs on the fuse lowlevel api.
+ *
+ * Instead of passing full pathes for every operation, the kernel works on
+ * nodeids that are handed out by lookup and are kept until it forgets them.
+ * The modules are still called through their path based interface.
+ */
+int mammut_lowlevel_main (std::shared_ptr<ModuleResolver> resovler,
+                          std::shared_ptr<MammutConfig> config);
+
+}
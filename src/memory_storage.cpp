@@ -0,0 +1,568 @@
+#include "memory_storage.h"
+
+#include "arena.h"
+
+#include <algorithm>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace mammutfs {
+
+static struct timespec now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts;
+}
+
+
+MemoryStorage::MemoryStorage() {
+	std::unique_lock<std::shared_mutex> lock(this->tree_mux);
+	this->root = this->make_node(S_IFDIR | 0755);
+}
+
+
+MemoryStorage::node_ptr MemoryStorage::make_node(mode_t mode) {
+	auto node = std::make_shared<node_t>(S_ISDIR(mode));
+	memset(&node->st, 0, sizeof(node->st));
+	node->st.st_ino = this->next_ino++;
+	node->st.st_mode = mode;
+	node->st.st_nlink = S_ISDIR(mode) ? 2 : 1;
+	node->st.st_uid = getuid();
+	node->st.st_gid = getgid();
+	node->st.st_blksize = 4096;
+	node->st.st_atim = node->st.st_mtim = node->st.st_ctim = now();
+	return node;
+}
+
+
+void MemoryStorage::resize(node_t &node, size_t size) {
+	node.data.resize(size);
+	node.st.st_size = size;
+	node.st.st_blocks = (size + 511) / 512;
+}
+
+
+MemoryStorage::node_ptr MemoryStorage::find(const std::string &path, size_t len) {
+	len = std::min(len, path.size());
+	Arena::scope scope;
+	std::string &name = scope.string();
+	node_ptr node = this->root;
+	size_t start = 0;
+	while (start < len) {
+		size_t end = path.find('/', start);
+		if (end == std::string::npos || end > len) {
+			end = len;
+		}
+		if (end > start && path.compare(start, end - start, ".") != 0) {
+			if (!node->dir) {
+				return nullptr;
+			}
+			name.assign(path, start, end - start);
+			auto it = node->children.find(name);
+			if (it == node->children.end()) {
+				return nullptr;
+			}
+			node = it->second;
+		}
+		start = end + 1;
+	}
+	return node;
+}
+
+
+int MemoryStorage::find_parent(const std::string &path, node_ptr &parent, std::string &name) {
+	size_t end = path.find_last_not_of('/');
+	if (end == std::string::npos) {
+		// The root has no parent
+		return -EBUSY;
+	}
+	size_t start = path.rfind('/', end);
+	start = (start == std::string::npos) ? 0 : start + 1;
+	name = path.substr(start, end - start + 1);
+
+	parent = this->find(path, start);
+	if (!parent) {
+		return -ENOENT;
+	}
+	if (!parent->dir) {
+		return -ENOTDIR;
+	}
+	return 0;
+}
+
+
+MemoryStorage::node_ptr MemoryStorage::file(int fh) {
+	std::shared_lock<std::shared_mutex> lock(this->files_mux);
+	auto it = this->files.find(fh);
+	return (it == this->files.end()) ? nullptr : it->second;
+}
+
+
+int MemoryStorage::stat(const std::string &path, struct stat *statbuf) {
+	std::shared_lock<std::shared_mutex> lock(this->tree_mux);
+	node_ptr node = this->find(path);
+	if (!node) {
+		return -ENOENT;
+	}
+	std::lock_guard<std::mutex> node_lock(node->mux);
+	*statbuf = node->st;
+	return 0;
+}
+
+
+int MemoryStorage::lstat(const std::string &path, struct stat *statbuf) {
+	// There are no symlinks
+	return this->stat(path, statbuf);
+}
+
+
+int MemoryStorage::access(const std::string &path, int) {
+	// The kernel checks the permissions (default_permissions)
+	std::shared_lock<std::shared_mutex> lock(this->tree_mux);
+	return this->find(path) ? 0 : -ENOENT;
+}
+
+
+int MemoryStorage::statvfs(const std::string &, struct statvfs *statv) {
+	// Memory has no fixed size, claim plenty of free space
+	memset(statv, 0, sizeof(*statv));
+	statv->f_bsize = 4096;
+	statv->f_frsize = 4096;
+	statv->f_blocks = statv->f_bfree = statv->f_bavail = 1 << 24;
+	statv->f_files = statv->f_ffree = statv->f_favail = 1 << 20;
+	statv->f_namemax = 255;
+	return 0;
+}
+
+
+int MemoryStorage::mkdir(const std::string &path, mode_t mode) {
+	std::unique_lock<std::shared_mutex> lock(this->tree_mux);
+	node_ptr parent;
+	std::string name;
+	int retstat = this->find_parent(path, parent, name);
+	if (retstat < 0) {
+		return retstat;
+	}
+	if (parent->children.count(name) != 0) {
+		return -EEXIST;
+	}
+
+	parent->children[name] = this->make_node(S_IFDIR | (mode & 07777));
+	std::lock_guard<std::mutex> parent_lock(parent->mux);
+	parent->st.st_nlink++;
+	parent->st.st_mtim = parent->st.st_ctim = now();
+	return 0;
+}
+
+
+int MemoryStorage::unlink(const std::string &path) {
+	std::unique_lock<std::shared_mutex> lock(this->tree_mux);
+	node_ptr parent;
+	std::string name;
+	int retstat = this->find_parent(path, parent, name);
+	if (retstat < 0) {
+		return retstat;
+	}
+	auto it = parent->children.find(name);
+	if (it == parent->children.end()) {
+		return -ENOENT;
+	}
+	if (it->second->dir) {
+		return -EISDIR;
+	}
+
+	{
+		// It may be open and written meanwhile
+		std::lock_guard<std::mutex> node_lock(it->second->mux);
+		it->second->st.st_nlink--;
+	}
+	parent->children.erase(it);
+	std::lock_guard<std::mutex> parent_lock(parent->mux);
+	parent->st.st_mtim = parent->st.st_ctim = now();
+	return 0;
+}
+
+
+int MemoryStorage::rmdir(const std::string &path) {
+	std::unique_lock<std::shared_mutex> lock(this->tree_mux);
+	node_ptr parent;
+	std::string name;
+	int retstat = this->find_parent(path, parent, name);
+	if (retstat < 0) {
+		return retstat;
+	}
+	auto it = parent->children.find(name);
+	if (it == parent->children.end()) {
+		return -ENOENT;
+	}
+	if (!it->second->dir) {
+		return -ENOTDIR;
+	}
+	if (!it->second->children.empty()) {
+		return -ENOTEMPTY;
+	}
+
+	parent->children.erase(it);
+	std::lock_guard<std::mutex> parent_lock(parent->mux);
+	parent->st.st_nlink--;
+	parent->st.st_mtim = parent->st.st_ctim = now();
+	return 0;
+}
+
+
+int MemoryStorage::rename(const std::string &from, const std::string &to) {
+	std::unique_lock<std::shared_mutex> lock(this->tree_mux);
+	node_ptr from_parent, to_parent;
+	std::string from_name, to_name;
+	int retstat = this->find_parent(from, from_parent, from_name);
+	if (retstat < 0) {
+		return retstat;
+	}
+	if ((retstat = this->find_parent(to, to_parent, to_name)) < 0) {
+		return retstat;
+	}
+
+	auto from_it = from_parent->children.find(from_name);
+	if (from_it == from_parent->children.end()) {
+		return -ENOENT;
+	}
+	node_ptr node = from_it->second;
+	bool is_dir = node->dir;
+
+	// A directory cannot be moved into itself
+	if (is_dir && to.compare(0, from.size() + 1, from + "/") == 0) {
+		return -EINVAL;
+	}
+
+	auto to_it = to_parent->children.find(to_name);
+	if (to_it != to_parent->children.end()) {
+		node_ptr target = to_it->second;
+		if (target == node) {
+			return 0;
+		}
+		if (target->dir) {
+			if (!is_dir) {
+				return -EISDIR;
+			}
+			if (!target->children.empty()) {
+				return -ENOTEMPTY;
+			}
+		} else if (is_dir) {
+			return -ENOTDIR;
+		}
+		std::lock_guard<std::mutex> target_lock(target->mux);
+		target->st.st_nlink--;
+	}
+
+	from_parent->children.erase(from_it);
+	bool replaced = to_parent->children.count(to_name) != 0;
+	to_parent->children[to_name] = node;
+
+	// The tree is locked exclusively, no other node lock is held meanwhile
+	struct timespec ts = now();
+	{
+		std::lock_guard<std::mutex> node_lock(node->mux);
+		node->st.st_ctim = ts;
+	}
+	{
+		std::lock_guard<std::mutex> parent_lock(from_parent->mux);
+		if (is_dir) {
+			from_parent->st.st_nlink--;
+		}
+		from_parent->st.st_mtim = from_parent->st.st_ctim = ts;
+	}
+	{
+		std::lock_guard<std::mutex> parent_lock(to_parent->mux);
+		if (is_dir && !replaced) {
+			to_parent->st.st_nlink++;
+		}
+		to_parent->st.st_mtim = to_parent->st.st_ctim = ts;
+	}
+	return 0;
+}
+
+
+int MemoryStorage::chmod(const std::string &path, mode_t mode) {
+	std::shared_lock<std::shared_mutex> lock(this->tree_mux);
+	node_ptr node = this->find(path);
+	if (!node) {
+		return -ENOENT;
+	}
+	std::lock_guard<std::mutex> node_lock(node->mux);
+	node->st.st_mode = (node->st.st_mode & S_IFMT) | (mode & 07777);
+	node->st.st_ctim = now();
+	return 0;
+}
+
+
+int MemoryStorage::truncate(const std::string &path, off_t size) {
+	if (size < 0) {
+		return -EINVAL;
+	}
+	std::shared_lock<std::shared_mutex> lock(this->tree_mux);
+	node_ptr node = this->find(path);
+	if (!node) {
+		return -ENOENT;
+	}
+	if (node->dir) {
+		return -EISDIR;
+	}
+	std::lock_guard<std::mutex> node_lock(node->mux);
+	resize(*node, size);
+	node->st.st_mtim = node->st.st_ctim = now();
+	return 0;
+}
+
+
+int MemoryStorage::utimens(const std::string &path, const struct timespec tv[2]) {
+	std::shared_lock<std::shared_mutex> lock(this->tree_mux);
+	node_ptr node = this->find(path);
+	if (!node) {
+		return -ENOENT;
+	}
+	std::lock_guard<std::mutex> node_lock(node->mux);
+
+	struct timespec ts = now();
+	struct timespec *times[2] = { &node->st.st_atim, &node->st.st_mtim };
+	for (int i = 0; i < 2; ++i) {
+		if (tv == NULL || tv[i].tv_nsec == UTIME_NOW) {
+			*times[i] = ts;
+		} else if (tv[i].tv_nsec != UTIME_OMIT) {
+			*times[i] = tv[i];
+		}
+	}
+	node->st.st_ctim = ts;
+	return 0;
+}
+
+
+int MemoryStorage::open(const std::string &path, int flags, mode_t mode) {
+	node_ptr node;
+	if (flags & O_CREAT) {
+		std::unique_lock<std::shared_mutex> lock(this->tree_mux);
+		node_ptr parent;
+		std::string name;
+		int retstat = this->find_parent(path, parent, name);
+		if (retstat < 0) {
+			return retstat;
+		}
+		auto it = parent->children.find(name);
+		if (it != parent->children.end()) {
+			if (flags & O_EXCL) {
+				return -EEXIST;
+			}
+			node = it->second;
+		} else {
+			node = this->make_node(S_IFREG | (mode & 07777));
+			parent->children[name] = node;
+			std::lock_guard<std::mutex> parent_lock(parent->mux);
+			parent->st.st_mtim = parent->st.st_ctim = now();
+		}
+	} else {
+		std::shared_lock<std::shared_mutex> lock(this->tree_mux);
+		node = this->find(path);
+		if (!node) {
+			return -ENOENT;
+		}
+	}
+
+	bool writes = (flags & O_ACCMODE) != O_RDONLY;
+	if (node->dir && writes) {
+		return -EISDIR;
+	}
+	if ((flags & O_DIRECTORY) && !node->dir) {
+		return -ENOTDIR;
+	}
+	if ((flags & O_TRUNC) && writes) {
+		std::lock_guard<std::mutex> node_lock(node->mux);
+		if (node->st.st_size != 0) {
+			resize(*node, 0);
+			node->st.st_mtim = node->st.st_ctim = now();
+		}
+	}
+
+	std::unique_lock<std::shared_mutex> lock(this->files_mux);
+	int fh = this->next_fh++;
+	this->files[fh] = node;
+	return fh;
+}
+
+
+int MemoryStorage::close(int fh) {
+	std::unique_lock<std::shared_mutex> lock(this->files_mux);
+	return this->files.erase(fh) != 0 ? 0 : -EBADF;
+}
+
+
+ssize_t MemoryStorage::pread(int fh, void *buf, size_t size, off_t offset) {
+	node_ptr node = this->file(fh);
+	if (!node) {
+		return -EBADF;
+	}
+	if (node->dir) {
+		return -EISDIR;
+	}
+	if (offset < 0) {
+		return -EINVAL;
+	}
+	std::lock_guard<std::mutex> node_lock(node->mux);
+	if (static_cast<size_t>(offset) >= node->data.size()) {
+		return 0;
+	}
+	size = std::min(size, node->data.size() - offset);
+	memcpy(buf, node->data.data() + offset, size);
+	return size;
+}
+
+
+ssize_t MemoryStorage::pwrite(int fh, const void *buf, size_t size, off_t offset) {
+	node_ptr node = this->file(fh);
+	if (!node) {
+		return -EBADF;
+	}
+	if (offset < 0) {
+		return -EINVAL;
+	}
+	std::lock_guard<std::mutex> node_lock(node->mux);
+	if (offset + size > node->data.size()) {
+		resize(*node, offset + size);
+	}
+	memcpy(node->data.data() + offset, buf, size);
+	node->st.st_mtim = node->st.st_ctim = now();
+	return size;
+}
+
+
+ssize_t MemoryStorage::copy_file_range(int fh_in, off_t offset_in,
+                                       int fh_out, off_t offset_out, size_t size) {
+	node_ptr in = this->file(fh_in);
+	node_ptr out = this->file(fh_out);
+	if (!in || !out) {
+		return -EBADF;
+	}
+	node_t &from = *in;
+	node_t &to = *out;
+	if (from.dir || to.dir) {
+		return -EISDIR;
+	}
+	if (offset_in < 0 || offset_out < 0) {
+		return -EINVAL;
+	}
+	// Both files are locked, once if it is the same
+	std::unique_lock<std::mutex> from_lock(from.mux, std::defer_lock);
+	std::unique_lock<std::mutex> to_lock(to.mux, std::defer_lock);
+	if (in == out) {
+		from_lock.lock();
+	} else {
+		std::lock(from_lock, to_lock);
+	}
+	if (static_cast<size_t>(offset_in) >= from.data.size()) {
+		return 0;
+	}
+	size = std::min(size, from.data.size() - offset_in);
+	if (offset_out + size > to.data.size()) {
+		resize(to, offset_out + size);
+	}
+	// The ranges may overlap within a file
+	memmove(to.data.data() + offset_out, from.data.data() + offset_in, size);
+	to.st.st_mtim = to.st.st_ctim = now();
+	return size;
+}
+
+
+int MemoryStorage::fsync(int fh) {
+	return this->file(fh) ? 0 : -EBADF;
+}
+
+
+off_t MemoryStorage::lseek(int fh, off_t offset, int whence) {
+	node_ptr node = this->file(fh);
+	if (!node) {
+		return -EBADF;
+	}
+	off_t size;
+	{
+		std::lock_guard<std::mutex> node_lock(node->mux);
+		size = node->data.size();
+	}
+	if (offset < 0) {
+		return -EINVAL;
+	} else if (offset >= size) {
+		return -ENXIO;
+	}
+	switch (whence) {
+	case SEEK_DATA:
+		return offset;
+	case SEEK_HOLE:
+		// No holes, only the one at the end
+		return size;
+	default:
+		return -EINVAL;
+	}
+}
+
+
+int MemoryStorage::opendir(const std::string &path, void *&dir) {
+	std::shared_lock<std::shared_mutex> lock(this->tree_mux);
+	node_ptr node = this->find(path);
+	if (!node) {
+		return -ENOENT;
+	}
+	if (!node->dir) {
+		return -ENOTDIR;
+	}
+	dir_t *d = new dir_t();
+	d->node = node;
+	dir = d;
+	return 0;
+}
+
+
+int MemoryStorage::readdir(void *dir, off_t offset, const dir_filler &filler,
+                           unsigned int attrs, int) {
+	dir_t *d = static_cast<dir_t *>(dir);
+	if (offset == 0 || d->names.empty()) {
+		std::shared_lock<std::shared_mutex> lock(this->tree_mux);
+		d->names.assign({ ".", ".." });
+		d->names.reserve(d->node->children.size() + 2);
+		for (const auto &child : d->node->children) {
+			d->names.push_back(child.first);
+		}
+	}
+
+	// The filler must not be called locked, it may call into the storage.
+	// The parent of a node is unknown, ".." comes without attributes.
+	struct stat st;
+	for (size_t i = offset; i < d->names.size(); ++i) {
+		bool has_attrs = false;
+		if (attrs && i != 1) {
+			std::shared_lock<std::shared_mutex> lock(this->tree_mux);
+			node_ptr node = d->node;
+			if (i != 0) {
+				auto it = d->node->children.find(d->names[i]);
+				node = (it != d->node->children.end()) ? it->second : nullptr;
+			}
+			if (node) {
+				std::lock_guard<std::mutex> node_lock(node->mux);
+				st = node->st;
+				has_attrs = true;
+			}
+		}
+		if (!filler(d->names[i].c_str(), has_attrs ? &st : nullptr, i + 1)) {
+			break;
+		}
+	}
+	return 0;
+}
+
+
+int MemoryStorage::closedir(void *dir) {
+	delete static_cast<dir_t *>(dir);
+	return 0;
+}
+
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include "storage.h"
+
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace mammutfs {
+
+/**
+ * A storage that keeps the whole tree in memory.
+ *
+ * Every directory indexes its children by name in a hash map, so a lookup
+ * costs one hash per path component. Symlinks do not exist, lstat and stat
+ * are the same. Everything is lost when mammutfs exits - this is meant for
+ * benchmarks and tests of mammutfs itself, not for user data.
+ *
+ * The names of the tree and the handles have a lock each, that is shared by
+ * the lookups, and every node locks its own attributes and data. So requests
+ * on different files do not wait for each others copies.
+ */
+class MemoryStorage : public Storage {
+public:
+	MemoryStorage();
+
+	bool is_native() const override { return false; }
+
+	int stat(const std::string &path, struct stat *statbuf) override;
+	int lstat(const std::string &path, struct stat *statbuf) override;
+	int access(const std::string &path, int mask) override;
+	int statvfs(const std::string &path, struct statvfs *statv) override;
+
+	int mkdir(const std::string &path, mode_t mode) override;
+	int unlink(const std::string &path) override;
+	int rmdir(const std::string &path) override;
+	int rename(const std::string &from, const std::string &to) override;
+	int chmod(const std::string &path, mode_t mode) override;
+	int truncate(const std::string &path, off_t size) override;
+	int utimens(const std::string &path, const struct timespec tv[2]) override;
+
+	int open(const std::string &path, int flags, mode_t mode = 0) override;
+	int close(int fh) override;
+	ssize_t pread(int fh, void *buf, size_t size, off_t offset) override;
+	ssize_t pwrite(int fh, const void *buf, size_t size, off_t offset) override;
+	int fsync(int fh) override;
+	off_t lseek(int fh, off_t offset, int whence) override;
+	ssize_t copy_file_range(int fh_in, off_t offset_in,
+	                        int fh_out, off_t offset_out, size_t size) override;
+
+	int opendir(const std::string &path, void *&dir) override;
+	int readdir(void *dir, off_t offset, const dir_filler &filler,
+	            unsigned int attrs = 0, int sync = 0) override;
+	int closedir(void *dir) override;
+
+private:
+	struct node_t {
+		explicit node_t(bool dir) : dir(dir) {}
+
+		/** The type never changes, it is checked without locking */
+		const bool dir;
+		/** Guards st and data */
+		std::mutex mux;
+		struct stat st;
+		std::vector<char> data;
+		/** Guarded by tree_mux */
+		std::unordered_map<std::string, std::shared_ptr<node_t>> children;
+	};
+	using node_ptr = std::shared_ptr<node_t>;
+
+	/**
+	 * An open directory. The names are taken when the listing starts,
+	 * the offset of an entry is its index + 1.
+	 */
+	struct dir_t {
+		node_ptr node;
+		std::vector<std::string> names;
+	};
+
+	/** The node at the first len chars of path or nullptr, tree_mux has to be held */
+	node_ptr find(const std::string &path, size_t len = std::string::npos);
+
+	/**
+	 * The directory that contains path and the last name of path,
+	 * tree_mux has to be held
+	 */
+	int find_parent(const std::string &path, node_ptr &parent, std::string &name);
+
+	/** A new node owned by mammutfs, tree_mux has to be held exclusively */
+	node_ptr make_node(mode_t mode);
+
+	/** Set the size of a file, its mux has to be held */
+	static void resize(node_t &node, size_t size);
+
+	/** The node of an open file or nullptr */
+	node_ptr file(int fh);
+
+	/** Guards the children of all nodes and next_ino */
+	std::shared_mutex tree_mux;
+
+	node_ptr root;
+	ino_t next_ino = 1;
+
+	/** Guards files and next_fh */
+	std::shared_mutex files_mux;
+
+	/** The open files - unlinked files stay readable until they are closed */
+	std::unordered_map<int, node_ptr> files;
+	int next_fh = 1;
+};
+
+}
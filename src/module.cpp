@@ -1,14 +1,18 @@
 #include "module.h"
 
+#include <stdlib.h>
 #include <unistd.h>
-#include <dirent.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <string.h>
 #include <syslog.h>
 #include <errno.h>
+#include <algorithm>
 #include <iostream>
 #include <sstream>
+#include <vector>
 
+#include "arena.h"
 #include "config.h"
 #include "communicator.h"
 
@@ -36,20 +40,38 @@ Module::Module(const std::string &modname,
                const std::shared_ptr<Communicator> &comm) :
 	config(config),
 	comm(comm),
+	storage(Storage::shared(config)),
 	modname(modname),
-	max_native_fds(0) {
-	this->config->lookupValue("max_native_fds", this->max_native_fds);
+	locator(RaidLocator::shared(config, storage)),
+	statfs_cache(StatfsCache::shared(config, storage)),
+	open_files(config->module_value<size_t>(modname, "max_open_files", 1 << 20)),
+	fd_cache(FdCache::shared(config, storage)) {
+	// The defaults are the same libfuse uses
+	this->cache.attr_timeout = config->module_value<double>(modname, "attr_timeout", 1.0);
+	this->cache.entry_timeout = config->module_value<double>(modname, "entry_timeout", 1.0);
+	this->cache.negative_timeout = config->module_value<double>(modname, "negative_timeout", 0.0);
+	this->cache.kernel_cache = config->module_flag(modname, "kernel_cache");
+	this->cache.cache_readdir = config->module_flag(modname, "cache_readdir");
+	this->configure_attr_cache();
+	this->configure_statx();
+	this->configure_xattr();
+	this->readdirplus = config->module_value<std::string>(modname, "readdirplus", "true") == "true";
+	this->readahead_max = config->module_value<size_t>(modname, "readahead_max", 8 << 20);
+	this->write_buffer_size = config->module_value<size_t>(modname, "write_buffer", 0);
+	this->write_budget = WriteBudget::shared(config);
 	{
 		std::string tmp;
 		this->config->lookupValue("loglevel", tmp);
 		this->max_loglvl = str_to_loglevel(tmp);
 	}
-#ifdef SAVE_FILE_HANDLES
-	config->register_changeable("max_native_fds", [this]() {
-			this->config->lookupValue("max_native_fds", this->max_native_fds);
-			// TODO maybe close enough files to reach the limit
-		});
-#endif
+
+	for (const std::string &key : { std::string("attr_cache_ttl"), modname + "_attr_cache_ttl",
+	                                std::string("negative_cache_ttl"), modname + "_negative_cache_ttl",
+	                                std::string("xattr_cache_ttl"), modname + "_xattr_cache_ttl" }) {
+		config->register_changeable(key, [this]() {
+				this->configure_attr_cache();
+			});
+	}
 
 	config->register_changeable("loglevel", [this]() {
 			std::string tmp;
@@ -60,61 +82,291 @@ Module::Module(const std::string &modname,
 	this->comm->register_command(
 		modname + "_raid",
 		[this](const std::string &/*data*/, std::string &resp) {
-			if (this->basepath == "") {
-				std::string path;
-				find_raid(path);
-			}
+			std::string path;
+			Module::find_raid(path);
 			std::stringstream ss;
-			ss << "\"" << this->basepath << "\"";
+			ss << "\"" << path << "\"";
 			resp = ss.str();
 			return true;
 		}, "Get the modules identified raid");
+
+	this->comm->register_void_command(
+		modname + "_cachestats",
+		[this](const std::string &/*data*/, std::string &resp) {
+			resp = this->attrs.stats();
+		}, "Get the hits and misses of the modules attribute cache");
+
+	this->comm->register_void_command(
+		modname + "_openfiles",
+		[this](const std::string &/*data*/, std::string &resp) {
+			std::stringstream ss;
+			this->dump_open_files(ss);
+			resp = ss.str();
+		}, "Get the open files of the module and the memory they take");
+
+	this->comm->register_void_command(
+		modname + "_clearcache",
+		[this](const std::string &/*data*/, std::string &/*resp*/) {
+			this->attrs.clear();
+		}, "Drop the modules attribute cache");
+}
+
+
+void Module::configure_attr_cache() {
+	// Disabled by default: changes made directly on the raids would only
+	// show up after the ttl
+	double ttl = this->config->module_value<double>(this->modname, "attr_cache_ttl", 0.0);
+	size_t size = this->config->module_value<size_t>(this->modname, "attr_cache_size", 65536);
+	this->attrs.configure(ttl, size);
+
+	ttl = this->config->module_value<double>(this->modname, "negative_cache_ttl", 0.0);
+	size = this->config->module_value<size_t>(this->modname, "negative_cache_size", 16384);
+	bool check_parent = this->config->module_flag(this->modname, "negative_cache_check_mtime");
+	this->attrs.configure_negative(ttl, size, check_parent);
+
+	ttl = this->config->module_value<double>(this->modname, "xattr_cache_ttl", 0.0);
+	size = this->config->module_value<size_t>(this->modname, "xattr_cache_size", 16384);
+	this->attrs.configure_xattr(ttl, size);
+}
+
+
+void Module::configure_xattr() {
+	// Nothing is allowed by default: trusted.*, security.* and system.* would
+	// let users change what the raid enforces
+	std::string allow = this->config->module_value<std::string>(this->modname, "xattr_allow", "");
+	size_t start = 0;
+	while (start < allow.size()) {
+		size_t end = allow.find_first_of(",; ", start);
+		if (end == std::string::npos) {
+			end = allow.size();
+		}
+		if (end > start) {
+			this->xattr_allow.push_back(allow.substr(start, end - start));
+		}
+		start = end + 1;
+	}
+}
+
+
+bool Module::xattr_allowed(const char *name) const {
+	for (const auto &prefix : this->xattr_allow) {
+		if (strncmp(name, prefix.c_str(), prefix.size()) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+
+int Module::fetch_xattrs(const std::string &translated, AttrCache::xattr_list &values) {
+	std::vector<char> names;
+	int retstat = this->list_allowed_xattrs(translated, names);
+	if (retstat < 0) {
+		return retstat;
+	}
+	for (size_t pos = 0; pos < names.size(); pos += strlen(&names[pos]) + 1) {
+		const char *name = &names[pos];
+		std::string value;
+		for (;;) {
+			retstat = this->storage->getxattr(translated, name, nullptr, 0);
+			if (retstat == -ENODATA) {
+				break;
+			} else if (retstat < 0) {
+				return retstat;
+			}
+			value.resize(retstat);
+			retstat = this->storage->getxattr(translated, name, &value[0], value.size());
+			if (retstat >= 0) {
+				value.resize(retstat);
+				values.emplace_back(name, std::move(value));
+				break;
+			} else if (retstat != -ERANGE) {
+				return retstat;
+			}
+			// It grew in between
+		}
+	}
+	return 0;
 }
 
 
-int Module::translatepath(const std::string &path, std::string &out) {
+int Module::list_allowed_xattrs(const std::string &translated, std::vector<char> &names) {
+	int retstat;
+	std::vector<char> all;
+	do {
+		retstat = this->storage->listxattr(translated, nullptr, 0);
+		if (retstat < 0) {
+			return retstat;
+		}
+		all.resize(retstat);
+		retstat = this->storage->listxattr(translated, all.data(), all.size());
+	} while (retstat == -ERANGE);
+	if (retstat < 0) {
+		return retstat;
+	}
+	all.resize(retstat);
+
+	names.clear();
+	for (size_t pos = 0; pos < all.size(); pos += strlen(&all[pos]) + 1) {
+		const char *name = &all[pos];
+		if (this->xattr_allowed(name)) {
+			names.insert(names.end(), name, name + strlen(name) + 1);
+		}
+	}
+	return 0;
+}
+
+
+void Module::configure_statx() {
+	std::string sync = this->config->module_value<std::string>(this->modname, "statx_sync", "default");
+	if (sync == "dont_sync") {
+		this->attr_sync = AT_STATX_DONT_SYNC;
+	} else if (sync == "force_sync") {
+		this->attr_sync = AT_STATX_FORCE_SYNC;
+	} else {
+		if (sync != "default") {
+			this->warn(0, "config", "unknown statx_sync, using default", sync);
+		}
+		this->attr_sync = AT_STATX_SYNC_AS_STAT;
+	}
+
+	static const std::map<std::string, unsigned int> fields = {
+		{ "basic", STATX_BASIC_STATS },
+		{ "type", STATX_TYPE },
+		{ "mode", STATX_MODE },
+		{ "nlink", STATX_NLINK },
+		{ "uid", STATX_UID },
+		{ "gid", STATX_GID },
+		{ "atime", STATX_ATIME },
+		{ "mtime", STATX_MTIME },
+		{ "ctime", STATX_CTIME },
+		{ "ino", STATX_INO },
+		{ "size", STATX_SIZE },
+		{ "blocks", STATX_BLOCKS },
+	};
+	std::string mask = this->config->module_value<std::string>(this->modname, "statx_mask", "basic");
+	std::stringstream ss(mask);
+	std::string field;
+	this->attr_mask = STATX_TYPE | STATX_MODE;
+	while (std::getline(ss, field, ',')) {
+		auto it = fields.find(field);
+		if (it != fields.end()) {
+			this->attr_mask |= it->second;
+		} else {
+			this->warn(0, "config", "unknown statx_mask field, fetching all", field);
+			this->attr_mask |= STATX_BASIC_STATS;
+		}
+	}
+}
+
+
+bool Module::cached_attr(const std::string &translated, struct stat *statbuf, int &retstat) {
+	if (this->attrs.get(translated, statbuf)) {
+		retstat = 0;
+		return true;
+	}
+
+	struct timespec mtime;
+	if (!this->attrs.get_negative(translated, mtime)) {
+		return false;
+	}
+	if (this->attrs.check_parent()) {
+		struct stat parent;
+		if (this->parent_attr(translated, &parent) != 0
+		    || parent.st_mtim.tv_sec != mtime.tv_sec
+		    || parent.st_mtim.tv_nsec != mtime.tv_nsec) {
+			this->attrs.drop_negative(translated);
+			return false;
+		}
+	}
+	retstat = -ENOENT;
+	return true;
+}
+
+
+int Module::parent_attr(const std::string &translated, struct stat *statbuf) {
+	size_t pos = translated.find_last_of('/');
+	if (pos == std::string::npos) {
+		return -ENOENT;
+	}
+	Arena::scope scope;
+	std::string &parent = scope.string();
+	parent.assign(translated, 0, pos);
+	if (this->attrs.get(parent, statbuf)) {
+		return 0;
+	}
+	uint64_t ticket = this->attrs.ticket();
+	int retstat = this->statx(parent, AT_SYMLINK_NOFOLLOW, this->attr_mask, statbuf);
+	if (retstat == 0) {
+		this->attrs.put(parent, *statbuf, ticket);
+	}
+	return retstat;
+}
+
+
+int Module::translatepath(std::string_view path, std::string &out) {
 	if (!this->is_path_valid(path))
 		return -ENOENT;
 
-	std::string basepath;
+	Arena::scope scope;
+	std::string &basepath = scope.string();
 	int retval = find_raid(basepath);
-	out = basepath + path;
+	out.assign(basepath).append(path);
 	return retval;
 }
 
 
 int Module::find_raid(std::string &path) {
-	if (basepath != "") {
-		path = basepath;
+	uint64_t generation = this->locator->generation();
+	auto current = std::atomic_load(&this->basepath);
+	if (current && current->generation == generation) {
+		path = current->path;
 		return 0;
 	}
 
-	for (const auto &raid : config->raids) {
-		std::string to_test = raid + "/" + modname + "/" + config->homename();
-
-		//this->log(LOG_LEVEL::INFO, std::string("Testing raid " + to_test));
-		struct stat statbuf;
-		memset(&statbuf, 0, sizeof(statbuf));
-		int retval = ::stat(to_test.c_str(), &statbuf);
-
-		if (retval == 0) {
-			//this->log(LOG_LEVEL::INFO, std::string("Found raid at " + to_test));
-			basepath = to_test;
-			break;
+	// All fuse workers may ask for the raid concurrently, the first one
+	// performs the lookup
+	std::lock_guard<std::mutex> lock(this->basepath_mux);
+	current = std::atomic_load(&this->basepath);
+	if (current && current->generation == generation) {
+		path = current->path;
+		return 0;
+	}
+	std::string previous = current ? current->path : "";
+
+	std::string home;
+	if (this->locator->locate(modname, home) != 0
+	    && !this->storage->is_native() && !config->raids.empty()) {
+		// A fresh memory storage is empty, the home lives on the first raid
+		home = config->raids.front() + "/" + modname + "/" + config->homename();
+		if (this->storage->mkdirs(home, 0755) != 0) {
+			home = "";
 		}
 	}
-	if (basepath == "") {
+	if (home == "") {
 		this->log(LOG_LEVEL::ERR, 0, "Could not find Raid!! THIS IS BAD!");
 		return -ENOENT;
 	}
 
-	path = basepath;
+	if (home != previous) {
+		if (previous != "") {
+			// The user was moved to another raid
+			this->log(LOG_LEVEL::WRN, 0, "Home moved from " + previous, home);
+			this->attrs.clear();
+		}
+		// From now on the paths of this module are resolved below the home
+		this->storage->add_root(home);
+	}
+	std::atomic_store(&this->basepath,
+	                  std::shared_ptr<const basepath_t>(new basepath_t { home, generation }));
+
+	path = home;
 	return 0;
 }
 
 
 void Module::log(LOG_LEVEL lvl, int errnum, const std::string &msg, const std::string &path) {
-	if (static_cast<int>(lvl) < static_cast<int>(this->max_loglvl)) {
+	if (static_cast<int>(lvl) < static_cast<int>(this->max_loglvl.load())) {
 		return;
 	}
 
@@ -168,12 +420,16 @@ void Module::log(LOG_LEVEL lvl, int errnum, const std::string &msg, const std::s
 
 
 #ifdef ENABLE_TRACELOG
-void Module::trace(const std::string &method,
-                   const std::string &path,
-                   const std::string &second_path) {
+void Module::trace(std::string_view method,
+                   std::string_view path,
+                   std::string_view second_path) {
+	// Formatting the message is the expensive part, skip it if unused
+	if (this->max_loglvl.load() != LOG_LEVEL::TRACE) {
+		return;
+	}
 	std::stringstream ss;
 	ss << method << ": " << path;
-	if (second_path != "") {
+	if (!second_path.empty()) {
 		ss << " --> " << second_path;
 	}
 	log(LOG_LEVEL::TRACE, 0, ss.str());
@@ -224,39 +480,30 @@ void Module::error(int errnum,
 
 
 // A default file handle does nothing
-Module::open_file_handle_t::open_file_handle_t(open_file_t *f, bool close) :
+Module::open_file_handle_t::open_file_handle_t(open_file_t *f, Storage *s, FdCache *c) :
 	file(f),
-	should_close(close) {
+	storage(s),
+	cache(c) {
+	if (this->file != nullptr) {
+		FdCache::pin(this->file);
+	}
 }
 
 
 Module::open_file_handle_t::open_file_handle_t(open_file_handle_t &&rhs) :
 	file(rhs.file),
-	should_close(rhs.should_close) {
+	storage(rhs.storage),
+	cache(rhs.cache) {
 	rhs.file = nullptr;
 }
 
 
-// Closes the file upon leaving the control structure, releasing its contents
-// and especially its precious file descriptors.
+// Lets the fd cache close the file again, if it needs the room for hotter
+// files. Its precious file descriptor stays open for now.
 Module::open_file_handle_t::~open_file_handle_t() {
-#ifdef SAVE_FILE_HANDLES
 	if (this->file != nullptr) {
-		if (this->should_close && this->file->is_open) {
-			switch(this->file->type) {
-			case open_file_t::FILE:
-				::close(this->file->fh.fd);
-				break;
-			case open_file_t::DIRECTORY:
-				::closedir(this->file->fh.dp);
-				break;
-			default:
-				break;
-			}
-			this->file->is_open = false;
-		}
+		FdCache::unpin(this->file);
 	}
-#endif
 }
 
 
@@ -266,42 +513,53 @@ int Module::open_file_handle_t::fd() {
 		return -1;
 	}
 
-#ifdef SAVE_FILE_HANDLES
-	if (!this->file->is_open) {
-		// Remember R/W status, and set the remaining stuff correctly
-		int flags = (this->file->flags & (O_RDONLY | O_WRONLY | O_RDWR)) | O_NOFOLLOW | O_APPEND;
-		this->file->fh.fd = ::open(this->file->path.c_str(), flags);
-		if (this->file->fh.fd < 0) {
-			std::cerr << strerror(errno) << "open_file_handle: ERROR opening file" << this->file->path;
-		}
-		this->file->is_open = true;
+	if (this->file->is_open.load(std::memory_order_acquire)) {
+		this->cache->hit();
+		return this->file->fh.fd;
 	}
-#endif
+
+	// Remember R/W status, everything else (O_TRUNC!) was done by open
+	this->cache->miss();
+	int flags = (this->file->flags & (O_ACCMODE | O_APPEND)) | O_NOFOLLOW;
+	int fd = this->storage->open(*this->file->path, flags);
+	if (fd < 0) {
+		errno = -fd;
+		std::cerr << strerror(errno) << "open_file_handle: ERROR opening file" << *this->file->path;
+		return -1;
+	}
+	this->cache->add(this->file, fd);
 	return this->file->fh.fd;
 }
 
 
-DIR *Module::open_file_handle_t::dp() {
+void *Module::open_file_handle_t::dir() {
 	if (this->file->type != open_file_t::DIRECTORY) {
 		errno = EINVAL;
 		return NULL;
 	}
-#ifdef SAVE_FILE_HANDLES
-	if (!this->file->is_open) {
-		this->file->fh.dp = ::opendir(this->file->path.c_str());
-		this->file->is_open = true;
+
+	if (this->file->is_open.load(std::memory_order_acquire)) {
+		this->cache->hit();
+		return this->file->fh.dir;
 	}
-#endif
-	return this->file->fh.dp;
+
+	this->cache->miss();
+	void *dir = nullptr;
+	int retstat = this->storage->opendir(*this->file->path, dir);
+	if (retstat < 0) {
+		errno = -retstat;
+		return NULL;
+	}
+	this->cache->add(this->file, dir);
+	return this->file->fh.dir;
 }
 
 void Module::open_file_handle_t::debug(std::ostream &os) {
-	os << "{file: " << file->path
+	os << "{file: " << *file->path
 	   << ", type: " << file->type
 	   << ", flags: " << file->flags
 	   << ", open: " << file->is_open
 	   << ", changed " << file->has_changed
-	   << ", close: " << should_close
 	   << "}";
 }
 
@@ -310,41 +568,121 @@ Module::open_file_handle_t Module::file(const std::string &path, fuse_file_info
 	// If not, create a open file structure, but do not assign any sane values
 	// to it, it is not possible to do that cleanly at this point.
 	// Finally, create a open_file_handle_t for this file.
-	// Use the number of open files as reference for the should_close flag;
-	const auto &lock = std::lock_guard<std::mutex>(this->open_file_mux);
+	open_file_t *file = this->open_files.get(fi->fh);
+	if (file == nullptr) {
+		uint64_t handle = this->open_files.allocate(file);
+		if (handle == 0) {
+			this->warn(ENFILE, "file", "too many open files", path);
+			return open_file_handle_t(nullptr, this->storage.get(), nullptr);
+		}
+		file->path = this->open_paths.intern(path);
+		file->fh.fd = -1;
+		fi->fh = handle;
+	}
 
-	open_file_t *file;
-	auto it = open_files.find(fi->fh);
-	if (it != open_files.end()) {
-		file = &it->second;
-	} else {
-		open_file_t f;
-		f.path = path; // TODO do we have to store the path?
-		f.is_open = false;
-		f.has_changed = false;
-		f.type = open_file_t::UNSPEC;
-		f.flags = 0;
-		f.fh.fd = -1;
+	return open_file_handle_t(file, this->storage.get(), this->fd_cache.get());
+}
+
+Module::open_file_handle_t Module::file(fuse_file_info *fi) {
+	open_file_t *file = this->open_files.get(fi->fh);
+	return open_file_handle_t(file, this->storage.get(), this->fd_cache.get());
+}
 
-		int64_t fileid = this->open_file_count++;
-		fi->fh = fileid;
 
-		file = &open_files.emplace(std::make_pair(fileid, f)).first->second;
+int Module::backing_fd(struct fuse_file_info *fi) {
+	open_file_t *file = this->open_files.get(fi->fh);
+	if (file == nullptr
+	    || file->type != open_file_t::FILE
+	    || file->write_buffer
+	    || !this->storage->is_native()) {
+		// Buffered writes have to stay in order with everything else
+		return -1;
 	}
+	// This handle is unbuffered, but others of the file may not be
+	this->flush_writes(*file->path);
+	FdCache::pin(file);
+	if (!file->is_open.load(std::memory_order_acquire)) {
+		// Evicted, the module reopens it
+		FdCache::unpin(file);
+		return -1;
+	}
+	this->fd_cache->hit();
+	return file->fh.fd;
+}
 
-	bool should_close = open_files.size() > max_native_fds;
+void Module::put_backing_fd(struct fuse_file_info *fi) {
+	open_file_t *file = this->open_files.get(fi->fh);
+	if (file != nullptr) {
+		FdCache::unpin(file);
+	}
+}
 
-	return open_file_handle_t(file, should_close);
+void Module::file_written(struct fuse_file_info *fi) {
+	open_file_t *file = this->open_files.get(fi->fh);
+	if (file != nullptr) {
+		file->has_changed = true;
+		this->attrs.invalidate(*file->path);
+	}
+}
+
+int Module::detach_file(struct fuse_file_info *fi, int &error) {
+	error = 0;
+	open_file_t *file = this->open_files.get(fi->fh);
+	if (file == nullptr) {
+		return -1;
+	}
+	{
+		// Usually flush did that already
+		auto f = this->file(fi);
+		error = this->flush_writes(f, true);
+	}
+	if ((file->flags & O_ACCMODE) != O_RDONLY) {
+		// Passthrough writes never reach the module
+		this->attrs.invalidate(*file->path);
+	}
+	this->disown_buffer(file);
+	FdCache::pin(file);
+	int fd = this->fd_cache->take(file);
+	if (fd >= 0 && !this->storage->is_native()) {
+		// Nobody but the storage can use it
+		this->storage->close(fd);
+		fd = -1;
+	}
+	this->free_file(fi, file);
+	return fd;
+}
+
+
+void Module::disown_buffer(open_file_t *file) {
+	auto buffer = std::atomic_load(&file->write_buffer);
+	if (buffer) {
+		// flush_writes(translated) uses the fd only under the lock
+		std::lock_guard<std::mutex> lock(buffer->mux);
+		buffer->owner = nullptr;
+	}
+}
+
+
+void Module::free_file(struct fuse_file_info *fi, open_file_t *file) {
+	// The slot is freed first: flush_writes(translated) then does not see
+	// the file anymore while its path and buffer go. The buffer gives its
+	// memory back to the budget, free does not destroy the slot.
+	const std::string *path = file->path;
+	auto buffer = std::atomic_exchange(&file->write_buffer, std::shared_ptr<WriteBuffer>());
+	this->open_files.free(fi->fh);
+	buffer.reset();
+	this->open_paths.release(path);
 }
 
 void Module::close_file(const std::string &/*path*/, fuse_file_info *fi) {
 	// Test if the file was open, if so - remove it and thereby close it.
-	const auto &lock = std::lock_guard<std::mutex>(this->open_file_mux);
-
-	auto it = open_files.find(fi->fh);
-	if (it != open_files.end()) {
-		// We do not need to call close, will be done in destructor
-		open_files.erase(it);
+	open_file_t *file = this->open_files.get(fi->fh);
+	if (file != nullptr) {
+		// Usually the file was closed by the caller already
+		this->disown_buffer(file);
+		FdCache::pin(file);
+		this->fd_cache->close(file);
+		this->free_file(fi, file);
 	}
 }
 
@@ -355,13 +693,27 @@ void Module::close_file(const char *path, fuse_file_info *fi) {
 
 
 void Module::dump_open_files(std::ostream &s) {
-	const auto& lock = std::lock_guard<std::mutex>(this->open_file_mux);
-	for (const auto &t : open_files) {
-		s << "{\"key\":\"" << t.first << "\","
-		  << "\"name\":\"" << t.second.path << "\","
-		  << "\"changed\":\"" << t.second.has_changed << "\","
-		  << "\"open\":\"" << t.second.is_open << "\"},";
-	}
+	s << "{\"open\":" << this->open_files.size()
+	  << ",\"max\":" << this->open_files.limit()
+	  << ",\"slots\":" << this->open_files.capacity()
+	  << ",\"bytes\":" << this->open_files.memory()
+	  << ",\"paths\":" << this->open_paths.size()
+	  << ",\"path_bytes\":" << this->open_paths.memory()
+	  << ",\"write_buffers\":" << this->write_budget->in_use()
+	  << ",\"files\":[";
+	bool first = true;
+	this->open_files.for_each([&](uint64_t handle, const open_file_t &file) {
+			auto buffer = std::atomic_load(&file.write_buffer);
+			s << (first ? "" : ",")
+			  << "{\"key\":\"" << handle << "\","
+			  << "\"name\":\"" << (file.path ? *file.path : "") << "\","
+			  << "\"changed\":\"" << file.has_changed << "\","
+			  << "\"readahead\":" << file.read_ahead_window.load() << ","
+			  << "\"buffered\":" << (buffer ? buffer->pending() : 0) << ","
+			  << "\"open\":\"" << file.is_open << "\"}";
+			first = false;
+		});
+	s << "]}";
 }
 
 
@@ -389,16 +741,34 @@ int Module::getattr(const char *path, struct stat *statbuf) {
 	}
 
 	int retstat = 0;
-	std::string translated;
+	Arena::scope scope;
+	std::string &translated = scope.string();
 	if ((retstat = this->translatepath(path, translated)) != 0) {
 		this->info("getattr", "translatepath failed", path);
-	} else {
-		retstat = ::lstat(translated.c_str(), statbuf);
-		if (retstat) {
-			retstat = -errno;
-			if (errno != ENOENT) {
-				this->warn(errno, "getattr", "lstat failed", translated);
+		return retstat;
+	}
+	// The size on the raid has to include what is still buffered
+	this->flush_writes(translated);
+	if (!this->cached_attr(translated, statbuf, retstat)) {
+		uint64_t ticket = this->attrs.ticket();
+		// The mtime has to be taken before the lstat: a name created in
+		// between then shows up as a changed directory
+		struct stat parent;
+		bool negative = !this->attrs.check_parent()
+			|| this->parent_attr(translated, &parent) == 0;
+		retstat = this->statx(translated, AT_SYMLINK_NOFOLLOW, this->attr_mask, statbuf);
+		if (retstat == 0) {
+			this->attrs.put(translated, *statbuf, ticket);
+		} else if (retstat == -ENOENT) {
+			if (negative) {
+				struct timespec mtime = { 0, 0 };
+				if (this->attrs.check_parent()) {
+					mtime = parent.st_mtim;
+				}
+				this->attrs.put_negative(translated, mtime, ticket);
 			}
+		} else {
+			this->warn(-retstat, "getattr", "statx failed", translated);
 		}
 	}
 
@@ -423,7 +793,8 @@ int Module::readlink(const char *path, char */*link*/, size_t /*size*/) {
 	if (size == 0)
 		return -EINVAL;
 
-	std::string translated;
+	Arena::scope scope;
+	std::string &translated = scope.string();
 	retstat = this->translatepath(path, translated);
 
 	retstat = ::readlink(translated.c_str(), link, size - 1);
@@ -439,13 +810,6 @@ int Module::readlink(const char *path, char */*link*/, size_t /*size*/) {
 }
 
 
-/* Deprecated, use readdir() instead */
-int Module::getdir(const char *path, fuse_dirh_t, fuse_dirfil_t) {
-	this->trace("getdir", path);
-	return -ENOTSUP;
-}
-
-
 int Module::mknod(const char *path, mode_t, dev_t) {
 	this->trace("mknod", path);
 	return -ENOTSUP;
@@ -456,15 +820,17 @@ int Module::mkdir(const char *path, mode_t mode) {
 	this->trace("mkdir", path);
 
 	int retstat = 0;
-	std::string translated;
+	Arena::scope scope;
+	std::string &translated = scope.string();
 	if ((retstat = this->translatepath(path, translated))) {
 		this->info("mkdir", "translatepath failed", path);
 		return retstat;
 	}
 
-	if ((retstat = ::mkdir(translated.c_str(), mode)) < 0) {
-		retstat = -errno;
-		this->warn(errno, "mkdir", "mkdir failed", translated);
+	if ((retstat = this->storage->mkdir(translated, mode)) < 0) {
+		this->warn(-retstat, "mkdir", "mkdir failed", translated);
+	} else {
+		this->attrs.invalidate_entry(translated);
 	}
 
 	return retstat;
@@ -475,15 +841,17 @@ int Module::unlink(const char *path) {
 	this->trace("unlink", path);
 
 	int retstat = 0;
-	std::string translated;
+	Arena::scope scope;
+	std::string &translated = scope.string();
 	if ((retstat = this->translatepath(path, translated))) {
 		this->info("unlink", "translatepath failed", path);
 		return retstat;
 	}
 
-	if ((retstat = ::unlink(translated.c_str()))) {
-		retstat = -errno;
-		this->warn(errno, "unlink", "unlink", translated);
+	if ((retstat = this->storage->unlink(translated))) {
+		this->warn(-retstat, "unlink", "unlink", translated);
+	} else {
+		this->attrs.invalidate_entry(translated);
 	}
 
 	return retstat;
@@ -494,15 +862,18 @@ int Module::rmdir(const char *path) {
 	this->trace("rmdir", path);
 
 	int retstat = 0;
-	std::string translated;
+	Arena::scope scope;
+	std::string &translated = scope.string();
 	if ((retstat = this->translatepath(path, translated))) {
 		this->info("rmdir", "translatepath failed", path);
 		return retstat;
 	}
 
-	if ((retstat = ::rmdir(translated.c_str()))) {
-		retstat = -errno;
-		this->warn(errno, "rmdir", "rmdir", translated);
+	if ((retstat = this->storage->rmdir(translated))) {
+		this->warn(-retstat, "rmdir", "rmdir", translated);
+	} else {
+		this->attrs.invalidate_tree(translated);
+		this->attrs.invalidate_entry(translated);
 	}
 
 	return retstat;
@@ -522,19 +893,25 @@ int Module::rename(const char *sourcepath,
 	this->trace("rename", sourcepath, newpath);
 
 	int retstat = 0;
-	std::string to_translated;
+	Arena::scope scope;
+	std::string &to_translated = scope.string();
 	if ((retstat = this->translatepath(newpath, to_translated))) {
 		this->info("rename", "translatepath failed", newpath);
 		return retstat;
 	}
 
-	if ((retstat = ::rename(sourcepath, to_translated.c_str()) < 0)) {
-		retstat = -errno;
-		this->warn(errno, "rename", "rename", sourcepath, to_translated);
+	if ((retstat = this->storage->rename(sourcepath, to_translated)) < 0) {
+		this->warn(-retstat, "rename", "rename", sourcepath, to_translated);
 	} else {
 		// Open files do not need to be modified, because of filesystem magic
 		// that linux provides - a file is not re-identified by its name but
 		// by its filedescriptor (like it has to be)
+		// The source may belong to another module, its cache is dropped by
+		// the engine.
+		this->attrs.invalidate_tree(sourcepath);
+		this->attrs.invalidate_entry(sourcepath);
+		this->attrs.invalidate_tree(to_translated);
+		this->attrs.invalidate_entry(to_translated);
 	}
 
 	return retstat;
@@ -545,15 +922,17 @@ int Module::chmod(const char *path, mode_t mode) {
 	this->trace("chmod", path);
 
 	int retstat = 0;
-	std::string translated;
+	Arena::scope scope;
+	std::string &translated = scope.string();
 	if ((retstat = this->translatepath(path, translated))) {
 		this->info("chmod", "translatepath failed", path);
 		return retstat;
 	}
 
-	if ((retstat = ::chmod(translated.c_str(), mode)) < 0) {;
-		retstat = -errno;
-		this->warn(errno, "chmod", "chmod", translated);
+	if ((retstat = this->storage->chmod(translated, mode)) < 0) {
+		this->warn(-retstat, "chmod", "chmod", translated);
+	} else {
+		this->attrs.invalidate(translated);
 	}
 
 	return retstat;
@@ -570,7 +949,8 @@ int Module::truncate(const char *path, off_t newsize) {
 	this->trace("truncate", path);
 
 	int retstat = 0;
-	std::string translated;
+	Arena::scope scope;
+	std::string &translated = scope.string();
 	if ((retstat = this->translatepath(path, translated))) {
 		this->info("truncate", "translatepath failed", path);
 		return retstat;
@@ -579,9 +959,9 @@ int Module::truncate(const char *path, off_t newsize) {
 	if (newsize > config->truncate_max_size()) {
 		struct stat st;
 		memset(&st, 0, sizeof(st));
-		if (::stat(translated.c_str(), &st) != 0) {
-			this->warn(errno, "truncate", "stat", translated);
-			return -errno;
+		if ((retstat = this->statx(translated, 0, STATX_SIZE, &st)) != 0) {
+			this->warn(-retstat, "truncate", "stat", translated);
+			return retstat;
 		}
 
 		if (st.st_size < newsize) {
@@ -589,12 +969,14 @@ int Module::truncate(const char *path, off_t newsize) {
 		}
 	}
 
-	retstat = ::truncate(translated.c_str(), newsize);
+	// Written after the truncate, they would bring the cut data back
+	this->flush_writes(translated);
+	retstat = this->storage->truncate(translated, newsize);
 	if (retstat < 0) {
-		retstat = -errno;
-		this->warn(errno, "truncate", "truncate", translated);
+		this->warn(-retstat, "truncate", "truncate", translated);
 	} else {
 		// We cannot link to an open file.
+		this->attrs.invalidate(translated);
 	}
 
 	return retstat;
@@ -604,56 +986,113 @@ int Module::open(const char *path, struct fuse_file_info *fi) {
 	this->trace("open", path);
 
 	int retstat = 0;
-	std::string translated;
+	Arena::scope scope;
+	std::string &translated = scope.string();
 	if ((retstat = this->translatepath(path, translated))) {
 		this->info("open", "translatepath failed", path);
 		return retstat;
 	}
 
+	// The new handle reads what the others wrote
+	this->flush_writes(translated);
 	// How not to follow symlinks
 	fi->flags |= O_NOFOLLOW;
-	int fd = ::open(translated.c_str(), fi->flags);
+	int fd = this->storage->open(translated, fi->flags);
 	if (fd < 0) {
-		retstat = -errno;
-		this->warn(errno, "open", "open", translated);
+		retstat = fd;
+		this->warn(-retstat, "open", "open", translated);
 	} else {
-		auto f = this->file(translated, fi);
-		f.file->type = open_file_t::FILE;
-		f.file->fh.fd = fd;
-		f.file->is_open = true;
-		f.file->has_changed = false;
-		f.file->flags = fi->flags;
+		retstat = this->register_file(translated, fd, fi);
 	}
 
 	return retstat;
 }
 
 
+int Module::register_file(const std::string &translated, int fd,
+                          struct fuse_file_info *fi) {
+	// The open has cut the file (atomic_o_trunc), the cached size is gone
+	if (fi->flags & O_TRUNC) {
+		this->attrs.invalidate(translated);
+	}
+	auto f = this->file(translated, fi);
+	if (!f.valid()) {
+		this->storage->close(fd);
+		return -ENFILE;
+	}
+	f.file->type = open_file_t::FILE;
+	f.file->has_changed = false;
+	f.file->flags = fi->flags;
+	this->buffer_writes(f.file);
+	this->fd_cache->add(f.file, fd);
+	fi->keep_cache = this->cache.kernel_cache;
+	return 0;
+}
+
+
 int Module::read(const char *path, char *buf, size_t size, off_t offset,
                  struct fuse_file_info *fi) {
 	this->trace("read", path);
 
-	int retstat = 0;
-	std::string translated;
-	if ((retstat = this->translatepath(path, translated))) {
-		this->info("read", "translatepath failed", path);
-		return retstat;
+	auto f = this->file(fi);
+	if (!f.valid()) {
+		return -EBADF;
 	}
-	auto f = this->file(translated, fi);
 
-	retstat = ::pread(f.fd(), buf, size, offset);
+	// A file reads what was written to it, through any handle
+	this->flush_writes(f);
+	this->flush_writes(*f.file->path);
+	int fd = f.fd();
+	this->read_ahead(fi, fd, offset, size);
+	int retstat = this->storage->pread(fd, buf, size, offset);
 	if (retstat < 0) {
 		std::stringstream ss;
 		f.debug(ss);
 		ss << "{size: " << size << " offset: " << offset << "}";
-		this->warn(errno, "read", ss.str(), translated);
-		retstat = -errno;
+		this->warn(-retstat, "read", ss.str(), *f.file->path);
 	}
 
 	return retstat;
 }
 
 
+void Module::read_ahead(struct fuse_file_info *fi, int fd, off_t offset, size_t size) {
+	open_file_t *file = this->open_files.get(fi->fh);
+	if (this->readahead_max == 0 || fd < 0 || file == nullptr) {
+		return;
+	}
+
+	// The kernel issues the reads of a stream from several threads, they
+	// arrive slightly reordered
+	off_t end = offset + size;
+	off_t slack = size;
+	off_t expected = file->next_read.load(std::memory_order_relaxed);
+	if (expected < 0 || offset + 2 * slack < expected || offset > expected + slack) {
+		file->next_read.store(end, std::memory_order_relaxed);
+		file->read_ahead_window.store(0, std::memory_order_relaxed);
+		file->read_ahead_until.store(0, std::memory_order_relaxed);
+		return;
+	}
+	while (end > expected
+	       && !file->next_read.compare_exchange_weak(expected, end, std::memory_order_relaxed)) {
+	}
+
+	size_t window = file->read_ahead_window.load(std::memory_order_relaxed);
+	window = std::min(std::max(window * 2, size * 4), this->readahead_max);
+	file->read_ahead_window.store(window, std::memory_order_relaxed);
+
+	// Refill once half of the window was read, not on every read
+	off_t until = file->read_ahead_until.load(std::memory_order_relaxed);
+	if (until - end >= static_cast<off_t>(window / 2)) {
+		return;
+	}
+	off_t from = std::max(until, end);
+	off_t to = end + window;
+	file->read_ahead_until.store(to, std::memory_order_relaxed);
+	this->storage->readahead(fd, from, to - from);
+}
+
+
 int Module::write(const char *path, const char *buf, size_t size, off_t offset,
                   struct fuse_file_info *fi) {
 	this->trace("write", path);
@@ -661,23 +1100,254 @@ int Module::write(const char *path, const char *buf, size_t size, off_t offset,
 	//dump_open_files(std::cout << "open files: ");
 	//std::cout << std::endl;
 
+	auto f = this->file(fi);
+	if (!f.valid()) {
+		return -EBADF;
+	}
+	if (f.file->write_buffer) {
+		return this->write_buffered(f, buf, size, offset);
+	}
+	int fd = f.fd();
+	int retstat = this->storage->pwrite(fd, buf, size, offset);
+	if (retstat < 0) {
+		std::stringstream ss;
+		f.debug(ss);
+		ss << "{size: " << size << " offset: " << offset << "}";
+		this->warn(-retstat, "write", ss.str(), *f.file->path);
+	} else {
+		f.file->has_changed = true;
+		this->attrs.invalidate(*f.file->path);
+	}
+
+	return retstat;
+}
+
+
+void Module::buffer_writes(open_file_t *file) {
+	if ((file->flags & O_ACCMODE) != O_RDONLY) {
+		// flush_writes and dump_open_files load it from other threads
+		std::shared_ptr<WriteBuffer> buffer =
+			WriteBuffer::create(this->write_buffer_size, this->write_budget, *file->path);
+		if (buffer) {
+			buffer->owner = file;
+		}
+		std::atomic_store(&file->write_buffer, buffer);
+	}
+}
+
+
+int Module::write_buffered(open_file_handle_t &f, const char *buf, size_t size, off_t offset) {
+	WriteBuffer &buffer = *f.file->write_buffer;
+	std::lock_guard<std::mutex> lock(buffer.mux);
+
+	int retstat = size;
+	if (!buffer.append(buf, size, offset)) {
+		// What is buffered was written before, and stays so
+		int fd = f.fd();
+		buffer.write(this->storage.get(), fd, true);
+		if (!buffer.append(buf, size, offset)) {
+			retstat = this->storage->pwrite(fd, buf, size, offset);
+		}
+	}
+	if (buffer.full()) {
+		// An error is reported by flush, this write is fine
+		buffer.write(this->storage.get(), f.fd(), false);
+	}
+
+	if (retstat < 0) {
+		std::stringstream ss;
+		f.debug(ss);
+		ss << "{size: " << size << " offset: " << offset << "}";
+		this->warn(-retstat, "write", ss.str(), *f.file->path);
+	} else {
+		f.file->has_changed = true;
+		this->attrs.invalidate(*f.file->path);
+	}
+	return retstat;
+}
+
+
+int Module::flush_writes(open_file_handle_t &f, bool report) {
+	WriteBuffer *buffer = f.file->write_buffer.get();
+	if (buffer == nullptr || (buffer->pending() == 0 && !report)) {
+		return 0;
+	}
+
+	std::lock_guard<std::mutex> lock(buffer->mux);
 	int retstat = 0;
-	std::string translated;
-	if ((retstat = this->translatepath(path, translated))) {
-		this->info("write", "translatepath failed", path);
-		return retstat;
+	if (buffer->pending() > 0) {
+		retstat = buffer->write(this->storage.get(), f.fd(), true);
+		if (retstat < 0) {
+			this->warn(-retstat, "flush", "buffered write", *f.file->path);
+		}
 	}
-	auto f = this->file(translated, fi);
+	if (report) {
+		retstat = buffer->take_error();
+	}
+	return retstat;
+}
+
+
+void Module::flush_writes(const std::string &translated) {
+	if (this->write_buffer_size == 0 || !this->write_budget->dirty()) {
+		return;
+	}
+
+	std::vector<std::shared_ptr<WriteBuffer>> buffers;
+	this->write_budget->dirty_buffers(translated, buffers);
+
+	// Only opened for buffers whose file has no fd anymore
+	int fd = -1;
+	for (const auto &buffer : buffers) {
+		// The error is kept in the buffer for its owner as well
+		std::lock_guard<std::mutex> lock(buffer->mux);
+		if (buffer->pending() == 0) {
+			continue;
+		}
+		// The owner cannot close its fd while the buffer is locked, the pin
+		// keeps the fd cache from evicting it
+		FdCache::entry_t *owner = buffer->owner;
+		if (owner != nullptr) {
+			FdCache::pin(owner);
+		}
+		int retstat;
+		if (owner != nullptr && owner->is_open.load(std::memory_order_acquire)) {
+			this->fd_cache->hit();
+			retstat = buffer->write(this->storage.get(), owner->fh.fd, true);
+		} else {
+			if (fd < 0) {
+				fd = this->storage->open(translated, O_WRONLY | O_NOFOLLOW);
+			}
+			// Else the owner writes its buffer on its next flush
+			retstat = fd < 0 ? fd : buffer->write(this->storage.get(), fd, true);
+		}
+		if (owner != nullptr) {
+			FdCache::unpin(owner);
+		}
+		if (retstat < 0) {
+			this->warn(-retstat, "flush", "buffered write", translated);
+		}
+	}
+	if (fd >= 0) {
+		this->storage->close(fd);
+	}
+}
+
+
+// FUSE_BUFVEC_INIT is a compound literal, which is not valid C++
+static void bufvec_init(struct fuse_bufvec &bufv, size_t size) {
+	memset(&bufv, 0, sizeof(bufv));
+	bufv.count = 1;
+	bufv.buf[0].size = size;
+	bufv.buf[0].fd = -1;
+}
+
+
+int Module::read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
+                     off_t offset, struct fuse_file_info *fi) {
+	this->trace("read_buf", path);
+
+	auto f = this->file(fi);
+	if (!f.valid()) {
+		return -EBADF;
+	}
+
+	// fuse splices from the fd after f is gone, without a pin. While fds are
+	// being evicted, its number may be reused meanwhile - the data is copied
+	// then.
+	this->flush_writes(f);
+	this->flush_writes(*f.file->path);
 	int fd = f.fd();
-	retstat = ::pwrite(fd, buf, size, offset);
+	if (!f.is_native() || fd < 0 || this->fd_cache->under_pressure()) {
+		return this->read_buf_copy(path, bufp, size, offset, fi);
+	}
+	this->read_ahead(fi, fd, offset, size);
+
+	struct fuse_bufvec *buf = static_cast<fuse_bufvec *>(malloc(sizeof(struct fuse_bufvec)));
+	if (buf == NULL) {
+		return -ENOMEM;
+	}
+	bufvec_init(*buf, size);
+	buf->buf[0].flags = static_cast<fuse_buf_flags>(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+	buf->buf[0].fd = fd;
+	buf->buf[0].pos = offset;
+	*bufp = buf;
+
+	return 0;
+}
+
+
+int Module::read_buf_copy(const char *path, struct fuse_bufvec **bufp,
+                          size_t size, off_t offset, struct fuse_file_info *fi) {
+	struct fuse_bufvec *buf = static_cast<fuse_bufvec *>(malloc(sizeof(struct fuse_bufvec)));
+	if (buf == NULL) {
+		return -ENOMEM;
+	}
+	bufvec_init(*buf, size);
+	buf->buf[0].mem = malloc(size);
+	if (buf->buf[0].mem == NULL) {
+		free(buf);
+		return -ENOMEM;
+	}
+
+	int retstat = this->read(path, static_cast<char *>(buf->buf[0].mem), size, offset, fi);
 	if (retstat < 0) {
+		free(buf->buf[0].mem);
+		free(buf);
+		return retstat;
+	}
+	buf->buf[0].size = retstat;
+	*bufp = buf;
+
+	return 0;
+}
+
+
+int Module::write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+                      struct fuse_file_info *fi) {
+	this->trace("write_buf", path);
+
+	int retstat = 0;
+	size_t size = fuse_buf_size(buf);
+
+	open_file_t *file = this->open_files.get(fi->fh);
+	if (!this->storage->is_native() || (file != nullptr && file->write_buffer)) {
+		// There is no fd to splice into or the data is buffered, collect
+		// the data in memory
+		std::vector<char> data(size);
+		struct fuse_bufvec mem;
+		bufvec_init(mem, size);
+		mem.buf[0].mem = data.data();
+		ssize_t res = fuse_buf_copy(&mem, buf, static_cast<fuse_buf_copy_flags>(0));
+		if (res < 0) {
+			return res;
+		}
+		return Module::write(path, data.data(), res, offset, fi);
+	}
+
+	auto f = this->file(fi);
+	if (!f.valid()) {
+		return -EBADF;
+	}
+
+	struct fuse_bufvec dst;
+	bufvec_init(dst, size);
+	dst.buf[0].flags = static_cast<fuse_buf_flags>(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+	dst.buf[0].fd = f.fd();
+	dst.buf[0].pos = offset;
+
+	// fuse_buf_copy falls back to read/write if the fds cannot be spliced
+	ssize_t res = fuse_buf_copy(&dst, buf, static_cast<fuse_buf_copy_flags>(0));
+	if (res < 0) {
 		std::stringstream ss;
 		f.debug(ss);
 		ss << "{size: " << size << " offset: " << offset << "}";
-		this->warn(errno, "write", ss.str(), translated);
-		retstat = -errno;
+		this->warn(-res, "write_buf", ss.str(), *f.file->path);
+		retstat = res;
 	} else {
 		f.file->has_changed = true;
+		this->attrs.invalidate(*f.file->path);
+		retstat = res;
 	}
 
 	return retstat;
@@ -688,7 +1358,8 @@ int Module::statfs(const char *path, struct statvfs *statv) {
 	this->trace("statfs", path);
 
 	int retstat = 0;
-	std::string translated;
+	Arena::scope scope;
+	std::string &translated = scope.string();
 	if ((retstat = this->translatepath(path, translated))) {
 		this->info("statfs", "translatepath failed", path);
 		return retstat;
@@ -696,9 +1367,13 @@ int Module::statfs(const char *path, struct statvfs *statv) {
 
 	// get stats for underlying filesystem
 	memset(statv, 0, sizeof(*statv));
-	retstat = ::statvfs(translated.c_str(), statv);
+	retstat = this->statfs_cache->get(translated, statv);
+	if (retstat == -ENOENT) {
+		// Not on any raid
+		retstat = this->storage->statvfs(translated, statv);
+	}
 	if (retstat < 0) {
-		retstat = -errno;
+		errno = -retstat;
 		this->error(errno, "statfs", "statvfs", translated);
 	}
 
@@ -706,9 +1381,24 @@ int Module::statfs(const char *path, struct statvfs *statv) {
 }
 
 
-int Module::flush(const char *path, struct fuse_file_info *) {
+int Module::raids_statfs(struct statvfs *statv) {
+	memset(statv, 0, sizeof(*statv));
+	if (this->config->module_flag(this->modname, "statfs_aggregate")) {
+		return this->statfs_cache->aggregate(statv);
+	}
+	return this->statfs_cache->get(this->config->get_first_raid(), statv);
+}
+
+
+int Module::flush(const char *path, struct fuse_file_info *fi) {
 	this->trace("flush", path);
-	return 0;
+
+	// What close() returns: the errors of all buffered writes
+	auto f = this->file(fi);
+	if (!f.valid()) {
+		return 0;
+	}
+	return this->flush_writes(f, true);
 }
 
 
@@ -716,17 +1406,21 @@ int Module::release(const char *path, struct fuse_file_info *fi) {
 	this->trace("release", path);
 
 	int retstat = 0;
-	std::string translated;
-	if ((retstat = this->translatepath(path, translated))) {
-		this->info("stat", "translatepath failed", path);
-		return retstat;
-	}
-
-	auto f = this->file(translated, fi);
-	if (f.file->is_open) {
-		retstat = close(f.fd());
-		f.file->is_open = false;
-		f.file->fh.fd = -1;
+	{
+		// The handle must be gone before the slot is freed and reused
+		auto f = this->file(fi);
+		if (f.valid()) {
+			int error = this->flush_writes(f, true);
+			this->disown_buffer(f.file);
+			retstat = this->fd_cache->close(f.file);
+			if (error != 0) {
+				retstat = error;
+			}
+		}
+		if (f.valid() && (f.file->flags & O_ACCMODE) != O_RDONLY) {
+			// Passthrough writes never reach the module
+			this->attrs.invalidate(*f.file->path);
+		}
 	}
 
 	this->close_file(path, fi);
@@ -739,48 +1433,202 @@ int Module::fsync(const char *path, int, struct fuse_file_info *fi) {
 	this->trace("fsync", path);
 
 	int retstat = 0;
-	// This is only useful if we were not closing the file all the time
-#ifndef SAVE_FILE_HANDLES
-	std::string translated;
-	if ((retstat = this->translatepath(path, translated))) {
-		this->info("fsync", "translatepath failed", path);
-		return retstat;
+	// A reopened fd syncs the file just as well
+	auto f = this->file(fi);
+	if (!f.valid()) {
+		return -EBADF;
 	}
-
-	auto f = this->file(translated, fi);
-	retstat = ::fsync(f.fd());
+	int error = this->flush_writes(f, true);
+	retstat = this->storage->fsync(f.fd());
 	if (retstat < 0) {
 		errno = -retstat;
-		this->warn(errno, "fsync", "fsync", translated);
+		this->warn(errno, "fsync", "fsync", *f.file->path);
+	}
+	return error != 0 ? error : retstat;
+}
+
+
+off_t Module::lseek(const char *path, off_t offset, int whence, struct fuse_file_info *fi) {
+	this->trace("lseek", path);
+	if (whence != SEEK_DATA && whence != SEEK_HOLE) {
+		return -EINVAL;
+	}
+
+	auto f = this->file(fi);
+	if (!f.valid()) {
+		return -EBADF;
+	}
+
+	// The buffered writes are data, too
+	this->flush_writes(f);
+	off_t retstat = this->storage->lseek(f.fd(), offset, whence);
+	if (retstat < 0 && retstat != -ENXIO) {
+		std::stringstream ss;
+		f.debug(ss);
+		ss << "{offset: " << offset << " whence: " << whence << "}";
+		this->warn(-retstat, "lseek", ss.str(), *f.file->path);
 	}
-#else
-	(void)fi;
-#endif
 	return retstat;
 }
 
 
-int Module::setxattr(const char *path, const char *, const char *, size_t, int) {
+ssize_t Module::copy_file_range(Module *from,
+                                const char *path_in, struct fuse_file_info *fi_in,
+                                off_t offset_in,
+                                const char *path_out, struct fuse_file_info *fi_out,
+                                off_t offset_out, size_t size, int flags) {
+	this->trace("copy_file_range", path_in, path_out);
+	if (flags != 0) {
+		return -EINVAL;
+	}
+	auto in = from->file(fi_in);
+	auto out = this->file(fi_out);
+	if (!in.valid() || !out.valid()) {
+		return -EBADF;
+	}
+
+	// Both sides have to see what was written through mammutfs
+	from->flush_writes(in);
+	from->flush_writes(*in.file->path);
+	this->flush_writes(out);
+	ssize_t retstat = this->storage->copy_file_range(in.fd(), offset_in,
+	                                                 out.fd(), offset_out, size);
+	if (retstat < 0) {
+		std::stringstream ss;
+		in.debug(ss);
+		out.debug(ss);
+		ss << "{size: " << size << " offset_in: " << offset_in
+		   << " offset_out: " << offset_out << "}";
+		this->warn(-retstat, "copy_file_range", ss.str(), *out.file->path);
+	} else if (retstat > 0) {
+		out.file->has_changed = true;
+		this->attrs.invalidate(*out.file->path);
+	}
+	return retstat;
+}
+
+
+int Module::setxattr(const char *path, const char *name, const char *value, size_t size, int flags) {
 	this->trace("setxattr", path);
-	return -ENOTSUP;
+	if (!this->xattr_allowed(name)) {
+		return -ENOTSUP;
+	}
+
+	int retstat = 0;
+	Arena::scope scope;
+	std::string &translated = scope.string();
+	if ((retstat = this->translatepath(path, translated))) {
+		this->info("setxattr", "translatepath failed", path);
+		return retstat;
+	}
+
+	if ((retstat = this->storage->setxattr(translated, name, value, size, flags)) < 0) {
+		this->info("setxattr", strerror(-retstat), translated);
+	} else {
+		// The ctime changed, too
+		this->attrs.invalidate(translated);
+	}
+	return retstat;
 }
 
 /** Get extended attributes */
-int Module::getxattr(const char *path, const char *, char *, size_t) {
+int Module::getxattr(const char *path, const char *name, char *value, size_t size) {
 	this->trace("getxattr", path);
-	return -ENOTSUP;
+	if (this->xattr_allow.empty()) {
+		return -ENOTSUP;
+	} else if (!this->xattr_allowed(name)) {
+		// As far as the clients know the hidden ones do not exist
+		return -ENODATA;
+	}
+
+	int retstat = 0;
+	Arena::scope scope;
+	std::string &translated = scope.string();
+	if ((retstat = this->translatepath(path, translated))) {
+		this->info("getxattr", "translatepath failed", path);
+		return retstat;
+	}
+
+	if (this->attrs.get_xattr(translated, name, value, size, retstat)) {
+		return retstat;
+	}
+	if (this->attrs.caches_xattrs()) {
+		uint64_t ticket = this->attrs.ticket();
+		AttrCache::xattr_list values;
+		if (this->fetch_xattrs(translated, values) == 0) {
+			this->attrs.put_xattrs(translated, std::move(values), ticket);
+			if (this->attrs.get_xattr(translated, name, value, size, retstat)) {
+				return retstat;
+			}
+		}
+	}
+	return this->storage->getxattr(translated, name, value, size);
 }
 
 /** List extended attributes */
-int Module::listxattr(const char *path, char *, size_t) {
+int Module::listxattr(const char *path, char *list, size_t size) {
 	this->trace("listxattr", path);
-	return -ENOTSUP;
+	if (this->xattr_allow.empty()) {
+		return -ENOTSUP;
+	}
+
+	int retstat = 0;
+	Arena::scope scope;
+	std::string &translated = scope.string();
+	if ((retstat = this->translatepath(path, translated))) {
+		this->info("listxattr", "translatepath failed", path);
+		return retstat;
+	}
+
+	if (this->attrs.list_xattr(translated, list, size, retstat)) {
+		return retstat;
+	}
+	if (this->attrs.caches_xattrs()) {
+		uint64_t ticket = this->attrs.ticket();
+		AttrCache::xattr_list values;
+		if (this->fetch_xattrs(translated, values) == 0) {
+			this->attrs.put_xattrs(translated, std::move(values), ticket);
+			if (this->attrs.list_xattr(translated, list, size, retstat)) {
+				return retstat;
+			}
+		}
+	}
+
+	// Only the allowed names are listed
+	std::vector<char> names;
+	if ((retstat = this->list_allowed_xattrs(translated, names)) < 0) {
+		return retstat;
+	}
+	if (size == 0) {
+		return names.size();
+	} else if (size < names.size()) {
+		return -ERANGE;
+	}
+	memcpy(list, names.data(), names.size());
+	return names.size();
 }
 
 /** Remove extended attributes */
-int Module::removexattr(const char *path, const char *) {
+int Module::removexattr(const char *path, const char *name) {
 	this->trace("removexattr", path);
-	return -ENOTSUP;
+	if (!this->xattr_allowed(name)) {
+		return -ENOTSUP;
+	}
+
+	int retstat = 0;
+	Arena::scope scope;
+	std::string &translated = scope.string();
+	if ((retstat = this->translatepath(path, translated))) {
+		this->info("removexattr", "translatepath failed", path);
+		return retstat;
+	}
+
+	if ((retstat = this->storage->removexattr(translated, name)) < 0) {
+		this->info("removexattr", strerror(-retstat), translated);
+	} else {
+		this->attrs.invalidate(translated);
+	}
+	return retstat;
 }
 
 
@@ -788,23 +1636,28 @@ int Module::opendir(const char *path, struct fuse_file_info *fi) {
 	this->trace("opendir", path);
 
 	int retstat = 0;
-	std::string translated;
+	Arena::scope scope;
+	std::string &translated = scope.string();
 	if ((retstat = this->translatepath(path, translated))) {
 		this->info("opendir", "translatepath failed", path);
 		return retstat;
 	}
 
-	DIR *dp = ::opendir(translated.c_str());
-	if (dp == NULL) {
-		retstat = -errno;
-		this->warn(errno, "opendir", "opendir", translated);
+	void *dir = NULL;
+	if ((retstat = this->storage->opendir(translated, dir)) < 0) {
+		this->warn(-retstat, "opendir", "opendir", translated);
 		return retstat;
 	} else {
 		auto f = this->file(translated, fi);
+		if (!f.valid()) {
+			this->storage->closedir(dir);
+			return -ENFILE;
+		}
 		f.file->type = open_file_t::DIRECTORY;
-		f.file->fh.dp = dp;
-		f.file->is_open = true;
 		f.file->has_changed = false;
+		this->fd_cache->add(f.file, dir);
+		fi->cache_readdir = this->cache.cache_readdir;
+		fi->keep_cache = this->cache.cache_readdir;
 	}
 
 	return 0;
@@ -812,36 +1665,43 @@ int Module::opendir(const char *path, struct fuse_file_info *fi) {
 
 
 int Module::readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-                    off_t offset, struct fuse_file_info *fi) {
+                    off_t offset, struct fuse_file_info *fi,
+                    enum fuse_readdir_flags flags) {
 	this->trace("readdir", path);
-	(void)offset;
 
-	int retstat = 0;
-	std::string translated;
-	if ((retstat = this->translatepath(path, translated))) {
-		this->info("readdir", "translatepath failed", path);
-		return retstat;
+	auto f = this->file(fi);
+	if (!f.valid()) {
+		return -EBADF;
 	}
-	auto f = this->file(translated, fi);
-	DIR *dp = f.dp();
+	const std::string &translated = *f.file->path;
+	void *dir = f.dir();
 
-	if (dp == 0) {
+	if (dir == NULL) {
 		return -EINVAL;
 	}
 
-	rewinddir(dp);
-
-	struct dirent *de;
-	while ((de = ::readdir(dp)) != NULL) {
-		std::string path = translated + "/" + std::string(de->d_name);
-		if (!this->is_path_valid(path))
-			continue;
-		if (filler(buf, de->d_name, NULL, 0) != 0) {
-			return -ENOMEM;
-		}
-	}
-
-	return 0;
+	// Every entry carries the offset the storage continues at, so fuse
+	// hands out the listing in chunks of its buffer size (mode 2) and the
+	// next call resumes where the storage handle stopped.
+	Arena::scope scope;
+	std::string &entry = scope.string();
+	uint64_t ticket = this->attrs.ticket();
+	bool plus = this->readdirplus && (flags & FUSE_READDIR_PLUS);
+	return this->storage->readdir(dir, offset, [&](const char *name,
+	                                               const struct stat *st,
+	                                               off_t next) {
+			entry.assign(translated).append("/").append(name);
+			if (!this->is_path_valid(entry))
+				return true;
+			bool dots = name[0] == '.'
+				&& (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+			if (st != nullptr && !dots) {
+				this->attrs.put(entry, *st, ticket);
+			}
+			fuse_fill_dir_flags fill = st != nullptr ? FUSE_FILL_DIR_PLUS : FILL_DIR_PLAIN;
+			// The buffer is full, the entry is listed by the next call
+			return filler(buf, name, st, next, fill) == 0;
+		}, plus ? this->attr_mask : 0, this->attr_sync);
 }
 
 
@@ -849,15 +1709,11 @@ int Module::releasedir(const char *path, struct fuse_file_info *fi) {
 	this->trace("releasedir", path);
 
 	int retstat = 0;
-	std::string translated;
-	if ((retstat = this->translatepath(path, translated))) {
-		this->info("releasedir", "translatepath failed", path);
-		return retstat;
-	}
-	auto f = this->file(translated, fi);
-	if (f.file->is_open && f.file->type == open_file_t::DIRECTORY) {
-		retstat = ::closedir(f.dp());
-		f.file->is_open = false;
+	{
+		auto f = this->file(fi);
+		if (f.valid() && f.file->type == open_file_t::DIRECTORY) {
+			retstat = this->fd_cache->close(f.file);
+		}
 	}
 
 	this->close_file(path, fi);
@@ -876,12 +1732,13 @@ int Module::fsyncdir(const char *path, int, struct fuse_file_info *) {
 int Module::access(const char *path, int mask) {
 	this->trace("access", path);
 	int retstat = 0;
-	std::string translated;
+	Arena::scope scope;
+	std::string &translated = scope.string();
 	if ((retstat = this->translatepath(path, translated))) {
 		this->info("access", "translatepath failed", path);
 		return retstat;
 	}
-	retstat = ::access(translated.c_str(), mask);
+	retstat = this->storage->access(translated, mask);
 	return retstat;
 }
 
@@ -890,25 +1747,33 @@ int Module::create(const char *path, mode_t mode, struct fuse_file_info *fi) {
 	this->trace("create", path);
 
 	int retstat = 0;
-	std::string translated;
+	Arena::scope scope;
+	std::string &translated = scope.string();
 	if ((retstat = this->translatepath(path, translated))) {
 		this->info("create", "translatepath failed", path);
 		return retstat;
 	}
 
-	int fd = ::creat(translated.c_str(), mode);
+	int fd = this->storage->open(translated, O_CREAT | O_WRONLY | O_TRUNC, mode);
 	if (fd < 0) {
-		retstat = -errno;
-		this->warn(errno, "create", strerror(errno), translated);
+		retstat = fd;
+		this->warn(-retstat, "create", strerror(-retstat), translated);
 	} else {
 		// We do not like open files!
 		//::close(fd);
 		auto f = this->file(translated, fi);
+		if (!f.valid()) {
+			this->storage->close(fd);
+			return -ENFILE;
+		}
 		f.file->type = open_file_t::FILE;
-		f.file->flags = O_APPEND | O_RDWR;
-		f.file->fh.fd = fd;
-		f.file->is_open = true;
+		// What it was opened with, for the reopen
+		f.file->flags = O_WRONLY;
 		f.file->has_changed = true;
+		this->buffer_writes(f.file);
+		this->fd_cache->add(f.file, fd);
+		fi->keep_cache = this->cache.kernel_cache;
+		this->attrs.invalidate_entry(translated);
 	}
 
 	return retstat;
@@ -918,16 +1783,18 @@ int Module::create(const char *path, mode_t mode, struct fuse_file_info *fi) {
 int Module::utimens(const char *path, const struct timespec tv[2]) {
 	this->trace("utimens", path);
 	int retstat = 0;
-	std::string translated;
+	Arena::scope scope;
+	std::string &translated = scope.string();
 	if ((retstat = this->translatepath(path, translated))) {
 		this->info("utimens", "translatepath failed", path);
 		return retstat;
 	}
 
-	retstat = ::utimensat(0, translated.c_str(), tv, 0);
+	retstat = this->storage->utimens(translated, tv);
 	if (retstat < 0) {
-		retstat = -errno;
-		this->warn(errno, "utimens", "utimesat", translated);
+		this->warn(-retstat, "utimens", "utimesat", translated);
+	} else {
+		this->attrs.invalidate(translated);
 	}
 
 	return retstat;
@@ -1,12 +1,21 @@
 #pragma once
 
+#include "attr_cache.h"
+#include "fd_cache.h"
+#include "handle_table.h"
 #include "mammut_config.h"
+#include "raid_locator.h"
+#include "statfs_cache.h"
+#include "storage.h"
+#include "write_buffer.h"
 #include "config.h"
 
 #include <atomic>
 #include <map>
 #include <mutex>
+#include <string_view>
 #include <unordered_map>
+#include <vector>
 
 #include <fuse.h>
 
@@ -16,6 +25,10 @@ namespace mammutfs {
 
 class Communicator;
 class MammutConfig;
+
+/** Filler flags for a directory entry without any attributes */
+static const fuse_fill_dir_flags FILL_DIR_PLAIN = static_cast<fuse_fill_dir_flags>(0);
+
 /**
  * This the base fuse module, implementing a text replacement fuse translator
  *
@@ -41,13 +54,13 @@ public:
 	void log(LOG_LEVEL lvl, int errnum, const std::string &msg, const std::string &path = "" );
 
 #ifdef ENABLE_TRACELOG
-	void trace(const std::string &method,
-	           const std::string &path,
-	           const std::string &second_path = "");
+	void trace(std::string_view method,
+	           std::string_view path,
+	           std::string_view second_path = {});
 #else
-	inline void trace(const std::string &,
-	                  const std::string &,
-	                  const std::string & = "") {};
+	inline void trace(std::string_view,
+	                  std::string_view,
+	                  std::string_view = {}) {};
 #endif
 
 	void info(const std::string &method,
@@ -76,14 +89,14 @@ public:
 	 * The raid path is determined with @find_raid, and the username comes
 	 * from the config file
 	 */
-	virtual int translatepath(const std::string &path, std::string &out);
+	virtual int translatepath(std::string_view path, std::string &out);
 
 	/** Check if a path is valid and should be displayed / accessible
 	 *
 	 * This can be used to hide certain files for the user but keep them for
 	 * Management purposes (for example .mammut_suffix in anon folders)
 	 */
-	virtual bool is_path_valid(const std::string &/*path*/) {
+	virtual bool is_path_valid(std::string_view /*path*/) {
 		return true;
 	};
 
@@ -98,6 +111,140 @@ public:
 	 */
 	virtual bool visible_in_root() { return true; }
 
+	/**
+	 * Start looking for the home of the module in the background, modules
+	 * without a home on the raids do nothing
+	 */
+	virtual void prefetch_raid() {
+		this->locator->prefetch(this->modname);
+	}
+
+	/**
+	 * Option, if the module is a pure path translator: getattr, open, read,
+	 * write and release do nothing but the plain syscalls on the translated
+	 * path, so the engine may perform them on its own (passthrough, io_uring)
+	 * without calling the module.
+	 */
+	virtual bool plain_io() { return false; }
+
+	/**
+	 * Where the translated paths of this module live.
+	 */
+	const std::shared_ptr<Storage> &get_storage() const {
+		return this->storage;
+	}
+
+	/**
+	 * Option, if the kernel may read and write open files of this module
+	 * directly (fuse passthrough), bypassing mammutfs.
+	 */
+	virtual bool passthrough() {
+		return this->plain_io() && config->passthrough(modname);
+	}
+
+	/**
+	 * Follow the reads of an open file: once they are sequential, the file
+	 * is read ahead of them in a window that doubles with every read, up to
+	 * "<module>_readahead_max" bytes. A random read starts over.
+	 * read() does this itself, fd is the fd the read was issued on.
+	 */
+	void read_ahead(struct fuse_file_info *fi, int fd, off_t offset, size_t size);
+
+	/**
+	 * The native fd of an open file, or -1 if it currently has none.
+	 * The fd is not closed until put_backing_fd.
+	 */
+	int backing_fd(struct fuse_file_info *fi);
+	void put_backing_fd(struct fuse_file_info *fi);
+
+	/**
+	 * Store fd - opened on the translated path - as the open file of fi.
+	 * This is what open() does after opening the file, it also drops the cached
+	 * attributes of a file that was opened with O_TRUNC. If there is no room
+	 * for another open file, fd is closed and -ENFILE returned.
+	 */
+	int register_file(const std::string &translated, int fd,
+	                  struct fuse_file_info *fi);
+
+	/**
+	 * Forget an open file without closing it.
+	 * Returns its native fd (that now belongs to the caller) or -1. error is
+	 * set to the error of a buffered write nobody was told about, or 0.
+	 */
+	int detach_file(struct fuse_file_info *fi, int &error);
+
+	/**
+	 * How long the kernel may keep what this module returned.
+	 *
+	 * Configured per module as "<module>_attr_timeout" etc, see mammutfs.cfg.
+	 * Everything mammutfs changes on its own has to be invalidated through
+	 * the KernelCache.
+	 */
+	struct cache_policy_t {
+		/** seconds to cache attributes */
+		double attr_timeout;
+		/** seconds to cache names */
+		double entry_timeout;
+		/** seconds to cache that a name does not exist */
+		double negative_timeout;
+		/** keep the page cache of a file across opens */
+		bool kernel_cache;
+		/** cache directory listings in the kernel */
+		bool cache_readdir;
+	};
+
+	const cache_policy_t &cache_policy() const {
+		return this->cache;
+	}
+
+	/**
+	 * The fields getattr fetches (STATX_*, "<module>_statx_mask") - on
+	 * cephfs every field that is not needed saves revoking the capabilities
+	 * of other clients. Type and mode are always fetched.
+	 */
+	unsigned int statx_mask() const {
+		return this->attr_mask;
+	}
+
+	/**
+	 * The sync mode of getattr (AT_STATX_*, "<module>_statx_sync"):
+	 * read-mostly modules may take what the client has cached.
+	 */
+	int statx_sync() const {
+		return this->attr_sync;
+	}
+
+	/**
+	 * The attributes of this module's translated paths, kept in mammutfs
+	 * itself ("<module>_attr_cache_ttl"). Whatever changes a path without
+	 * going through the module has to invalidate it here.
+	 */
+	AttrCache &attr_cache() {
+		return this->attrs;
+	}
+
+	/**
+	 * Answer a getattr of a translated path from the attr cache: true if
+	 * retstat and statbuf are filled (0 or -ENOENT), false if the path has
+	 * to be stat-ed.
+	 */
+	bool cached_attr(const std::string &translated, struct stat *statbuf, int &retstat);
+
+	/**
+	 * Write out the buffered writes of all open files of translated - before
+	 * anything that stats, opens or reads it bypassing the module. The
+	 * buffers are found in the index of the write budget and written
+	 * through the cached fd of their file, only a file whose fd is gone is
+	 * opened for them.
+	 */
+	void flush_writes(const std::string &translated);
+
+	/**
+	 * The open file of fi was written to without the module (io_uring),
+	 * see write().
+	 */
+	void file_written(struct fuse_file_info *fi);
+
 	/** Get file attributes.
 	 *
 	 * Similar to stat().  The 'st_dev' and 'st_blksize' fields are
@@ -116,9 +263,6 @@ public:
 	 */
 	virtual int readlink(const char *, char *, size_t);
 
-	/* Deprecated, use readdir() instead */
-	int getdir(const char *, fuse_dirh_t, fuse_dirfil_t);
-
 	/** Create a file node
 	 *
 	 * This is called for creation of all non-directory, non-symlink
@@ -203,6 +347,28 @@ public:
 	virtual int write(const char *, const char *, size_t, off_t,
 	          struct fuse_file_info *);
 
+	/** Read data from an open file into a buffer vector
+	 *
+	 * Mammutfs: Returns the backing file descriptor of the handle, so fuse
+	 * can splice the data from the raid to /dev/fuse without copying it
+	 * through userspace. Handles that are not kept open natively - and all
+	 * handles while the fd cache is under pressure, fuse splices after the
+	 * handle is let go - fall back to read() into a memory buffer. The lowlevel engine
+	 * splices from backing_fd() instead, which it holds until the reply.
+	 *
+	 * The bufvec has to be allocated with malloc and is freed by the caller.
+	 */
+	virtual int read_buf(const char *, struct fuse_bufvec **, size_t, off_t,
+	                     struct fuse_file_info *);
+
+	/** Write the contents of a buffer vector to an open file
+	 *
+	 * Mammutfs: The data is spliced from /dev/fuse to the backing file
+	 * descriptor, libfuse copies it instead where splicing is impossible.
+	 */
+	virtual int write_buf(const char *, struct fuse_bufvec *, off_t,
+	                      struct fuse_file_info *);
+
 	/** Get file system statistics
 	 *
 	 * The 'f_frsize', 'f_favail', 'f_fsid' and 'f_flag' fields are ignored
@@ -262,6 +428,28 @@ public:
 	 */
 	virtual int fsync(const char *, int, struct fuse_file_info *);
 
+	/** Find the next data or hole in an open file
+	 *
+	 * Mammutfs: only SEEK_DATA and SEEK_HOLE arrive here, the kernel
+	 * handles all others on its own. Sparse files are copied (cp, rsync
+	 * --sparse) without reading their holes.
+	 */
+	virtual off_t lseek(const char *, off_t, int, struct fuse_file_info *);
+
+	/** Copy a range of data from one file to another
+	 *
+	 * Mammutfs: called on the module of the destination, from is the module
+	 * of the source - which may be another one, all modules share the
+	 * storage. The data is copied on the raid and never passes through
+	 * mammutfs; if the raid refuses (EXDEV, EOPNOTSUPP) the kernel falls
+	 * back to reading and writing.
+	 */
+	virtual ssize_t copy_file_range(Module *from,
+	                                const char *path_in, struct fuse_file_info *fi_in,
+	                                off_t offset_in,
+	                                const char *path_out, struct fuse_file_info *fi_out,
+	                                off_t offset_out, size_t size, int flags);
+
 	/** Set extended attributes */
 	virtual int setxattr(const char *, const char *, const char *, size_t, int);
 
@@ -288,7 +476,11 @@ public:
 
 	/** Read directory
 	 *
-	 * Mammutfs: Lists all files from the translated target directory
+	 * Mammutfs: Lists the files from the translated target directory,
+	 * starting at offset (mode 2 below). If the kernel asked for readdirplus
+	 * (FUSE_READDIR_PLUS) the entries come with their attributes
+	 * (FUSE_FILL_DIR_PLUS), which are fed into the attr cache as well - a
+	 * plain listing stats nothing.
 	 *
 	 * This supersedes the old getdir() interface.  New applications
 	 * should use this.
@@ -310,7 +502,7 @@ public:
 	 * Introduced in version 2.3
 	 */
 	virtual int readdir(const char *, void *, fuse_fill_dir_t, off_t,
-	                    struct fuse_file_info *);
+	                    struct fuse_file_info *, enum fuse_readdir_flags);
 
 	/** Release directory
 	 *
@@ -373,22 +565,99 @@ protected:
 
 	std::shared_ptr<Communicator> comm;
 
+	/** Performs the file operations on the translated paths */
+	std::shared_ptr<Storage> storage;
+
 	/** Name of the module to be set by child classes */
 	std::string modname;
 
 	/** The basepath that should be used to translate the path */
-	std::string basepath;
+	struct basepath_t {
+		std::string path;
+		/** The generation of the locator path is from */
+		uint64_t generation;
+	};
+	// Only accessed via std::atomic_load/std::atomic_store, every request
+	// reads it while find_raid may replace it. nullptr until the first lookup.
+	std::shared_ptr<const basepath_t> basepath;
+
+	/** Serializes the lookups of basepath in find_raid */
+	std::mutex basepath_mux;
+
+	/** Finds basepath */
+	std::shared_ptr<RaidLocator> locator;
+
+	/** What the kernel may cache of this module */
+	cache_policy_t cache;
+
+	/** What mammutfs caches of this module */
+	AttrCache attrs;
+
+	/**
+	 * If readdir hands out the attributes of the entries, so listings are
+	 * not followed by a getattr per entry ("<module>_readdirplus")
+	 */
+	bool readdirplus;
+
+	/** (Re)read the attr cache settings from the config */
+	void configure_attr_cache();
+
+	/** See statx_mask() and statx_sync() */
+	unsigned int attr_mask;
+	int attr_sync;
+
+	/** Read statx_mask and statx_sync from the config */
+	void configure_statx();
+
+	/**
+	 * Prefixes of the extended attributes that are passed through to the
+	 * raids ("<module>_xattr_allow"), all others are hidden and refused
+	 */
+	std::vector<std::string> xattr_allow;
+
+	/** Read xattr_allow from the config */
+	void configure_xattr();
+
+	/** How far sequential reads are read ahead at most, 0 never */
+	size_t readahead_max;
+
+	bool xattr_allowed(const char *name) const;
+
+	/** The allowed names of the xattrs of translated, as listxattr returns them */
+	int list_allowed_xattrs(const std::string &translated, std::vector<char> &names);
+
+	/** All allowed xattrs of translated with their values, for the cache */
+	int fetch_xattrs(const std::string &translated, AttrCache::xattr_list &values);
+
+	/** statx of a translated path with the sync mode of the module */
+	int statx(const std::string &translated, int flags, unsigned int mask,
+	          struct stat *statbuf) {
+		return this->storage->statx(translated, flags | this->attr_sync, mask, statbuf);
+	}
+
+	/** The attributes of the directory that contains translated, cached */
+	int parent_attr(const std::string &translated, struct stat *statbuf);
+
+	/** The statvfs of the raids, refreshed in the background */
+	std::shared_ptr<StatfsCache> statfs_cache;
+
+	/**
+	 * The statvfs of a module that is on no raid of its own: the first raid,
+	 * or all raids together with "<module>_statfs_aggregate"
+	 */
+	int raids_statfs(struct statvfs *statv);
 
 	/** The currently set log level */
-	LOG_LEVEL max_loglvl = LOG_LEVEL::TRACE;
+	std::atomic<LOG_LEVEL> max_loglvl { LOG_LEVEL::TRACE };
 
 	/**************************************************************************
 	 * Since multiple accesses to many different files can overload the open
 	 * file descriptors. it is necessary to encapsulate these file descriptors.
-	 * An open file is stored in a local map
-	 * This file-handle is handling a native file descriptor until the limit
-	 * max_native_fds is reached. above this limit, a file is opened for every
-	 * use and reopened again upon access.
+	 * An open file is stored in a slot of the handle table, fi->fh is its
+	 * handle. read and write find it without taking any lock.
+	 * The native file descriptors of all open files are kept by the fd cache:
+	 * once its budget (max_native_fds) is used up, the files that were not
+	 * used for the longest time are closed and reopened upon access.
 	 * This enables to have more open files than the kernel supports without
 	 * raising the native limits.
 	 */
@@ -396,46 +665,63 @@ protected:
 	/**
 	 * Represents an open file.
 	 */
-	struct open_file_t {
-		std::string path;
-		bool is_open;
-		bool has_changed;
-		enum { FILE, DIRECTORY, UNSPEC } type;
-		int flags;
-		union {
-			int32_t fd;
-			DIR *dp;
-		} fh;
+	struct open_file_t : FdCache::entry_t {
+		/** Pooled in open_paths */
+		const std::string *path = nullptr;
+		bool has_changed = false;
+		int flags = 0;
+		/** Where the next read starts if the reads are sequential */
+		std::atomic<off_t> next_read { -1 };
+		/** Read ahead up to here */
+		std::atomic<off_t> read_ahead_until { 0 };
+		/** Grows with every sequential read, 0 after a random one */
+		std::atomic<size_t> read_ahead_window { 0 };
+		/**
+		 * Collects small writes, if the module buffers writes. Loaded with
+		 * std::atomic_load, dump_open_files reads it from other threads.
+		 */
+		std::shared_ptr<WriteBuffer> write_buffer;
 	};
 private:
-	// The list of open files - and our internal file descriptors.
-	// It is not supported generally to use 64 bit fds.
-	std::unordered_map<int64_t, open_file_t> open_files;
+	// The open files, at most "<module>_max_open_files" at once - the
+	// memory they take is bounded
+	HandleTable<open_file_t> open_files;
 
-	// Has to be locked whenever open_files is accessed
-	std::mutex open_file_mux;
+	// The paths of the open files, every path is stored once
+	PathPool open_paths;
 
-	// File ids are handed out incrementingly, and this is the counter
-	int64_t open_file_count = 1;
-
-	// The maximum number of files that are to be represented natively.
-	// If the size of open_files reaches the limit, newly allocated files
-	// are stored temporarily
-	size_t max_native_fds;
+	// Keeps the native fds of the open files within max_native_fds
+	std::shared_ptr<FdCache> fd_cache;
 
 protected:
 	class open_file_handle_t {
 		friend class Module;
 		open_file_t *file;
-		const bool should_close;
-		open_file_handle_t(open_file_t *, bool should_close);
+		Storage *storage;
+		FdCache *cache;
+		/** file is pinned in the fd cache while the handle exists */
+		open_file_handle_t(open_file_t *, Storage *, FdCache *);
 	public:
 		open_file_handle_t(open_file_handle_t &&rhs);
+		/** If the handle refers to an open file at all */
+		bool valid() const {
+			return this->file != nullptr;
+		}
 		bool changed() {
-			return this->file->has_changed;
+			return this->file != nullptr && this->file->has_changed;
 		}
+		/** The storage handle of the file */
 		int fd();
-		DIR *dp();
+		/** The storage handle of the directory */
+		void *dir();
+
+		/**
+		 * If fd() is a native fd that stays valid after this handle is gone -
+		 * long enough to splice from it, an evicted fd is closed later.
+		 */
+		bool is_native() const {
+			return this->storage->is_native();
+		}
 
 		void debug(std::ostream &os);
 		~open_file_handle_t();
@@ -450,11 +736,53 @@ protected:
 	 */
 	open_file_handle_t file(const std::string &, fuse_file_info *fi);
 
+	/**
+	 * The open file of fi - for everything bound to an open handle (read,
+	 * write, release, ...), which therefore needs no path translation.
+	 * The path is only needed to reopen a file the fd cache closed and that
+	 * is stored in the open file. Check valid() before use.
+	 */
+	open_file_handle_t file(fuse_file_info *fi);
+
 	// TODO: This has to be called in rename
 	void close_file(const char *path, fuse_file_info *fi);
 	void close_file(const std::string &path, fuse_file_info *fi);
 
+	/** The open files and the memory they take, as json */
 	void dump_open_files(std::ostream &);
+
+	/** read_buf by copying through read() - for data without a backing fd */
+	int read_buf_copy(const char *, struct fuse_bufvec **, size_t, off_t,
+	                  struct fuse_file_info *);
+
+	/**
+	 * Small writes of an open file are buffered up to this many bytes
+	 * ("<module>_write_buffer"), 0 writes everything right away.
+	 */
+	size_t write_buffer_size;
+	/** What all buffers may take together ("write_buffer_memory") */
+	std::shared_ptr<WriteBudget> write_budget;
+
+	/** Give a file opened for writing a buffer, if the budget has room */
+	void buffer_writes(open_file_t *file);
+
+	/** write() through the buffer of f */
+	int write_buffered(open_file_handle_t &f, const char *buf, size_t size, off_t offset);
+
+	/**
+	 * Write out what is buffered for f, the error of that. With report the
+	 * error of any buffered write before is returned as well - once.
+	 */
+	int flush_writes(open_file_handle_t &f, bool report = false);
+
+	/**
+	 * Other handles stop writing the buffer of file through its fd, it is
+	 * about to be closed.
+	 */
+	void disown_buffer(open_file_t *file);
+
+	/** Give back the slot, path and buffer of a file whose fd is gone */
+	void free_file(struct fuse_file_info *fi, open_file_t *file);
 };
 
 } // mammutfs
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "../module.h"
+#include "lister.h"
 
 #include "../mammut_config.h"
 #include "../communicator.h"
@@ -24,12 +25,12 @@ class Anonymous : public Module {
 public:
 	Anonymous (const std::shared_ptr<MammutConfig> &config,
 	           const std::shared_ptr<Communicator> &comm,
-	           const std::map<std::string, std::string> *anon_map) :
+	           const PublicAnonLister *lister) :
 		Module("anonym", config, comm),
-		anon_map(anon_map) {
+		lister(lister) {
 	}
 
-	virtual bool is_path_valid(const std::string &path) override {
+	virtual bool is_path_valid(std::string_view path) override {
 		// Do not show any "./mammut-suffix" files.
 		// They are used to store the _ABC suffix in the anonmap
 		size_t delimiter = path.find_last_of('/');
@@ -71,8 +72,9 @@ public:
 					return retstat;
 				}
 				translated += ANON_SUFFIX_FILENAME;
-				retstat = ::unlink(translated.c_str());
+				retstat = this->storage->unlink(translated);
 				if(retstat != 0) {
+					errno = -retstat;
 					this->error(errno, "rmdir", "suffixfile", translated);
 				}
 			}
@@ -108,6 +110,34 @@ public:
 		return ret;
 	}
 
+	virtual int write_buf(const char *path,
+	                      struct fuse_bufvec *buf,
+	                      off_t off,
+	                      struct fuse_file_info *fi) override {
+		int ret = Module::write_buf(path, buf, off, fi);
+#ifdef ENABLE_WRITE_NOTIFY
+		if (ret > 0) {
+			inotify("WRITE", path);
+		}
+#endif
+		return ret;
+	}
+
+	virtual ssize_t copy_file_range(Module *from,
+	                                const char *path_in, struct fuse_file_info *fi_in,
+	                                off_t off_in,
+	                                const char *path_out, struct fuse_file_info *fi_out,
+	                                off_t off_out, size_t size, int flags) override {
+		ssize_t ret = Module::copy_file_range(from, path_in, fi_in, off_in,
+		                                      path_out, fi_out, off_out, size, flags);
+#ifdef ENABLE_WRITE_NOTIFY
+		if (ret > 0) {
+			inotify("WRITE", path_out);
+		}
+#endif
+		return ret;
+	}
+
 	virtual int truncate(const char *path, off_t off) override {
 		int ret = Module::truncate(path, off);
 		if (ret == 0)
@@ -160,7 +190,8 @@ protected:
 	}
 
 private:
-	const std::map<std::string, std::string> *anon_map;
+	/** Source of the current anon mapping, see PublicAnonLister::get_mapping */
+	const PublicAnonLister *lister;
 };
 
 }
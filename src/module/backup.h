@@ -11,6 +11,10 @@ public:
 	Backup (const std::shared_ptr<MammutConfig> &config,
 	        const std::shared_ptr<Communicator> &comm) :
 		Module("backup", config, comm) {}
+
+	bool plain_io() override {
+		return this->storage->is_native();
+	}
 };
 
 }
@@ -11,13 +11,13 @@ public:
 	        const std::shared_ptr<Communicator> &comm) :
 		Module("default", config, comm) {}
 
-	int translatepath(const std::string &path, std::string &/*out*/) override {
+	int translatepath(std::string_view path, std::string &/*out*/) override {
 		// It should not happen that translatepath is called - all module::*
 		// functions will do this, so check the log, which one it was and
 		// implement it here - doing some sensible stuff!
 		this->error(0, "default::translatepath",
 		            "An operation called translatepath for the default path!",
-		            path);
+		            std::string(path));
 		return -ENOTSUP;
 	}
 
@@ -58,19 +58,24 @@ public:
 	            void *buf,
 	            fuse_fill_dir_t filler,
 	            off_t /*offset*/,
-	            struct fuse_file_info */*fi*/) override {
+	            struct fuse_file_info */*fi*/,
+	            enum fuse_readdir_flags /*flags*/) override {
 		this->trace("default::readdir", path);
 
-		filler(buf, ".", NULL, 0);
-		filler(buf, "..", NULL, 0);
+		filler(buf, ".", NULL, 0, FILL_DIR_PLAIN);
+		filler(buf, "..", NULL, 0, FILL_DIR_PLAIN);
 		for (const auto &i : config->resolver->activatedModules()) {
 			if (i.second->visible_in_root()) {
-				filler(buf, i.first.c_str(), NULL, 0);
+				filler(buf, i.first.c_str(), NULL, 0, FILL_DIR_PLAIN);
 			}
 		}
 		return 0;
 	}
 
+	void prefetch_raid() override {
+		// Not on the raids
+	}
+
 	int statfs(const char *path, struct statvfs *statv) {
 		this->trace("default::statfs", path);
 		/*  struct statfs {
@@ -88,9 +93,8 @@ public:
 		    __fsword_t f_spare[xxx]; // Padding bytes reserved for future use
 		    };
 		*/
-		const std::string &first_raid = this->config->get_first_raid();
-		int rc = ::statvfs(first_raid.c_str(), statv);
-		if(rc < 0 && errno == ENOENT) {
+		int rc = this->raids_statfs(statv);
+		if(rc == -ENOENT) {
 			return rc;
 		}
 		return 0;
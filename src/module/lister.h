@@ -2,6 +2,8 @@
 
 #include "../module.h"
 #include "../mammut_config.h"
+#include "../communicator.h"
+#include "../kernel_cache.h"
 
 #include <mutex>
 #include <fstream>
@@ -16,7 +18,8 @@ public:
 		comm->register_command(
 			"CLEARCACHE",
 			[this](const std::string &, std::string &/*resp*/) {
-				list.clear();
+				std::unique_lock<std::mutex> lock(this->mutex);
+				std::atomic_store(&this->list, std::make_shared<const mapping_t>());
 				return true;
 			}, "Clear the anonmap");
 		comm->register_command(
@@ -41,14 +44,20 @@ public:
 		// rescan();
 	}
 
+	/** Compares transparently, so it can be searched with a string_view */
+	using mapping_t = std::map<std::string, std::string, std::less<>>;
+
 	/**
 	 * Get mapping from anon name to real path name
+	 *
+	 * The mapping is replaced as a whole on every rescan, so the returned
+	 * snapshot stays valid and unchanged for as long as it is held.
 	 */
-	const std::map<std::string, std::string> *get_mapping() const {
-		return &this->list;
+	std::shared_ptr<const mapping_t> get_mapping() const {
+		return std::atomic_load(&this->list);
 	}
 
-	bool is_path_valid(const std::string &path) {
+	bool is_path_valid(std::string_view path) {
 		// Do not show any "./mammut-suffix" files.
 		// They are used to store the _ABC suffix in the anonmap
 		size_t delimiter = path.find_last_of('/');
@@ -59,7 +68,7 @@ public:
 		return true;
 	}
 
-	int translatepath(const std::string &path, std::string &out) override {
+	int translatepath(std::string_view path, std::string &out) override {
 		if (path == "/") {
 			out = "";
 			return 0;
@@ -70,19 +79,20 @@ public:
 		}
 
 		size_t pos = path.find('/', 1);
-		std::string entry = path.substr(1, pos - 1);
+		std::string_view entry = path.substr(1, pos - 1);
 
 		// TODO: is this possible - we will aggressively scan the anonmap here
 		// if it was not yet opened.
-		if (this->list.empty()) {
+		auto list = this->get_mapping();
+		if (list->empty()) {
 			this->rescan();
+			list = this->get_mapping();
 		}
-		auto it = list.find(entry);
-		if (it != list.end()) {
-			if (pos == std::string::npos) {
-				out = it->second;
-			} else {
-				out = it->second + "/" + path.substr(pos + 1);
+		auto it = list->find(entry);
+		if (it != list->end()) {
+			out.assign(it->second);
+			if (pos != std::string::npos) {
+				out.append(path, pos, std::string::npos);
 			}
 		} else {
 			return -ENOENT;
@@ -158,18 +168,21 @@ public:
 	                   void *buf,
 	                   fuse_fill_dir_t filler,
 	                   off_t offset,
-	                   struct fuse_file_info *fi) override {
+	                   struct fuse_file_info *fi,
+	                   enum fuse_readdir_flags flags) override {
 		if (strcmp(path, "/") == 0) {
-			if (this->list.empty()) {
+			auto list = this->get_mapping();
+			if (list->empty()) {
 				this->rescan();
+				list = this->get_mapping();
 			}
 
 			this->trace("lister::readdir", path);
-			filler(buf, ".", NULL, 0);
-			filler(buf, "..", NULL, 0);
-			filler(buf, "core", NULL, 0);
+			filler(buf, ".", NULL, 0, FILL_DIR_PLAIN);
+			filler(buf, "..", NULL, 0, FILL_DIR_PLAIN);
+			filler(buf, "core", NULL, 0, FILL_DIR_PLAIN);
 
-			for (const auto  &entry : this->list) {
+			for (const auto  &entry : *list) {
 
 #ifdef ENABLE_AGGRESSIVE_LISTER_FILE_EXISTENCE_CHECK
 				struct stat statbuf;
@@ -183,7 +196,7 @@ public:
 				}
 #endif
 
-				if (filler(buf, entry.first.c_str(), NULL, 0) != 0) {
+				if (filler(buf, entry.first.c_str(), NULL, 0, FILL_DIR_PLAIN) != 0) {
 					this->error(0, "lister::readdir", "filler failed", path);
 					return -ENOMEM;
 				}
@@ -191,13 +204,13 @@ public:
 			return 0;
 		}
 
-		int retval = Module::readdir(path, buf, filler, offset, fi);
+		int retval = Module::readdir(path, buf, filler, offset, fi, flags);
 		// If the action did not succeed because the path was not found -
 		// maybe we need to use this as a trigger to rescan, and optimistically
 		// retry opening
 		if (retval == -ENOENT) {
 			if (try_rescan() != 0) {
-				retval = Module::readdir(path, buf, filler, offset, fi);
+				retval = Module::readdir(path, buf, filler, offset, fi, flags);
 			}
 		}
 		return retval;
@@ -221,9 +234,22 @@ public:
 		}
 	}
 
+	virtual int read_buf(const char *path, struct fuse_bufvec **bufp,
+			size_t size, off_t offset, struct fuse_file_info *fi) override {
+		if (strcmp("/core", path) == 0) {
+			return read_buf_copy(path, bufp, size, offset, fi);
+		} else {
+			return Module::read_buf(path, bufp, size, offset, fi);
+		}
+	}
+
+	void prefetch_raid() override {
+		// Not on the raids
+	}
+
 	int statfs(const char *, struct statvfs *statbuf) override {
 		this->trace("lister::statfs", config->raids.front().c_str());
-		return ::statvfs(config->raids.front().c_str(), statbuf);
+		return this->raids_statfs(statbuf);
 	}
 
 private:
@@ -244,7 +270,8 @@ private:
 			this->warn(0, "scan", "error opening annon mapping` file ", anon_mapping_file);
 			return -1;
 		}
-		this->list.clear();
+		// Readers keep on using the old mapping until the new one is complete
+		auto list = std::make_shared<mapping_t>();
 		std::string line;
 		while(std::getline(file, line, '\n')) {
 			size_t split = line.find(':');
@@ -255,11 +282,34 @@ private:
 			auto p = std::make_pair(
 				line.substr(0, split),
 				line.substr(split+1));
-			this->list.insert(p);
+			list->insert(p);
 		}
-		ss << "; found " << this->list.size() << " elements.";
+		auto old_list = std::atomic_exchange(&this->list, std::shared_ptr<const mapping_t>(list));
+		invalidate_changes(*old_list, *list);
+		ss << "; found " << list->size() << " elements.";
 		this->info("scan", ss.str(), "");
-		return this->list.size();
+		return list->size();
+	}
+
+	/** Make the kernel forget every anon name that appeared, vanished or moved */
+	void invalidate_changes(const mapping_t &before, const mapping_t &after) {
+		bool changed = false;
+		for (const auto &entry : before) {
+			auto it = after.find(entry.first);
+			if (it == after.end() || it->second != entry.second) {
+				KernelCache::invalidate_entry(this, "/" + entry.first);
+				changed = true;
+			}
+		}
+		for (const auto &entry : after) {
+			if (before.find(entry.first) == before.end()) {
+				KernelCache::invalidate_entry(this, "/" + entry.first);
+				changed = true;
+			}
+		}
+		if (changed) {
+			KernelCache::invalidate_inode(this, "/");
+		}
 	}
 
 	int try_rescan() {
@@ -269,17 +319,26 @@ private:
 		std::string anon_mapping_file = config->anon_mapping_file();
 		struct stat statbuf;
 		::stat(anon_mapping_file.c_str(), &statbuf);
-		if (statbuf.st_mtim.tv_sec != this->anonmap_mtime.tv_sec
-		    || statbuf.st_mtim.tv_nsec != this->anonmap_mtime.tv_nsec) {
+		bool changed;
+		{
+			std::unique_lock<std::mutex> lock(this->mutex);
+			changed = statbuf.st_mtim.tv_sec != this->anonmap_mtime.tv_sec
+				|| statbuf.st_mtim.tv_nsec != this->anonmap_mtime.tv_nsec;
+		}
+		if (changed) {
 			return rescan();
 		} else {
 			return 0;
 		}
 	}
 
-	timespec anonmap_mtime;
+	// Guarded by mutex
+	timespec anonmap_mtime = {0, 0};
 
-	std::map<std::string, std::string> list;
+	// Only accessed via std::atomic_load/std::atomic_store, the fuse workers
+	// read it concurrently while rescan() replaces it.
+	std::shared_ptr<const mapping_t> list = std::make_shared<const mapping_t>();
+	// Serializes rescan()s
 	std::mutex mutex;
 	std::shared_ptr<Communicator> comm;
 };
@@ -12,6 +12,10 @@ public:
 	         const std::shared_ptr<Communicator> &comm) :
 		Module("private", config, comm) {}
 
+	bool plain_io() override {
+		return this->storage->is_native();
+	}
+
 };
 
 }
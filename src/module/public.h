@@ -4,6 +4,7 @@
 
 #include "../mammut_config.h"
 #include "../communicator.h"
+#include "../kernel_cache.h"
 
 namespace mammutfs {
 
@@ -41,8 +42,11 @@ public:
 	                   const char *newpath_raw) override {
 		std::cout << "from " << sourcepath_raw << " to " << newpath_raw << std::endl;
 		int ret = Module::rename(sourcepath, newpath, sourcepath_raw, newpath_raw);
-		if (ret == 0)
+		if (ret == 0) {
 			this->comm->inotify("RENAME", sourcepath_raw, newpath_raw);
+			KernelCache::invalidate_entry(nullptr, sourcepath_raw);
+			KernelCache::invalidate_entry(nullptr, newpath_raw);
+		}
 		return ret;
 	}
 
@@ -60,6 +64,34 @@ public:
 		return ret;
 	}
 
+	virtual int write_buf(const char *path,
+	                      struct fuse_bufvec *buf,
+	                      off_t off,
+	                      struct fuse_file_info *fi) override {
+		int ret = Module::write_buf(path, buf, off, fi);
+#ifdef ENABLE_WRITE_NOTIFY
+		if (ret > 0) {
+			inotify("WRITE", path);
+		}
+#endif
+		return ret;
+	}
+
+	virtual ssize_t copy_file_range(Module *from,
+	                                const char *path_in, struct fuse_file_info *fi_in,
+	                                off_t off_in,
+	                                const char *path_out, struct fuse_file_info *fi_out,
+	                                off_t off_out, size_t size, int flags) override {
+		ssize_t ret = Module::copy_file_range(from, path_in, fi_in, off_in,
+		                                      path_out, fi_out, off_out, size, flags);
+#ifdef ENABLE_WRITE_NOTIFY
+		if (ret > 0) {
+			inotify("WRITE", path_out);
+		}
+#endif
+		return ret;
+	}
+
 	virtual int truncate(const char *path, off_t off) override {
 		int ret = Module::truncate(path, off);
 		if (ret == 0)
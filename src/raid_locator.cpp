@@ -0,0 +1,247 @@
+#include "raid_locator.h"
+
+#include "mammut_config.h"
+#include "storage.h"
+
+#include <chrono>
+#include <fstream>
+#include <future>
+#include <sstream>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+
+namespace mammutfs {
+
+std::shared_ptr<RaidLocator> RaidLocator::shared(const std::shared_ptr<MammutConfig> &config,
+                                                 const std::shared_ptr<Storage> &storage) {
+	static std::mutex mux;
+	static std::shared_ptr<RaidLocator> locator;
+
+	std::lock_guard<std::mutex> lock(mux);
+	if (!locator) {
+		locator = std::make_shared<RaidLocator>(config, storage);
+	}
+	return locator;
+}
+
+
+RaidLocator::RaidLocator(const std::shared_ptr<MammutConfig> &config,
+                         const std::shared_ptr<Storage> &storage) :
+	config(config),
+	storage(storage),
+	homename(config->homename()),
+	index_interval(10),
+	running(false) {
+	memset(&this->index_mtime, 0, sizeof(this->index_mtime));
+	config->lookupValue("raid_index_file", this->index_file, true);
+	config->lookupValue("raid_index_interval", this->index_interval, true);
+
+	if (!this->index_file.empty()) {
+		std::lock_guard<std::mutex> lock(this->mux);
+		this->read_index();
+		if (this->index_interval > 0) {
+			this->running = true;
+			this->worker = std::thread(&RaidLocator::worker_thread, this);
+		}
+	}
+}
+
+
+RaidLocator::~RaidLocator() {
+	{
+		std::lock_guard<std::mutex> lock(this->mux);
+		this->running = false;
+	}
+	this->wakeup.notify_all();
+	if (this->worker.joinable()) {
+		this->worker.join();
+	}
+}
+
+
+int RaidLocator::locate(const std::string &module, std::string &home) {
+	std::unique_lock<std::mutex> lock(this->mux);
+	for (;;) {
+		auto it = this->locations.find(module);
+		if (it == this->locations.end()) {
+			break;
+		}
+		if (!it->second.probing) {
+			home = it->second.home;
+			return 0;
+		}
+		this->probed.wait(lock);
+	}
+
+	// This thread probes, everyone else asking for the module waits for it
+	uint64_t generation = this->gen.load();
+	this->locations[module].probing = true;
+	std::string indexed;
+	auto idx = this->index.find(module + "/" + this->homename);
+	if (idx != this->index.end()) {
+		indexed = idx->second;
+	}
+	lock.unlock();
+
+	std::string found;
+	int retstat = -ENOENT;
+	struct stat statbuf;
+	if (!indexed.empty()
+	    && this->storage->statx(indexed, AT_STATX_DONT_SYNC, STATX_TYPE, &statbuf) == 0) {
+		// The index is right, no need to ask all raids
+		found = indexed;
+		retstat = 0;
+	} else {
+		retstat = this->probe(module, found);
+	}
+
+	lock.lock();
+	auto it = this->locations.find(module);
+	if (retstat == 0 && generation == this->gen.load()) {
+		it->second.home = found;
+		it->second.probing = false;
+	} else {
+		// Homes that do not exist yet may be created any time, and a
+		// refresh while probing may have moved the home: ask again next time
+		this->locations.erase(it);
+	}
+	this->probed.notify_all();
+
+	if (retstat == 0) {
+		home = found;
+	}
+	return retstat;
+}
+
+
+int RaidLocator::probe(const std::string &module, std::string &home) {
+	std::vector<std::string> homes;
+	std::vector<std::future<int>> results;
+	for (const auto &raid : this->config->raids) {
+		homes.push_back(raid + "/" + module + "/" + this->homename);
+		const std::string &to_test = homes.back();
+		results.push_back(std::async(std::launch::async, [this, to_test]() {
+				struct stat statbuf;
+				return this->storage->statx(to_test, AT_STATX_DONT_SYNC, STATX_TYPE, &statbuf);
+			}));
+	}
+
+	// If a home exists on several raids the first raid wins, as it always did
+	int retstat = -ENOENT;
+	for (size_t i = 0; i < results.size(); ++i) {
+		if (results[i].get() == 0 && retstat != 0) {
+			home = homes[i];
+			retstat = 0;
+		}
+	}
+	return retstat;
+}
+
+
+void RaidLocator::prefetch(const std::string &module) {
+	auto self = this->shared_from_this();
+	std::thread([self, module]() {
+			std::string home;
+			self->locate(module, home);
+		}).detach();
+}
+
+
+void RaidLocator::refresh() {
+	std::lock_guard<std::mutex> lock(this->mux);
+	this->read_index();
+	for (auto it = this->locations.begin(); it != this->locations.end();) {
+		if (it->second.probing) {
+			// Dropped by locate when it is done, since the generation changed
+			++it;
+		} else {
+			it = this->locations.erase(it);
+		}
+	}
+	this->gen++;
+}
+
+
+void RaidLocator::read_index() {
+	this->index.clear();
+	if (this->index_file.empty()) {
+		return;
+	}
+
+	struct stat statbuf;
+	if (::stat(this->index_file.c_str(), &statbuf) == 0) {
+		this->index_mtime = statbuf.st_mtim;
+	}
+
+	std::ifstream file(this->index_file);
+	std::string line;
+	while (std::getline(file, line)) {
+		while (!line.empty() && (line.back() == '/' || line.back() == ' ')) {
+			line.pop_back();
+		}
+		// Only the homes of this user on one of our raids
+		size_t name = line.find_last_of('/');
+		if (name == std::string::npos || line.compare(name + 1, std::string::npos, this->homename) != 0) {
+			continue;
+		}
+		size_t module = line.find_last_of('/', name - 1);
+		if (module == std::string::npos || module == 0) {
+			continue;
+		}
+		for (const auto &raid : this->config->raids) {
+			if (line.compare(0, module, raid) == 0 && raid.size() == module) {
+				this->index[line.substr(module + 1)] = line;
+				break;
+			}
+		}
+	}
+}
+
+
+void RaidLocator::worker_thread() {
+	prctl(PR_SET_NAME, "raid_locator", 0, 0, 0);
+	std::unique_lock<std::mutex> lock(this->mux);
+	while (this->running) {
+		this->wakeup.wait_for(lock, std::chrono::duration<double>(this->index_interval),
+		                      [this]() { return !this->running; });
+		if (!this->running) {
+			break;
+		}
+
+		struct stat statbuf;
+		if (::stat(this->index_file.c_str(), &statbuf) == 0
+		    && (statbuf.st_mtim.tv_sec != this->index_mtime.tv_sec
+		        || statbuf.st_mtim.tv_nsec != this->index_mtime.tv_nsec)) {
+			lock.unlock();
+			this->refresh();
+			lock.lock();
+		}
+	}
+}
+
+
+std::string RaidLocator::stats() {
+	std::lock_guard<std::mutex> lock(this->mux);
+	std::stringstream ss;
+	ss << "{\"generation\":" << this->gen.load()
+	   << ",\"indexed\":" << this->index.size()
+	   << ",\"homes\":{";
+	bool first = true;
+	for (const auto &location : this->locations) {
+		if (location.second.probing) {
+			continue;
+		}
+		ss << (first ? "" : ",") << "\"" << location.first << "\":\""
+		   << location.second.home << "\"";
+		first = false;
+	}
+	ss << "}}";
+	return ss.str();
+}
+
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include <time.h>
+
+namespace mammutfs {
+
+class MammutConfig;
+class Storage;
+
+/**
+ * Which raid the home of a module is on: raid/<module>/<homename>.
+ *
+ * All raids are probed at once, so a cold mount waits for the slowest raid
+ * instead of for all raids one after the other. With "raid_index_file" the
+ * homes are taken from an index instead - a list of homes, one per line, as
+ * `find <raids> -mindepth 2 -maxdepth 2` prints them.
+ *
+ * Users are moved between raids while they are mounted: the index is reread
+ * when it changes and RAIDRESCAN forgets everything that was located. Every
+ * change counts up generation(), the modules compare it to notice a move.
+ */
+class RaidLocator : public std::enable_shared_from_this<RaidLocator> {
+public:
+	/** The locator of this process, created on the first call */
+	static std::shared_ptr<RaidLocator> shared(const std::shared_ptr<MammutConfig> &config,
+	                                           const std::shared_ptr<Storage> &storage);
+
+	RaidLocator(const std::shared_ptr<MammutConfig> &config,
+	            const std::shared_ptr<Storage> &storage);
+	~RaidLocator();
+
+	/**
+	 * The home of module, -ENOENT if it is on no raid. Waits for a probe of
+	 * the module that is already running.
+	 */
+	int locate(const std::string &module, std::string &home);
+
+	/** Locate module in the background, so the first request does not wait */
+	void prefetch(const std::string &module);
+
+	/** Reread the index and forget all locations */
+	void refresh();
+
+	/** Counts the refreshes */
+	uint64_t generation() const {
+		return this->gen.load();
+	}
+
+	/** The located homes as json, for the communicator */
+	std::string stats();
+
+private:
+	struct location_t {
+		std::string home;
+		/** Being probed, wait for probed */
+		bool probing;
+	};
+
+	/** The home of module on the raids, without any caching */
+	int probe(const std::string &module, std::string &home);
+
+	/** (Re)read the index, has to be called locked */
+	void read_index();
+
+	/** Watches the index for changes */
+	void worker_thread();
+
+	std::shared_ptr<MammutConfig> config;
+	std::shared_ptr<Storage> storage;
+
+	const std::string homename;
+	std::string index_file;
+	double index_interval;
+
+	std::mutex mux;
+	std::condition_variable probed;
+	std::unordered_map<std::string, location_t> locations;
+	/** "<module>/<homename>" to the home, from the index */
+	std::unordered_map<std::string, std::string> index;
+	struct timespec index_mtime;
+
+	std::atomic<uint64_t> gen { 0 };
+
+	std::condition_variable wakeup;
+	bool running;
+	std::thread worker;
+};
+
+}
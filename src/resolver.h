@@ -6,6 +6,7 @@
 
 #include <map>
 #include <memory>
+#include <string_view>
 #include <unordered_map>
 
 namespace mammutfs {
@@ -23,12 +24,9 @@ public:
 	/**
 	 * resolve a module from name to module
 	 */
-	Module *getModule(const char *alias, int strlen = -1) const {
-		std::string search = (strlen >= 0)?
-		                     std::string(alias, strlen) :
-		                     std::string(alias);
-
-		auto it = activated.find(search);
+	Module *getModule(std::string_view alias) const {
+		// activated compares transparently, no string is built for the lookup
+		auto it = activated.find(alias);
 		if (it == activated.end()) {
 			return nullptr;
 		}
@@ -60,7 +58,7 @@ public:
 			remaining_path = p;
 		}
 		size_t mlen = (p - path - 1);
-		return getModule(path + 1, mlen);
+		return getModule(std::string_view(path + 1, mlen));
 	}
 
 
@@ -97,7 +95,26 @@ public:
 		return nullptr;
 	}
 
-	const std::map<std::string, Module *> &activatedModules() const {
+	/**
+	 * The path within the mount of a module relative path
+	 */
+	bool mount_path(const Module *module, const std::string &path, std::string &out) {
+		if (this->is_single_module()) {
+			out = path;
+			return module == this->get_single_module();
+		}
+		for (const auto &m : this->activated) {
+			if (m.second == module) {
+				out = "/" + m.first + (path == "/" ? "" : path);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	using modules_t = std::map<std::string, Module *, std::less<>>;
+
+	const modules_t &activatedModules() const {
 		return activated;
 	}
 private:
@@ -107,7 +124,7 @@ private:
 	 * is always the same even in programms that do not sort the output of the directory
 	 * filler
 	 */
-	std::map<std::string, Module *> activated;
+	modules_t activated;
 };
 
 }
@@ -0,0 +1,175 @@
+#include "statfs_cache.h"
+
+#include "mammut_config.h"
+#include "storage.h"
+
+#include <chrono>
+
+#include <errno.h>
+#include <string.h>
+#include <sys/prctl.h>
+
+namespace mammutfs {
+
+std::shared_ptr<StatfsCache> StatfsCache::shared(const std::shared_ptr<MammutConfig> &config,
+                                                 const std::shared_ptr<Storage> &storage) {
+	static std::mutex mux;
+	static std::shared_ptr<StatfsCache> cache;
+
+	std::lock_guard<std::mutex> lock(mux);
+	if (!cache) {
+		double interval = 10;
+		config->lookupValue("statfs_interval", interval, true);
+		cache = std::make_shared<StatfsCache>(config->raids, interval, storage);
+	}
+	return cache;
+}
+
+
+StatfsCache::StatfsCache(const std::list<std::string> &raids, double interval,
+                         const std::shared_ptr<Storage> &storage) :
+	interval(interval),
+	storage(storage),
+	running(interval > 0) {
+	for (const auto &path : raids) {
+		raid_t raid;
+		raid.path = path;
+		while (raid.path.size() > 1 && raid.path.back() == '/') {
+			raid.path.pop_back();
+		}
+		memset(&raid.statv, 0, sizeof(raid.statv));
+		raid.retstat = -EAGAIN;
+		raid.valid = false;
+		this->raids.push_back(raid);
+	}
+	if (this->running) {
+		for (size_t i = 0; i < this->raids.size(); ++i) {
+			this->workers.emplace_back(&StatfsCache::worker_thread, this, i);
+		}
+	}
+}
+
+
+StatfsCache::~StatfsCache() {
+	{
+		std::lock_guard<std::mutex> lock(this->mux);
+		this->running = false;
+	}
+	this->wakeup.notify_all();
+	for (auto &worker : this->workers) {
+		worker.join();
+	}
+}
+
+
+int StatfsCache::fetch(size_t i) {
+	// The raid may hang, nobody has to wait for the lock meanwhile
+	struct statvfs statv;
+	memset(&statv, 0, sizeof(statv));
+	int retstat = this->storage->statvfs(this->raids[i].path, &statv);
+
+	std::lock_guard<std::mutex> lock(this->mux);
+	raid_t &raid = this->raids[i];
+	raid.retstat = retstat;
+	if (retstat == 0) {
+		raid.statv = statv;
+		raid.valid = true;
+	}
+	return retstat;
+}
+
+
+void StatfsCache::worker_thread(size_t i) {
+	prctl(PR_SET_NAME, "statfs", 0, 0, 0);
+	std::unique_lock<std::mutex> lock(this->mux);
+	while (this->running) {
+		lock.unlock();
+		this->fetch(i);
+		lock.lock();
+		this->wakeup.wait_for(lock, std::chrono::duration<double>(this->interval),
+		                      [this]() { return !this->running; });
+	}
+}
+
+
+int StatfsCache::get(const std::string &path, struct statvfs *statv) {
+	// The longest raid that contains path
+	size_t found = this->raids.size();
+	for (size_t i = 0; i < this->raids.size(); ++i) {
+		const std::string &raid = this->raids[i].path;
+		if (path.compare(0, raid.size(), raid) == 0
+		    && (path.size() == raid.size() || path[raid.size()] == '/')
+		    && (found == this->raids.size() || raid.size() > this->raids[found].path.size())) {
+			found = i;
+		}
+	}
+	if (found == this->raids.size()) {
+		return -ENOENT;
+	}
+
+	// Without an interval the raids are asked on every query
+	if (this->interval <= 0) {
+		this->fetch(found);
+	}
+
+	std::lock_guard<std::mutex> lock(this->mux);
+	const raid_t &raid = this->raids[found];
+	if (!raid.valid) {
+		return raid.retstat;
+	}
+	*statv = raid.statv;
+	return 0;
+}
+
+
+int StatfsCache::aggregate(struct statvfs *statv) {
+	if (this->interval <= 0) {
+		for (size_t i = 0; i < this->raids.size(); ++i) {
+			this->fetch(i);
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(this->mux);
+	memset(statv, 0, sizeof(*statv));
+	std::vector<unsigned long> seen;
+	for (const auto &raid : this->raids) {
+		if (!raid.valid) {
+			continue;
+		}
+		const struct statvfs &s = raid.statv;
+		bool counted = false;
+		for (unsigned long fsid : seen) {
+			counted |= fsid == s.f_fsid;
+		}
+		if (counted) {
+			continue;
+		}
+		seen.push_back(s.f_fsid);
+
+		// The first raid defines the block size, the others are scaled to it
+		unsigned long frsize = s.f_frsize ? s.f_frsize : s.f_bsize;
+		if (statv->f_frsize == 0) {
+			statv->f_bsize = s.f_bsize;
+			statv->f_frsize = frsize;
+			statv->f_namemax = s.f_namemax;
+			statv->f_flag = s.f_flag;
+			statv->f_fsid = s.f_fsid;
+		}
+		double scale = static_cast<double>(frsize) / statv->f_frsize;
+		statv->f_blocks += s.f_blocks * scale;
+		statv->f_bfree += s.f_bfree * scale;
+		statv->f_bavail += s.f_bavail * scale;
+		statv->f_files += s.f_files;
+		statv->f_ffree += s.f_ffree;
+		statv->f_favail += s.f_favail;
+		if (s.f_namemax < statv->f_namemax) {
+			statv->f_namemax = s.f_namemax;
+		}
+	}
+	if (seen.empty()) {
+		return (this->interval > 0) ? -EAGAIN : -EIO;
+	}
+	return 0;
+}
+
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <condition_variable>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/statvfs.h>
+
+namespace mammutfs {
+
+class MammutConfig;
+class Storage;
+
+/**
+ * The statvfs of every raid, refreshed in the background.
+ *
+ * df and the free space queries of smb poll constantly, and a statvfs on a
+ * busy raid can take long. The requests get what the workers fetched last,
+ * they never wait for a raid. Every raid has a worker of its own, so a raid
+ * that hangs does not keep the others from being refreshed.
+ */
+class StatfsCache {
+public:
+	/**
+	 * The cache of this process, created on the first call. The raids are
+	 * refreshed every "statfs_interval" seconds, 0 fetches them on every
+	 * query.
+	 */
+	static std::shared_ptr<StatfsCache> shared(const std::shared_ptr<MammutConfig> &config,
+	                                           const std::shared_ptr<Storage> &storage);
+
+	StatfsCache(const std::list<std::string> &raids, double interval,
+	            const std::shared_ptr<Storage> &storage);
+	~StatfsCache();
+
+	/**
+	 * The last statvfs of the raid path is on, -ENOENT if it is on none.
+	 * -EAGAIN (or the error of the last statvfs) if there is no sample of
+	 * the raid yet.
+	 */
+	int get(const std::string &path, struct statvfs *statv);
+
+	/**
+	 * The capacity of all raids together. Raids on the same filesystem
+	 * are counted once, raids without a sample yet not at all.
+	 */
+	int aggregate(struct statvfs *statv);
+
+private:
+	struct raid_t {
+		std::string path;
+		struct statvfs statv;
+		/** The result of the last statvfs */
+		int retstat;
+		/** If statv holds a sample, it is kept when a later statvfs fails */
+		bool valid;
+	};
+
+	/** Fetch raid i and store it */
+	int fetch(size_t i);
+
+	/** Refreshes raid i every interval */
+	void worker_thread(size_t i);
+
+	const double interval;
+	std::shared_ptr<Storage> storage;
+
+	/** Guards the statvfs and states of raids, the paths never change */
+	std::mutex mux;
+	std::vector<raid_t> raids;
+
+	std::condition_variable wakeup;
+	bool running;
+	std::vector<std::thread> workers;
+};
+
+}
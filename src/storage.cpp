@@ -0,0 +1,672 @@
+#include "storage.h"
+
+#include "arena.h"
+#include "mammut_config.h"
+#include "memory_storage.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/xattr.h>
+#ifdef SYS_openat2
+#include <linux/openat2.h>
+#endif
+
+#include <atomic>
+#include <iostream>
+#include <mutex>
+
+namespace mammutfs {
+
+void statx_to_stat(const struct statx &stx, struct stat &st) {
+	memset(&st, 0, sizeof(st));
+	st.st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+	st.st_ino = stx.stx_ino;
+	st.st_mode = stx.stx_mode;
+	st.st_nlink = stx.stx_nlink;
+	st.st_uid = stx.stx_uid;
+	st.st_gid = stx.stx_gid;
+	st.st_rdev = makedev(stx.stx_rdev_major, stx.stx_rdev_minor);
+	st.st_size = stx.stx_size;
+	st.st_blksize = stx.stx_blksize;
+	st.st_blocks = stx.stx_blocks;
+	st.st_atim.tv_sec = stx.stx_atime.tv_sec;
+	st.st_atim.tv_nsec = stx.stx_atime.tv_nsec;
+	st.st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+	st.st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+	st.st_ctim.tv_sec = stx.stx_ctime.tv_sec;
+	st.st_ctim.tv_nsec = stx.stx_ctime.tv_nsec;
+}
+
+
+std::shared_ptr<Storage> Storage::shared(const std::shared_ptr<MammutConfig> &config) {
+	static std::mutex mux;
+	static std::shared_ptr<Storage> storage;
+
+	std::lock_guard<std::mutex> lock(mux);
+	if (!storage) {
+		std::string type = config->storage();
+		if (type == "memory") {
+			storage = std::make_shared<MemoryStorage>();
+		} else {
+			if (type != "posix") {
+				std::cerr << "Unknown storage \"" << type << "\", using posix" << std::endl;
+			}
+			storage = std::make_shared<PosixStorage>();
+		}
+	}
+	return storage;
+}
+
+
+int Storage::statx(const std::string &path, int flags, unsigned int,
+                   struct stat *statbuf) {
+	if (flags & AT_SYMLINK_NOFOLLOW) {
+		return this->lstat(path, statbuf);
+	}
+	return this->stat(path, statbuf);
+}
+
+
+int Storage::getxattr(const std::string &, const char *, char *, size_t) {
+	return -ENOTSUP;
+}
+
+
+int Storage::setxattr(const std::string &, const char *, const char *, size_t, int) {
+	return -ENOTSUP;
+}
+
+
+int Storage::listxattr(const std::string &, char *, size_t) {
+	return -ENOTSUP;
+}
+
+
+int Storage::removexattr(const std::string &, const char *) {
+	return -ENOTSUP;
+}
+
+
+int Storage::mkdirs(const std::string &path, mode_t mode) {
+	// Create every prefix ending before a '/', then the path itself
+	size_t pos = 0;
+	while ((pos = path.find('/', pos + 1)) != std::string::npos) {
+		int retstat = this->mkdir(path.substr(0, pos), mode);
+		if (retstat < 0 && retstat != -EEXIST) {
+			return retstat;
+		}
+	}
+	int retstat = this->mkdir(path, mode);
+	return retstat == -EEXIST ? 0 : retstat;
+}
+
+
+// The syscalls return -1 and set errno
+static inline int result(int retstat) {
+	return retstat < 0 ? -errno : retstat;
+}
+
+
+PosixStorage::~PosixStorage() {
+	auto roots = std::atomic_load(&this->roots);
+	if (roots) {
+		for (const auto &root : *roots) {
+			::close(root.fd);
+		}
+	}
+}
+
+
+void PosixStorage::add_root(const std::string &path) {
+	std::string root = path;
+	while (root.size() > 1 && root.back() == '/') {
+		root.pop_back();
+	}
+
+	std::lock_guard<std::mutex> lock(this->roots_mux);
+	auto current = std::atomic_load(&this->roots);
+	if (current) {
+		for (const auto &r : *current) {
+			if (r.path == root) {
+				return;
+			}
+		}
+	}
+
+	int fd = ::open(root.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		// The paths below it keep working through the plain syscalls
+		return;
+	}
+	auto next = std::make_shared<roots_t>(current ? *current : roots_t());
+	next->push_back(root_t { root, fd });
+	std::atomic_store(&this->roots, std::shared_ptr<const roots_t>(next));
+}
+
+
+PosixStorage::at_t::~at_t() {
+	if (this->owned) {
+		::close(this->dirfd);
+	}
+}
+
+
+int PosixStorage::split_root(const std::string &path, std::string &rel) {
+	auto roots = std::atomic_load(&this->roots);
+	const root_t *best = nullptr;
+	if (roots) {
+		for (const auto &r : *roots) {
+			if (path.compare(0, r.path.size(), r.path) == 0
+			    && (path.size() == r.path.size() || path[r.path.size()] == '/')
+			    && (best == nullptr || r.path.size() > best->path.size())) {
+				best = &r;
+			}
+		}
+	}
+	if (best == nullptr) {
+		rel.assign(path);
+		return AT_FDCWD;
+	}
+
+	size_t start = path.find_first_not_of('/', best->path.size());
+	if (start == std::string::npos) {
+		rel.assign(".");
+	} else {
+		rel.assign(path, start, std::string::npos);
+	}
+	// The roots are only closed with the storage
+	return best->fd;
+}
+
+
+int PosixStorage::resolve(const std::string &path, std::string &rel, at_t &at) {
+	int dirfd = this->split_root(path, rel);
+	if (dirfd == AT_FDCWD) {
+		at.dirfd = AT_FDCWD;
+		at.name = path.c_str();
+		return 0;
+	}
+
+	rel.erase(rel.find_last_not_of('/') + 1);
+	size_t slash = rel.rfind('/');
+	if (slash == std::string::npos) {
+		at.dirfd = dirfd;
+		at.name = rel.c_str();
+		return 0;
+	}
+
+	// Split rel in place into the directory and the name
+	rel[slash] = '\0';
+	int fd = open_beneath(dirfd, rel.c_str(), O_PATH | O_DIRECTORY, 0);
+	if (fd < 0) {
+		return fd;
+	}
+	at.dirfd = fd;
+	at.owned = true;
+	at.name = rel.c_str() + slash + 1;
+	return 0;
+}
+
+
+int openat2_flags(int flags) {
+	// fuse may pass internal bits of the kernel (like __FMODE_EXEC)
+	return flags & (O_ACCMODE | O_CREAT | O_EXCL | O_NOCTTY
+		| O_TRUNC | O_APPEND | O_NONBLOCK | O_DSYNC | O_SYNC | O_DIRECT
+		| O_LARGEFILE | O_DIRECTORY | O_NOFOLLOW | O_NOATIME | O_CLOEXEC
+		| O_PATH | O_TMPFILE);
+}
+
+
+int PosixStorage::resolve_file(const std::string &path, std::string &rel, at_t &at) {
+	int dirfd = this->split_root(path, rel);
+	rel.erase(rel.find_last_not_of('/') + 1);
+	if (dirfd == AT_FDCWD || rel.find('/') == std::string::npos) {
+		// No directory to open, the name is looked up right in dirfd
+		at.dirfd = dirfd;
+		at.name = dirfd == AT_FDCWD ? path.c_str() : rel.c_str();
+		return 0;
+	}
+
+	int fd = open_beneath(dirfd, rel.c_str(), O_PATH | O_NOFOLLOW | O_CLOEXEC, 0);
+	if (fd < 0) {
+		return fd;
+	}
+	at.dirfd = fd;
+	at.owned = true;
+	at.name = "";
+	return 0;
+}
+
+
+#ifdef SYS_openat2
+// Cleared once the kernel turns out to be older than 5.6
+static std::atomic<bool> has_openat2 { true };
+#endif
+
+
+int PosixStorage::root_fd(const std::string &path, std::string &rel) {
+#ifdef SYS_openat2
+	if (has_openat2) {
+		int dirfd = this->split_root(path, rel);
+		return dirfd == AT_FDCWD ? -1 : dirfd;
+	}
+#else
+	(void)path;
+	(void)rel;
+#endif
+	return -1;
+}
+
+
+int PosixStorage::open_beneath(int dirfd, const char *rel, int flags, mode_t mode) {
+	if (dirfd == AT_FDCWD) {
+		return result(::open(rel, flags, mode));
+	}
+#ifdef SYS_openat2
+	if (has_openat2) {
+		struct open_how how;
+		memset(&how, 0, sizeof(how));
+		how.flags = openat2_flags(flags);
+		if ((flags & O_CREAT) || (flags & O_TMPFILE) == O_TMPFILE) {
+			how.mode = mode;
+		}
+		how.resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS;
+		int fd = syscall(SYS_openat2, dirfd, rel, &how, sizeof(how));
+		if (fd >= 0 || errno != ENOSYS) {
+			return result(fd);
+		}
+		has_openat2 = false;
+	}
+#endif
+	// At least the last component must not be a symlink
+	return result(::openat(dirfd, rel, flags | O_NOFOLLOW, mode));
+}
+
+
+int PosixStorage::stat(const std::string &path, struct stat *statbuf) {
+	// No symlink is followed, not even the last component
+	return this->lstat(path, statbuf);
+}
+
+
+int PosixStorage::lstat(const std::string &path, struct stat *statbuf) {
+	Arena::scope scope;
+	at_t at;
+	int retstat = this->resolve_file(path, scope.string(), at);
+	if (retstat < 0) {
+		return retstat;
+	}
+	return result(::fstatat(at.dirfd, at.name, statbuf,
+	                        AT_SYMLINK_NOFOLLOW | AT_EMPTY_PATH));
+}
+
+
+int PosixStorage::statx(const std::string &path, int flags, unsigned int mask,
+                        struct stat *statbuf) {
+	Arena::scope scope;
+	at_t at;
+	int retstat = this->resolve_file(path, scope.string(), at);
+	if (retstat < 0) {
+		return retstat;
+	}
+	struct statx stx;
+	retstat = result(::statx(at.dirfd, at.name,
+	                         flags | AT_SYMLINK_NOFOLLOW | AT_EMPTY_PATH, mask, &stx));
+	if (retstat == 0) {
+		statx_to_stat(stx, *statbuf);
+	}
+	return retstat;
+}
+
+
+int PosixStorage::access(const std::string &path, int mask) {
+	Arena::scope scope;
+	at_t at;
+	int retstat = this->resolve(path, scope.string(), at);
+	if (retstat < 0) {
+		return retstat;
+	}
+	return result(::faccessat(at.dirfd, at.name, mask, AT_SYMLINK_NOFOLLOW));
+}
+
+
+int PosixStorage::statvfs(const std::string &path, struct statvfs *statv) {
+	return result(::statvfs(path.c_str(), statv));
+}
+
+
+int PosixStorage::mkdir(const std::string &path, mode_t mode) {
+	Arena::scope scope;
+	at_t at;
+	int retstat = this->resolve(path, scope.string(), at);
+	if (retstat < 0) {
+		return retstat;
+	}
+	return result(::mkdirat(at.dirfd, at.name, mode));
+}
+
+
+int PosixStorage::unlink(const std::string &path) {
+	Arena::scope scope;
+	at_t at;
+	int retstat = this->resolve(path, scope.string(), at);
+	if (retstat < 0) {
+		return retstat;
+	}
+	return result(::unlinkat(at.dirfd, at.name, 0));
+}
+
+
+int PosixStorage::rmdir(const std::string &path) {
+	Arena::scope scope;
+	at_t at;
+	int retstat = this->resolve(path, scope.string(), at);
+	if (retstat < 0) {
+		return retstat;
+	}
+	return result(::unlinkat(at.dirfd, at.name, AT_REMOVEDIR));
+}
+
+
+int PosixStorage::rename(const std::string &from, const std::string &to) {
+	Arena::scope scope;
+	at_t from_at, to_at;
+	int retstat = this->resolve(from, scope.string(), from_at);
+	if (retstat < 0) {
+		return retstat;
+	}
+	if ((retstat = this->resolve(to, scope.string(), to_at)) < 0) {
+		return retstat;
+	}
+	return result(::renameat(from_at.dirfd, from_at.name,
+	                         to_at.dirfd, to_at.name));
+}
+
+
+int PosixStorage::chmod(const std::string &path, mode_t mode) {
+	Arena::scope scope;
+	at_t at;
+	int retstat = this->resolve(path, scope.string(), at);
+	if (retstat < 0) {
+		return retstat;
+	}
+	int flags = (at.dirfd == AT_FDCWD) ? 0 : AT_SYMLINK_NOFOLLOW;
+	return result(::fchmodat(at.dirfd, at.name, mode, flags));
+}
+
+
+int PosixStorage::truncate(const std::string &path, off_t size) {
+	Arena::scope scope;
+	std::string &rel = scope.string();
+	int dirfd = this->split_root(path, rel);
+	if (dirfd == AT_FDCWD) {
+		return result(::truncate(path.c_str(), size));
+	}
+
+	int fd = open_beneath(dirfd, rel.c_str(), O_WRONLY, 0);
+	if (fd < 0) {
+		return fd;
+	}
+	int retstat = result(::ftruncate(fd, size));
+	::close(fd);
+	return retstat;
+}
+
+
+int PosixStorage::utimens(const std::string &path, const struct timespec tv[2]) {
+	Arena::scope scope;
+	at_t at;
+	int retstat = this->resolve(path, scope.string(), at);
+	if (retstat < 0) {
+		return retstat;
+	}
+	int flags = (at.dirfd == AT_FDCWD) ? 0 : AT_SYMLINK_NOFOLLOW;
+	return result(::utimensat(at.dirfd, at.name, tv, flags));
+}
+
+
+int PosixStorage::xattr_path(const std::string &path, std::string &scratch, int &fd) {
+	fd = -1;
+	int dirfd = this->split_root(path, scratch);
+	if (dirfd == AT_FDCWD) {
+		return 0;
+	}
+	fd = open_beneath(dirfd, scratch.c_str(), O_PATH | O_CLOEXEC, 0);
+	if (fd < 0) {
+		return fd;
+	}
+	char proc[32];
+	snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+	scratch.assign(proc);
+	return 0;
+}
+
+
+int PosixStorage::getxattr(const std::string &path, const char *name, char *value, size_t size) {
+	Arena::scope scope;
+	std::string &p = scope.string();
+	int fd;
+	int retstat = this->xattr_path(path, p, fd);
+	if (retstat < 0) {
+		return retstat;
+	}
+	// The /proc link has to be followed, path must not be
+	retstat = result(fd < 0 ? ::lgetxattr(p.c_str(), name, value, size)
+	                        : ::getxattr(p.c_str(), name, value, size));
+	if (fd >= 0) {
+		::close(fd);
+	}
+	return retstat;
+}
+
+
+int PosixStorage::setxattr(const std::string &path, const char *name, const char *value,
+                           size_t size, int flags) {
+	Arena::scope scope;
+	std::string &p = scope.string();
+	int fd;
+	int retstat = this->xattr_path(path, p, fd);
+	if (retstat < 0) {
+		return retstat;
+	}
+	retstat = result(fd < 0 ? ::lsetxattr(p.c_str(), name, value, size, flags)
+	                        : ::setxattr(p.c_str(), name, value, size, flags));
+	if (fd >= 0) {
+		::close(fd);
+	}
+	return retstat;
+}
+
+
+int PosixStorage::listxattr(const std::string &path, char *list, size_t size) {
+	Arena::scope scope;
+	std::string &p = scope.string();
+	int fd;
+	int retstat = this->xattr_path(path, p, fd);
+	if (retstat < 0) {
+		return retstat;
+	}
+	retstat = result(fd < 0 ? ::llistxattr(p.c_str(), list, size)
+	                        : ::listxattr(p.c_str(), list, size));
+	if (fd >= 0) {
+		::close(fd);
+	}
+	return retstat;
+}
+
+
+int PosixStorage::removexattr(const std::string &path, const char *name) {
+	Arena::scope scope;
+	std::string &p = scope.string();
+	int fd;
+	int retstat = this->xattr_path(path, p, fd);
+	if (retstat < 0) {
+		return retstat;
+	}
+	retstat = result(fd < 0 ? ::lremovexattr(p.c_str(), name)
+	                        : ::removexattr(p.c_str(), name));
+	if (fd >= 0) {
+		::close(fd);
+	}
+	return retstat;
+}
+
+
+int PosixStorage::open(const std::string &path, int flags, mode_t mode) {
+	Arena::scope scope;
+	std::string &rel = scope.string();
+	int dirfd = this->split_root(path, rel);
+	return open_beneath(dirfd, rel.c_str(), flags, mode);
+}
+
+
+int PosixStorage::close(int fh) {
+	return result(::close(fh));
+}
+
+
+ssize_t PosixStorage::pread(int fh, void *buf, size_t size, off_t offset) {
+	ssize_t retstat = ::pread(fh, buf, size, offset);
+	return retstat < 0 ? -errno : retstat;
+}
+
+
+ssize_t PosixStorage::pwrite(int fh, const void *buf, size_t size, off_t offset) {
+	ssize_t retstat = ::pwrite(fh, buf, size, offset);
+	return retstat < 0 ? -errno : retstat;
+}
+
+
+int PosixStorage::fsync(int fh) {
+	return result(::fsync(fh));
+}
+
+
+off_t PosixStorage::lseek(int fh, off_t offset, int whence) {
+	// The file position is never used for io, moving it does not matter
+	off_t retstat = ::lseek(fh, offset, whence);
+	return retstat < 0 ? -errno : retstat;
+}
+
+
+int PosixStorage::readahead(int fh, off_t offset, size_t size) {
+	// Queues the reads into the page cache - on cephfs a request to the
+	// osds that runs while the reads before it are served
+	return -::posix_fadvise(fh, offset, size, POSIX_FADV_WILLNEED);
+}
+
+
+ssize_t PosixStorage::copy_file_range(int fh_in, off_t offset_in,
+                                      int fh_out, off_t offset_out, size_t size) {
+	// Across filesystems the kernel copies itself (since 5.3), still
+	// without the data leaving it
+	ssize_t retstat = ::copy_file_range(fh_in, &offset_in, fh_out, &offset_out, size, 0);
+	return retstat < 0 ? -errno : retstat;
+}
+
+
+/** A record as returned by getdents64 */
+struct linux_dirent64 {
+	ino64_t d_ino;
+	off64_t d_off;      //< where the listing continues after this record
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[1];     //< actually d_reclen - offsetof(d_name) bytes
+};
+
+/** Big enough to list a directory on ceph in few round trips */
+static const size_t DIR_BUFFER_SIZE = 128 * 1024;
+
+/**
+ * The records of the last getdents64 are kept until they are listed, so a
+ * listing that stops because the fuse buffer is full continues right there
+ * without any syscall.
+ */
+struct PosixStorage::dir_t {
+	int fd;
+	/** Allocated on the first readdir */
+	std::vector<char> buf;
+	/** The next record within buf and the end of the valid records */
+	size_t pos = 0;
+	size_t end = 0;
+	/** The offset of the record at pos */
+	off_t cursor = 0;
+};
+
+
+int PosixStorage::opendir(const std::string &path, void *&dir) {
+	Arena::scope scope;
+	std::string &rel = scope.string();
+	int dirfd = this->split_root(path, rel);
+	int fd = open_beneath(dirfd, rel.c_str(), O_RDONLY | O_DIRECTORY, 0);
+	if (fd < 0) {
+		return fd;
+	}
+	dir_t *d = new dir_t();
+	d->fd = fd;
+	dir = d;
+	return 0;
+}
+
+
+int PosixStorage::readdir(void *dir, off_t offset, const dir_filler &filler,
+                          unsigned int attrs, int sync) {
+	dir_t *d = static_cast<dir_t *>(dir);
+	if (offset != d->cursor) {
+		// d_off is a position the directory can seek to, 0 rewinds
+		if (::lseek(d->fd, offset, SEEK_SET) < 0) {
+			return -errno;
+		}
+		d->pos = d->end = 0;
+		d->cursor = offset;
+	}
+
+	struct statx stx;
+	struct stat st;
+	while (true) {
+		if (d->pos >= d->end) {
+			if (d->buf.empty()) {
+				d->buf.resize(DIR_BUFFER_SIZE);
+			}
+			long n = ::syscall(SYS_getdents64, d->fd, d->buf.data(), d->buf.size());
+			if (n <= 0) {
+				return n < 0 ? -errno : 0;
+			}
+			d->pos = 0;
+			d->end = n;
+		}
+
+		const linux_dirent64 *de = reinterpret_cast<const linux_dirent64 *>(
+			d->buf.data() + d->pos);
+		const char *name = d->buf.data() + d->pos + offsetof(linux_dirent64, d_name);
+		// Relative to the open directory, the kernel does not walk the path
+		// again. An entry that vanished in between is listed without.
+		bool has_attrs = attrs != 0
+			&& ::statx(d->fd, name, AT_SYMLINK_NOFOLLOW | sync, attrs, &stx) == 0;
+		if (has_attrs) {
+			statx_to_stat(stx, st);
+		}
+		if (!filler(name, has_attrs ? &st : nullptr, de->d_off)) {
+			return 0;
+		}
+		d->pos += de->d_reclen;
+		d->cursor = de->d_off;
+	}
+}
+
+
+int PosixStorage::closedir(void *dir) {
+	dir_t *d = static_cast<dir_t *>(dir);
+	int retstat = result(::close(d->fd));
+	delete d;
+	return retstat;
+}
+
+}
@@ -0,0 +1,260 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/types.h>
+
+namespace mammutfs {
+
+class MammutConfig;
+
+/** A stat as lstat would have filled it, fields statx did not return are 0 */
+void statx_to_stat(const struct statx &stx, struct stat &st);
+
+/** The flags of open(2) that openat2(2) accepts, it refuses all others */
+int openat2_flags(int flags);
+
+/**
+ * Where the translated paths of the modules live.
+ *
+ * The modules translate the mount into paths on the raids and hand the
+ * actual file operations to a storage. The posix storage performs them on
+ * the raids (this is what mammutfs does in production), the memory storage
+ * keeps the whole tree in memory - so a mount or a benchmark runs without
+ * any disk latency and shows the cost of mammutfs alone.
+ *
+ * All paths are translated paths, all calls return 0 (or a size / a handle)
+ * on success and -errno on failure.
+ */
+class Storage {
+public:
+	virtual ~Storage() {}
+
+	/**
+	 * The storage of all modules of this process, as configured by "storage"
+	 * ("posix" or "memory"). It is created on the first call.
+	 */
+	static std::shared_ptr<Storage> shared(const std::shared_ptr<MammutConfig> &config);
+
+	/**
+	 * If the files are real files on the raids, so their handles are native
+	 * fds the kernel can splice from, pass through or queue to io_uring.
+	 */
+	virtual bool is_native() const = 0;
+
+	/**
+	 * A directory most of the following paths are below - the home of a
+	 * module. The storage may keep it open and resolve paths relative to it.
+	 */
+	virtual void add_root(const std::string &) {}
+
+	/**
+	 * The dirfd of the root path is below, rel is set to path relative to
+	 * it - for callers that do the syscalls on their own (io_uring). They
+	 * have to resolve rel with openat2 RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS.
+	 * -1 if path is below no root or the kernel has no openat2.
+	 */
+	virtual int root_fd(const std::string &, std::string &) { return -1; }
+
+	virtual int stat(const std::string &path, struct stat *statbuf) = 0;
+	virtual int lstat(const std::string &path, struct stat *statbuf) = 0;
+	/**
+	 * stat that fetches only the fields in mask (STATX_*), flags are the
+	 * AT_* flags of statx(2) - AT_SYMLINK_NOFOLLOW and the sync mode.
+	 * A storage without statx returns all fields.
+	 */
+	virtual int statx(const std::string &path, int flags, unsigned int mask,
+	                  struct stat *statbuf);
+	virtual int access(const std::string &path, int mask) = 0;
+	virtual int statvfs(const std::string &path, struct statvfs *statv) = 0;
+
+	virtual int mkdir(const std::string &path, mode_t mode) = 0;
+	/** Create path and all its missing parents (mkdir -p) */
+	int mkdirs(const std::string &path, mode_t mode);
+	virtual int unlink(const std::string &path) = 0;
+	virtual int rmdir(const std::string &path) = 0;
+	virtual int rename(const std::string &from, const std::string &to) = 0;
+	virtual int chmod(const std::string &path, mode_t mode) = 0;
+	virtual int truncate(const std::string &path, off_t size) = 0;
+	virtual int utimens(const std::string &path, const struct timespec tv[2]) = 0;
+
+	/**
+	 * The extended attributes of path (getxattr(2) and friends), symlinks
+	 * are not followed. A storage without xattrs returns -ENOTSUP.
+	 */
+	virtual int getxattr(const std::string &path, const char *name, char *value, size_t size);
+	virtual int setxattr(const std::string &path, const char *name, const char *value,
+	                     size_t size, int flags);
+	virtual int listxattr(const std::string &path, char *list, size_t size);
+	virtual int removexattr(const std::string &path, const char *name);
+
+	/** Open a file, returns the handle for the calls below */
+	virtual int open(const std::string &path, int flags, mode_t mode = 0) = 0;
+	virtual int close(int fh) = 0;
+	virtual ssize_t pread(int fh, void *buf, size_t size, off_t offset) = 0;
+	virtual ssize_t pwrite(int fh, const void *buf, size_t size, off_t offset) = 0;
+	virtual int fsync(int fh) = 0;
+	/**
+	 * The next data (SEEK_DATA) or hole (SEEK_HOLE) at or after offset,
+	 * -ENXIO beyond the end. A storage that knows no holes has data up to
+	 * the end of the file.
+	 */
+	virtual off_t lseek(int fh, off_t offset, int whence) = 0;
+	/**
+	 * Start reading size bytes at offset into the cache and return without
+	 * waiting for them. A storage without a cache does nothing.
+	 */
+	virtual int readahead(int /*fh*/, off_t /*offset*/, size_t /*size*/) { return 0; }
+	/**
+	 * Copy size bytes between two open files without passing them through
+	 * mammutfs - the raid may even share the blocks (reflink). Returns the
+	 * bytes copied, which may be less than size.
+	 */
+	virtual ssize_t copy_file_range(int fh_in, off_t offset_in,
+	                                int fh_out, off_t offset_out, size_t size) = 0;
+
+	/**
+	 * A directory entry, its attributes (as lstat returns them) or nullptr
+	 * and the offset the listing continues at after it. Return false to
+	 * stop the listing - before this entry.
+	 */
+	using dir_filler = std::function<bool(const char *name, const struct stat *st, off_t next)>;
+
+	/** Open a directory, dir is the handle for the calls below */
+	virtual int opendir(const std::string &path, void *&dir) = 0;
+	/**
+	 * List the entries of dir, including "." and "..", starting at offset:
+	 * 0 for the start or the next of an entry of an earlier call. Offsets
+	 * stay valid while entries are added or removed.
+	 * With attrs (STATX_*, and the statx sync mode) the entries come with
+	 * these attributes where possible, 0 lists only the names.
+	 */
+	virtual int readdir(void *dir, off_t offset, const dir_filler &filler,
+	                    unsigned int attrs = 0, int sync = 0) = 0;
+	virtual int closedir(void *dir) = 0;
+};
+
+
+/**
+ * The files on the raids - plain syscalls.
+ *
+ * Every root is kept open as an O_PATH dirfd. Paths below a root are
+ * resolved by the *at() syscalls relative to it: the kernel does not walk
+ * the raid prefix again for every call, and openat2 with RESOLVE_BENEATH |
+ * RESOLVE_NO_SYMLINKS guarantees that no symlink - not even one swapped in
+ * while the call runs - leads out of the home.
+ * Paths outside of all roots use the plain syscalls.
+ */
+class PosixStorage : public Storage {
+public:
+	~PosixStorage();
+
+	bool is_native() const override { return true; }
+
+	void add_root(const std::string &root) override;
+	int root_fd(const std::string &path, std::string &rel) override;
+
+	int stat(const std::string &path, struct stat *statbuf) override;
+	int lstat(const std::string &path, struct stat *statbuf) override;
+	int statx(const std::string &path, int flags, unsigned int mask,
+	          struct stat *statbuf) override;
+	int access(const std::string &path, int mask) override;
+	int statvfs(const std::string &path, struct statvfs *statv) override;
+
+	int mkdir(const std::string &path, mode_t mode) override;
+	int unlink(const std::string &path) override;
+	int rmdir(const std::string &path) override;
+	int rename(const std::string &from, const std::string &to) override;
+	int chmod(const std::string &path, mode_t mode) override;
+	int truncate(const std::string &path, off_t size) override;
+	int utimens(const std::string &path, const struct timespec tv[2]) override;
+
+	int getxattr(const std::string &path, const char *name, char *value, size_t size) override;
+	int setxattr(const std::string &path, const char *name, const char *value,
+	             size_t size, int flags) override;
+	int listxattr(const std::string &path, char *list, size_t size) override;
+	int removexattr(const std::string &path, const char *name) override;
+
+	int open(const std::string &path, int flags, mode_t mode = 0) override;
+	int close(int fh) override;
+	ssize_t pread(int fh, void *buf, size_t size, off_t offset) override;
+	ssize_t pwrite(int fh, const void *buf, size_t size, off_t offset) override;
+	int fsync(int fh) override;
+	off_t lseek(int fh, off_t offset, int whence) override;
+	int readahead(int fh, off_t offset, size_t size) override;
+	ssize_t copy_file_range(int fh_in, off_t offset_in,
+	                        int fh_out, off_t offset_out, size_t size) override;
+
+	int opendir(const std::string &path, void *&dir) override;
+	int readdir(void *dir, off_t offset, const dir_filler &filler,
+	            unsigned int attrs = 0, int sync = 0) override;
+	int closedir(void *dir) override;
+
+private:
+	struct root_t {
+		std::string path;
+		int fd;
+	};
+	using roots_t = std::vector<root_t>;
+
+	/** Replaced as a whole on add_root, so lookups need no lock */
+	std::shared_ptr<const roots_t> roots;
+	std::mutex roots_mux;
+
+	/**
+	 * Where the last component of a path lives: the directory to pass to
+	 * the *at() syscalls and the name within it.
+	 */
+	struct at_t {
+		int dirfd;
+		/** Points into the path or the scratch string given to resolve */
+		const char *name;
+		/** dirfd was opened for this path and has to be closed */
+		bool owned;
+
+		at_t() : dirfd(-1), name(nullptr), owned(false) {}
+		at_t(const at_t &) = delete;
+		~at_t();
+	};
+
+	/**
+	 * The root path is below, rel is set to path relative to it.
+	 * Returns AT_FDCWD and path itself if path is outside of all roots.
+	 */
+	int split_root(const std::string &path, std::string &rel);
+
+	/**
+	 * Open the directory that contains path (see at_t).
+	 * scratch holds the relative path and has to outlive at.
+	 */
+	int resolve(const std::string &path, std::string &scratch, at_t &at);
+
+	/**
+	 * Like resolve, but a nested path is opened itself (O_PATH, not
+	 * followed) instead of its directory: at.name is "" and the call has
+	 * to pass AT_EMPTY_PATH. The walk beneath the root is the only lookup,
+	 * no directory is opened on the way.
+	 */
+	int resolve_file(const std::string &path, std::string &scratch, at_t &at);
+
+	/** An open directory, see readdir */
+	struct dir_t;
+
+	/** openat below dirfd, without following any symlink */
+	static int open_beneath(int dirfd, const char *rel, int flags, mode_t mode);
+
+	/**
+	 * There are no *at() xattr syscalls: below a root the file is opened
+	 * O_PATH beneath it and scratch becomes its /proc/self/fd path, fd has
+	 * to be closed. Outside of all roots scratch is path and fd is -1.
+	 */
+	int xattr_path(const std::string &path, std::string &scratch, int &fd);
+};
+
+}
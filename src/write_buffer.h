@@ -0,0 +1,302 @@
+#pragma once
+
+#include "fd_cache.h"
+#include "mammut_config.h"
+#include "storage.h"
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+
+namespace mammutfs {
+
+class WriteBuffer;
+
+/**
+ * The memory all write buffers of this process may take together.
+ *
+ * It also indexes the buffers that hold data by the path of their file, so
+ * a request on a path finds what other handles buffered for it without
+ * looking at every open file.
+ */
+class WriteBudget {
+public:
+	/** The budget of this process, "write_buffer_memory" bytes */
+	static std::shared_ptr<WriteBudget> shared(const std::shared_ptr<MammutConfig> &config) {
+		static std::mutex mux;
+		static std::shared_ptr<WriteBudget> budget;
+
+		std::lock_guard<std::mutex> lock(mux);
+		if (!budget) {
+			size_t max = 64 << 20;
+			config->lookupValue("write_buffer_memory", max, true);
+			budget = std::make_shared<WriteBudget>(max);
+		}
+		return budget;
+	}
+
+	explicit WriteBudget(size_t max) : max(max) {}
+
+	/** Take size bytes, false if that would exceed the budget */
+	bool take(size_t size) {
+		size_t used = this->used.load();
+		do {
+			if (used + size > this->max) {
+				return false;
+			}
+		} while (!this->used.compare_exchange_weak(used, used + size));
+		return true;
+	}
+
+	void give(size_t size) {
+		this->used -= size;
+	}
+
+	size_t in_use() const {
+		return this->used.load();
+	}
+
+	/** If any buffer holds data that was not written yet - without a lock */
+	bool dirty() const {
+		return this->dirty_count.load(std::memory_order_relaxed) > 0;
+	}
+
+	/**
+	 * Add the buffers of path that hold data to buffers. Buffers that are
+	 * being destroyed are left out, they are written by their owner.
+	 */
+	void dirty_buffers(const std::string &path,
+	                   std::vector<std::shared_ptr<WriteBuffer>> &buffers);
+
+private:
+	friend class WriteBuffer;
+
+	/** A buffer started or stopped holding data */
+	void mark_dirty(WriteBuffer *buffer, bool dirty);
+
+	const size_t max;
+	std::atomic<size_t> used { 0 };
+
+	/**
+	 * The dirty buffers, hashed by their path into lists that are linked
+	 * through the buffers - marking a buffer dirty allocates nothing.
+	 */
+	static const size_t DIRTY_BUCKETS = 1024;
+	std::mutex dirty_mux;
+	WriteBuffer *dirty_index[DIRTY_BUCKETS] = {};
+	/** Changed under dirty_mux, read by dirty() without */
+	std::atomic<size_t> dirty_count { 0 };
+};
+
+
+/**
+ * Small writes to an open file, merged into few large ones.
+ *
+ * SFTP and smb clients write in small pieces, and on cephfs every write
+ * costs capability traffic and a tiny object update. Contiguous writes are
+ * collected and written once the buffer is full, in pieces that end at a
+ * multiple of its size - so the writes are aligned after the first one.
+ * A write that does not continue the buffer writes it out first.
+ *
+ * Errors of writes that were buffered are kept until they are taken - by
+ * flush, fsync or release.
+ *
+ * Other handles of the file write the buffer out before they look at the
+ * file, they find it in the index of the budget while it holds data.
+ */
+class WriteBuffer : public std::enable_shared_from_this<WriteBuffer> {
+public:
+	/**
+	 * A buffer of size bytes for the file at path, nullptr if the budget
+	 * has no room for it
+	 */
+	static std::unique_ptr<WriteBuffer> create(size_t size,
+	                                           const std::shared_ptr<WriteBudget> &budget,
+	                                           const std::string &path) {
+		// A full buffer takes one more write before it is written out
+		if (size == 0 || !budget->take(2 * size)) {
+			return nullptr;
+		}
+		return std::unique_ptr<WriteBuffer>(new WriteBuffer(size, budget, path));
+	}
+
+	~WriteBuffer() {
+		this->set_buffered(0);
+		this->budget->give(2 * this->size);
+	}
+
+	WriteBuffer(const WriteBuffer &) = delete;
+	WriteBuffer &operator=(const WriteBuffer &) = delete;
+
+	/** Guards the buffer, writes of a file are kept in order by it */
+	std::mutex mux;
+
+	/** The file the buffer belongs to */
+	const std::string path;
+
+	/**
+	 * The fd cache entry of the file, until its fd is closed: other handles
+	 * write the buffer through that fd. Guarded by mux.
+	 */
+	FdCache::entry_t *owner = nullptr;
+
+	/** Bytes not written yet - without the lock, to skip empty buffers */
+	size_t pending() const {
+		return this->buffered.load(std::memory_order_relaxed);
+	}
+
+	/** If the buffer should be written out */
+	bool full() const {
+		return this->data.size() >= this->size;
+	}
+
+	/**
+	 * Add a write, if it is small and continues the buffer.
+	 * False if it was not added, has to be called locked.
+	 */
+	bool append(const char *buf, size_t size, off_t offset) {
+		if (size >= this->size
+		    || (!this->data.empty()
+		        && offset != this->offset + static_cast<off_t>(this->data.size()))) {
+			return false;
+		}
+		if (this->data.empty()) {
+			this->offset = offset;
+		}
+		this->data.insert(this->data.end(), buf, buf + size);
+		this->set_buffered(this->data.size());
+		return true;
+	}
+
+	/**
+	 * Write the buffer to fd - all of it, or only up to the last multiple of
+	 * the buffer size. A failed write is dropped and its error kept.
+	 * Has to be called locked.
+	 */
+	int write(Storage *storage, int fd, bool all) {
+		size_t count = this->data.size();
+		if (!all) {
+			off_t end = this->offset + count;
+			off_t aligned = end / this->size * this->size;
+			count = aligned > this->offset ? aligned - this->offset : 0;
+		}
+
+		int retstat = 0;
+		size_t done = 0;
+		while (done < count) {
+			ssize_t res = storage->pwrite(fd, this->data.data() + done,
+			                              count - done, this->offset + done);
+			if (res <= 0) {
+				retstat = res < 0 ? res : -EIO;
+				if (this->error == 0) {
+					this->error = retstat;
+				}
+				break;
+			}
+			done += res;
+		}
+
+		// The rest stays at the front, the capacity is kept
+		this->data.erase(this->data.begin(), this->data.begin() + count);
+		this->offset += count;
+		this->set_buffered(this->data.size());
+		return retstat;
+	}
+
+	/** The first error nobody was told about yet, 0 if there was none */
+	int take_error() {
+		int error = this->error;
+		this->error = 0;
+		return error;
+	}
+
+private:
+	friend class WriteBudget;
+
+	WriteBuffer(size_t size, const std::shared_ptr<WriteBudget> &budget,
+	            const std::string &path) :
+		path(path),
+		size(size),
+		budget(budget),
+		bucket(bucket_of(path)) {
+		this->data.reserve(2 * size);
+	}
+
+	/** Where the buffers of path are in the index of the budget */
+	static size_t bucket_of(const std::string &path) {
+		return std::hash<std::string>()(path) % WriteBudget::DIRTY_BUCKETS;
+	}
+
+	/** Publish the pending bytes, the budget indexes the dirty buffers */
+	void set_buffered(size_t size) {
+		size_t before = this->buffered.exchange(size, std::memory_order_relaxed);
+		if ((before == 0) != (size == 0)) {
+			this->budget->mark_dirty(this, size != 0);
+		}
+	}
+
+	const size_t size;
+	std::shared_ptr<WriteBudget> budget;
+
+	/** The list of the budget while the buffer is dirty, see mark_dirty */
+	const size_t bucket;
+	WriteBuffer *dirty_prev = nullptr;
+	WriteBuffer *dirty_next = nullptr;
+
+	std::vector<char> data;
+	/** Where data starts in the file */
+	off_t offset = 0;
+	std::atomic<size_t> buffered { 0 };
+	int error = 0;
+};
+
+
+inline void WriteBudget::mark_dirty(WriteBuffer *buffer, bool dirty) {
+	std::lock_guard<std::mutex> lock(this->dirty_mux);
+	WriteBuffer *&head = this->dirty_index[buffer->bucket];
+	if (dirty) {
+		buffer->dirty_prev = nullptr;
+		buffer->dirty_next = head;
+		if (head != nullptr) {
+			head->dirty_prev = buffer;
+		}
+		head = buffer;
+		this->dirty_count.fetch_add(1, std::memory_order_relaxed);
+	} else {
+		if (buffer->dirty_prev != nullptr) {
+			buffer->dirty_prev->dirty_next = buffer->dirty_next;
+		} else {
+			head = buffer->dirty_next;
+		}
+		if (buffer->dirty_next != nullptr) {
+			buffer->dirty_next->dirty_prev = buffer->dirty_prev;
+		}
+		buffer->dirty_prev = nullptr;
+		buffer->dirty_next = nullptr;
+		this->dirty_count.fetch_sub(1, std::memory_order_relaxed);
+	}
+}
+
+
+inline void WriteBudget::dirty_buffers(const std::string &path,
+                                       std::vector<std::shared_ptr<WriteBuffer>> &buffers) {
+	size_t bucket = WriteBuffer::bucket_of(path);
+	std::lock_guard<std::mutex> lock(this->dirty_mux);
+	for (WriteBuffer *b = this->dirty_index[bucket]; b != nullptr; b = b->dirty_next) {
+		if (b->path != path) {
+			continue;
+		}
+		// Fails once the destructor runs, that unlinks it right after
+		auto buffer = b->weak_from_this().lock();
+		if (buffer) {
+			buffers.push_back(std::move(buffer));
+		}
+	}
+}
+
+}
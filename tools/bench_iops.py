@@ -0,0 +1,181 @@
+#!/usr/bin/env python3
+"""
+Measure the aggregate IOPS of a mounted mammutfs with a rising number of
+concurrent clients.
+
+Every client is a separate process, hammering a set of files below the given
+directory for a fixed amount of time. The total number of completed operations
+is reported for every client count, so the scaling of the configured
+`fuse_threads` becomes visible:
+
+    ./bench_iops.py /tmp/mammut-fuse/mnt/private --clients 16 --op stat
+
+Run it once against a mount with `fuse_threads = "1"` and once with a higher
+value to compare both.
+
+The same way the io backends of the lowlevel engine are compared: mount once
+with `io_backend = "sync"` and once with `io_backend = "uring"` and run the
+`getattr`, `read` and `write` ops against both. The uring backend is only
+used for modules that are plain path translators (private, backup).
+
+The cost of a single call through mammutfs shows in the us/op column of a
+single client. `seqread` and `seqwrite` keep their files open and move
+through them like a file transfer over SMB does, so only the handle bound
+read / write calls are measured:
+
+    ./bench_iops.py /tmp/mammut-fuse/mnt/private --clients 1 \
+        --op seqwrite --size 131072
+"""
+
+import argparse
+import multiprocessing
+import os
+import time
+
+OPS = {}
+
+
+def op(name):
+    def register(f):
+        OPS[name] = f
+        return f
+    return register
+
+
+@op("stat")
+def op_stat(path, _):
+    # files that do not exist are never cached by the kernel, so every single
+    # operation reaches mammutfs.
+    try:
+        os.lstat(path + ".bench-missing")
+    except FileNotFoundError:
+        pass
+
+
+@op("getattr")
+def op_getattr(path, _):
+    os.lstat(path)
+
+
+@op("open")
+def op_open(path, _):
+    fd = os.open(path, os.O_RDONLY)
+    os.close(fd)
+
+
+@op("read")
+def op_read(path, size):
+    fd = os.open(path, os.O_RDONLY)
+    try:
+        os.pread(fd, size, 0)
+    finally:
+        os.close(fd)
+
+
+@op("write")
+def op_write(path, size):
+    fd = os.open(path, os.O_WRONLY)
+    try:
+        os.pwrite(fd, b"\0" * size, 0)
+    finally:
+        os.close(fd)
+
+
+# The files of the sequential ops stay open: path -> [fd, offset]
+SEQ_FILES = {}
+# Where the sequential ops start over
+SEQ_SPAN = 64 * 1024 * 1024
+
+
+def seq_file(path, flags):
+    entry = SEQ_FILES.get(path)
+    if entry is None:
+        entry = SEQ_FILES[path] = [os.open(path, flags), 0]
+    return entry
+
+
+@op("seqread")
+def op_seqread(path, size):
+    entry = seq_file(path, os.O_RDONLY)
+    data = os.pread(entry[0], size, entry[1])
+    entry[1] = entry[1] + size if len(data) == size else 0
+
+
+@op("seqwrite")
+def op_seqwrite(path, size):
+    entry = seq_file(path, os.O_WRONLY)
+    os.pwrite(entry[0], b"\0" * size, entry[1])
+    entry[1] = (entry[1] + size) % SEQ_SPAN
+
+
+def prepare(directory, count, size):
+    files = []
+    for i in range(count):
+        path = os.path.join(directory, "bench-{:04d}".format(i))
+        if not os.path.exists(path):
+            with open(path, "wb") as f:
+                f.write(b"\0" * size)
+        files.append(path)
+    return files
+
+
+def client(files, opname, size, duration, result):
+    fn = OPS[opname]
+    count = 0
+    end = time.monotonic() + duration
+    while time.monotonic() < end:
+        for path in files:
+            fn(path, size)
+        count += len(files)
+    result.put(count)
+
+
+def run(files, opname, size, duration, clients):
+    result = multiprocessing.Queue()
+    procs = []
+    for i in range(clients):
+        # every client works on its own slice, so they do not serialize on
+        # the same inodes in the kernel
+        own = files[i::clients] or files
+        p = multiprocessing.Process(target=client,
+                                    args=(own, opname, size, duration, result))
+        p.start()
+        procs.append(p)
+    total = sum(result.get() for _ in procs)
+    for p in procs:
+        p.join()
+    return total / duration
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("directory", help="writable directory within the mount")
+    parser.add_argument("--clients", type=int, default=8,
+                        help="maximum number of concurrent clients")
+    parser.add_argument("--op", choices=sorted(OPS.keys()), default="stat")
+    parser.add_argument("--files", type=int, default=64)
+    parser.add_argument("--size", type=int, default=4096,
+                        help="size of the files and of every read")
+    parser.add_argument("--duration", type=float, default=5.0,
+                        help="seconds per measurement")
+    args = parser.parse_args()
+
+    files = prepare(args.directory, args.files, args.size)
+
+    print("{:>8} {:>12} {:>8} {:>10}".format("clients", "IOPS", "scaling", "us/op"))
+    base = None
+    clients = 1
+    while clients <= args.clients:
+        iops = run(files, args.op, args.size, args.duration, clients)
+        if base is None:
+            base = iops
+        # the time a single client waited for every call
+        latency = clients / iops * 1e6 if iops else float("inf")
+        print("{:>8} {:>12.0f} {:>7.2f}x {:>10.1f}".format(clients, iops, iops / base,
+                                                          latency))
+        clients *= 2
+
+
+if __name__ == "__main__":
+    main()
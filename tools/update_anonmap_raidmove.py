@@ -11,6 +11,7 @@ if len(sys.argv) < 3:
 
 anonmapfile = "/etc/mammutfs/anon.map"
 outfile = "/etc/mammutfs/new.anon.map"
+indexfile = "/etc/mammutfs/raid.index"
 
 fullvol = sys.argv[1]
 freevol = sys.argv[2]
@@ -32,3 +33,13 @@ os.rename(anonmapfile,
           "/etc/mammutfs/anon.map_backups/anon.map."
           + datetime.now().replace(microsecond=0).isoformat())
 os.rename(outfile, anonmapfile)
+
+# The mounts of the user pick up the new raid from the index
+if os.path.exists(indexfile):
+    with open(indexfile + ".new", "w+") as newfd:
+        with open(indexfile) as index:
+            for line in index:
+                if line.rstrip().rstrip('/').split('/')[-1] == user:
+                    line = line.replace(fullvol, freevol, 1)
+                newfd.write(line)
+    os.rename(indexfile + ".new", indexfile)